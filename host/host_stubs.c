@@ -0,0 +1,47 @@
+/*
+ * Kernel services that mem.c and vm.c call, for the host build.
+ */
+#include "klog.h"
+#include "panic.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+uint64_t host_satp;
+
+// Warnings such as "no free pages" are expected under memory pressure; count them.
+int klog_threshold = KLOG_ERR;
+uint64_t host_klog_dropped;
+
+void klog_emit(int level, const char *fmt, const uint64_t *args, unsigned int nargs) {
+    if (level > klog_threshold) {
+        host_klog_dropped++;
+        return;
+    }
+    // Formats only use integer conversions with 64-bit arguments.
+    fprintf(stderr, "klog %d: %s", level, fmt);
+    for (unsigned int i = 0; i < nargs; i++) {
+        fprintf(stderr, " 0x%llx", (unsigned long long)args[i]);
+    }
+    fputc('\n', stderr);
+}
+
+void klog_drain(unsigned int budget) {
+    (void)budget;
+}
+
+void klog_flush(void) {}
+
+void page_zero(void *page) {
+    memset(page, 0, 4096);
+}
+
+void page_copy(void *dst, const void *src) {
+    memcpy(dst, src, 4096);
+}
+
+void panic(const char *msg) {
+    fprintf(stderr, "Kernel Panic: %s\n", msg);
+    abort();
+}
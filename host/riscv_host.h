@@ -0,0 +1,68 @@
+#ifndef RISCV_HOST_H
+#define RISCV_HOST_H
+
+/*
+ * Host stand-ins for the hart primitives in src/riscv.h, used when mem.c and
+ * vm.c are built natively with CHIMERA_HOST. Everything runs as hart 0 with
+ * "interrupts" permanently off; satp is a plain variable and TLB maintenance
+ * is a no-op. The counters come from the host's monotonic clock.
+ */
+#include <stdint.h>
+#include <time.h>
+
+static inline uint64_t host_clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000UL + (uint64_t)ts.tv_nsec;
+}
+
+static inline uint64_t r_sstatus(void) {
+    return 0;
+}
+
+static inline void w_sstatus(uint64_t x) {
+    (void)x;
+}
+
+// Ticks at 10 MHz (TIMER_HZ_DEFAULT), like the virt machine's time CSR.
+static inline uint64_t r_time(void) {
+    return host_clock_ns() / 100;
+}
+
+static inline uint64_t r_cycle(void) {
+    return host_clock_ns();
+}
+
+static inline uint64_t r_instret(void) {
+    return 0;
+}
+
+static inline uint64_t cpuid(void) {
+    return 0;
+}
+
+static inline uint64_t intr_save(void) {
+    return 0;
+}
+
+static inline void intr_restore(uint64_t saved) {
+    (void)saved;
+}
+
+// All 16 ASID bits "stick", as on a hart that implements them.
+extern uint64_t host_satp;
+
+static inline uint64_t r_satp(void) {
+    return host_satp;
+}
+
+static inline void w_satp(uint64_t x) {
+    host_satp = x;
+}
+
+static inline void sfence_vma_all(void) {}
+static inline void sfence_vma_asid(uint64_t asid) { (void)asid; }
+static inline void sfence_vma_page(uint64_t va) { (void)va; }
+static inline void sfence_vma_page_asid(uint64_t va, uint64_t asid) { (void)va; (void)asid; }
+
+#endif // RISCV_HOST_H
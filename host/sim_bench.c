@@ -0,0 +1,614 @@
+/*
+ * Host simulation benchmark for the physical frame allocator (src/mem.c)
+ * and the Sv39 page-table code (src/vm.c), built natively by `make sim`.
+ *
+ * The kernel sources run unmodified over a simulated physical arena: a
+ * MAP_NORESERVE host mapping aligned like RAM, so "physical" addresses are
+ * host pointers. A trace of allocations and mappings is either generated
+ * (a steady-state churn around a target occupancy) or loaded from a file,
+ * then replayed with every operation timed. The report covers throughput
+ * and latency per operation type, buddy fragmentation, and page-table
+ * memory overhead.
+ *
+ * Trace format, one operation per line:
+ *   A <id> <order>             allocate 2^order frames into slot <id>
+ *   F <id>                     free slot <id>
+ *   M <id> <as> <va> <pages>   map fresh frames at <va> in address space <as>
+ *   U <id>                     unmap region <id>
+ *
+ * Host memory: if the simulated RAM fits comfortably in host RAM it is
+ * pre-faulted, so timings contain no host page faults. Otherwise (or with
+ * -r) only pages the allocator writes become resident, and frames that are
+ * still allocated are handed back to the host every SIM_EPOCH_PAGES pages.
+ * The resident set then stays near metadata + page tables + touched free
+ * memory, but operations that write to handed-back frames (frees, unmap)
+ * pay for host page faults; the report gives the fault count.
+ */
+#define _GNU_SOURCE
+#include "mem.h"
+#include "vm.h"
+#include "riscv.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#define SIM_MAX_AS       1024
+#define SIM_AS_SLOTS     4096                 // 2 MiB VA slots per address space (8 GiB).
+#define SIM_VA_BASE      0x100000000UL
+#define SIM_EPOCH_PAGES  65536                // Pages handed out between host memory releases.
+#define SIM_LAT_BUCKETS  40                   // log2(ns) latency histogram.
+
+#define SIM_MAP_FLAGS (PTE_R | PTE_W | PTE_U | PTE_A | PTE_D | PTE_OWNED)
+
+enum op_type { OP_ALLOC, OP_FREE, OP_MAP, OP_UNMAP, OP_NTYPES };
+
+static const char *const op_names[OP_NTYPES] = { "alloc", "free", "map", "unmap" };
+
+struct op {
+    uint8_t type;
+    uint8_t order;
+    uint16_t as;
+    uint32_t npages;
+    uint32_t id;
+    uint64_t va;
+};
+
+struct region {
+    uint64_t va;
+    uint32_t npages;
+    uint16_t as;
+    uint8_t live;
+};
+
+struct block {
+    void *pa;
+    uint8_t order;
+};
+
+struct lat_stats {
+    uint64_t count;
+    uint64_t pages;
+    uint64_t failed;
+    uint64_t total_ns;
+    uint64_t hist[SIM_LAT_BUCKETS];
+};
+
+static struct op *ops;
+static uint64_t nops, ops_cap;
+static uint32_t nslots, nregions;     // Id space used by the trace.
+
+static struct block *blocks;
+static struct region *regions;
+static pagetable_t as_root[SIM_MAX_AS];
+static uint32_t nas;
+
+static struct lat_stats lat[OP_NTYPES];
+
+/*
+ * Release mode: blocks and regions created since the last release, and
+ * scratch space for the host ranges they cover.
+ */
+static int release_mode;
+static uint32_t *epoch_ids;     // Block ids, then region ids with the top bit set.
+static uint64_t nepoch_ids, epoch_pages;
+
+struct range {
+    uint64_t start;
+    uint64_t len;
+};
+static struct range *epoch_ranges;
+static uint64_t nepoch_ranges, epoch_ranges_cap;
+
+#define EPOCH_REGION (1U << 31)
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15UL;
+
+static uint64_t rng(void) {
+    uint64_t x = rng_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    rng_state = x;
+    return x * 0x2545f4914f6cdd1dUL;
+}
+
+static void *xrealloc(void *p, size_t n) {
+    p = realloc(p, n);
+    if (!p) {
+        fprintf(stderr, "out of host memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static void push_op(struct op op) {
+    if (nops == ops_cap) {
+        ops_cap = ops_cap ? ops_cap * 2 : 1 << 20;
+        ops = xrealloc(ops, ops_cap * sizeof(*ops));
+    }
+    ops[nops++] = op;
+}
+
+// --- Trace generation ---
+
+// Frames per allocation: mostly single pages, with a tail of larger blocks.
+static unsigned int gen_order(void) {
+    uint64_t r = rng() % 1000;
+    if (r < 800) return 0;
+    if (r < 880) return 1;
+    if (r < 930) return 2;
+    if (r < 960) return 3;
+    if (r < 990) return 4 + rng() % 5;
+    return 9 + rng() % 2;
+}
+
+static uint32_t gen_region_pages(void) {
+    uint64_t r = rng() % 100;
+    if (r < 60) return 1 + rng() % 16;
+    if (r < 90) return 17 + rng() % 112;
+    return 129 + rng() % 384;
+}
+
+/*
+ * Steady-state churn: allocate and map while below the target occupancy,
+ * free and unmap above it, with a bias so both kinds always occur.
+ */
+static void generate(uint64_t n, uint64_t target_pages) {
+    // Every operation creates at most one block or region.
+    uint32_t *live_blocks = xrealloc(NULL, n * sizeof(uint32_t));
+    uint32_t *live_regions = xrealloc(NULL, n * sizeof(uint32_t));
+    uint32_t *block_pos = xrealloc(NULL, n * sizeof(uint32_t));
+    uint32_t *region_pos = xrealloc(NULL, n * sizeof(uint32_t));
+    uint8_t *block_order = xrealloc(NULL, n);
+    struct region *gen_regions = xrealloc(NULL, n * sizeof(struct region));
+    uint64_t nlive_blocks = 0, nlive_regions = 0;
+    uint64_t used = 0;
+    static uint8_t slot_used[SIM_MAX_AS][SIM_AS_SLOTS];
+
+    for (uint64_t i = 0; i < n; i++) {
+        int grow;
+        if (used < target_pages - target_pages / 50) {
+            grow = rng() % 100 < 80;
+        } else if (used > target_pages) {
+            grow = rng() % 100 < 20;
+        } else {
+            grow = rng() % 2;
+        }
+
+        if (grow && rng() % 100 < 70) {
+            struct op op = { .type = OP_ALLOC, .order = gen_order(), .id = nslots++ };
+            block_order[op.id] = op.order;
+            block_pos[op.id] = nlive_blocks;
+            live_blocks[nlive_blocks++] = op.id;
+            used += 1UL << op.order;
+            push_op(op);
+        } else if (grow) {
+            uint16_t as = rng() % nas;
+            uint32_t slot = rng() % SIM_AS_SLOTS;
+            for (uint32_t probe = 0; probe < SIM_AS_SLOTS && slot_used[as][slot]; probe++) {
+                slot = (slot + 1) % SIM_AS_SLOTS;
+            }
+            if (slot_used[as][slot]) {
+                continue;
+            }
+            slot_used[as][slot] = 1;
+            uint32_t pages = gen_region_pages();
+            uint64_t off = rng() % (512 - pages + 1);
+            struct op op = { .type = OP_MAP, .as = as, .npages = pages, .id = nregions++,
+                             .va = SIM_VA_BASE + slot * MEGAPAGE_SIZE + off * PAGE_SIZE };
+            gen_regions[op.id] = (struct region){ .va = op.va, .npages = pages, .as = as };
+            region_pos[op.id] = nlive_regions;
+            live_regions[nlive_regions++] = op.id;
+            used += pages;
+            push_op(op);
+        } else if (nlive_blocks && (rng() % 100 < 70 || !nlive_regions)) {
+            uint32_t id = live_blocks[rng() % nlive_blocks];
+            uint32_t last = live_blocks[--nlive_blocks];
+            live_blocks[block_pos[id]] = last;
+            block_pos[last] = block_pos[id];
+            used -= 1UL << block_order[id];
+            push_op((struct op){ .type = OP_FREE, .id = id });
+        } else if (nlive_regions) {
+            uint32_t id = live_regions[rng() % nlive_regions];
+            uint32_t last = live_regions[--nlive_regions];
+            live_regions[region_pos[id]] = last;
+            region_pos[last] = region_pos[id];
+            struct region *r = &gen_regions[id];
+            slot_used[r->as][(r->va - SIM_VA_BASE) / MEGAPAGE_SIZE] = 0;
+            used -= r->npages;
+            push_op((struct op){ .type = OP_UNMAP, .id = id });
+        }
+    }
+    free(live_blocks);
+    free(block_pos);
+    free(live_regions);
+    free(region_pos);
+    free(block_order);
+    free(gen_regions);
+}
+
+static int load_trace(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    char line[256];
+    uint64_t lineno = 0;
+    while (fgets(line, sizeof(line), f)) {
+        struct op op = { 0 };
+        unsigned int id, order, as, pages;
+        unsigned long long va;
+        lineno++;
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        } else if (sscanf(line, "A %u %u", &id, &order) == 2 && order <= PFA_MAX_ORDER) {
+            op = (struct op){ .type = OP_ALLOC, .id = id, .order = order };
+        } else if (sscanf(line, "F %u", &id) == 1) {
+            op = (struct op){ .type = OP_FREE, .id = id };
+        } else if (sscanf(line, "M %u %u %llx %u", &id, &as, &va, &pages) == 4 &&
+                   as < SIM_MAX_AS && va % PAGE_SIZE == 0 && va < VM_USER_END) {
+            op = (struct op){ .type = OP_MAP, .id = id, .as = as, .va = va, .npages = pages };
+            if (as + 1 > nas) {
+                nas = as + 1;
+            }
+        } else if (sscanf(line, "U %u", &id) == 1) {
+            op = (struct op){ .type = OP_UNMAP, .id = id };
+        } else {
+            fprintf(stderr, "%s:%llu: bad trace line\n", path, (unsigned long long)lineno);
+            fclose(f);
+            return -1;
+        }
+        if (op.type == OP_ALLOC || op.type == OP_FREE) {
+            nslots = (id + 1 > nslots) ? id + 1 : nslots;
+        } else {
+            nregions = (id + 1 > nregions) ? id + 1 : nregions;
+        }
+        push_op(op);
+    }
+    fclose(f);
+    return 0;
+}
+
+static int save_trace(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    for (uint64_t i = 0; i < nops; i++) {
+        struct op *op = &ops[i];
+        switch (op->type) {
+        case OP_ALLOC:
+            fprintf(f, "A %u %u\n", op->id, op->order);
+            break;
+        case OP_FREE:
+            fprintf(f, "F %u\n", op->id);
+            break;
+        case OP_MAP:
+            fprintf(f, "M %u %u %llx %u\n", op->id, op->as, (unsigned long long)op->va,
+                    op->npages);
+            break;
+        case OP_UNMAP:
+            fprintf(f, "U %u\n", op->id);
+            break;
+        }
+    }
+    return fclose(f);
+}
+
+// --- Replay ---
+
+static void epoch_add(uint64_t start, uint64_t len) {
+    if (nepoch_ranges == epoch_ranges_cap) {
+        epoch_ranges_cap = epoch_ranges_cap ? epoch_ranges_cap * 2 : 1 << 16;
+        epoch_ranges = xrealloc(epoch_ranges, epoch_ranges_cap * sizeof(*epoch_ranges));
+    }
+    epoch_ranges[nepoch_ranges++] = (struct range){ start, len };
+}
+
+static int range_cmp(const void *a, const void *b) {
+    const struct range *x = a, *y = b;
+    return (x->start > y->start) - (x->start < y->start);
+}
+
+/*
+ * Give the host back the frames handed out since the last release that are
+ * still allocated: their contents are never read again, while free frames
+ * may hold list headers and must stay.
+ */
+static void epoch_release(void) {
+    nepoch_ranges = 0;
+    for (uint64_t i = 0; i < nepoch_ids; i++) {
+        uint32_t id = epoch_ids[i] & ~EPOCH_REGION;
+        if (!(epoch_ids[i] & EPOCH_REGION)) {
+            struct block *b = &blocks[id];
+            if (b->pa) {
+                epoch_add((uint64_t)b->pa, PAGE_SIZE << b->order);
+            }
+            continue;
+        }
+        struct region *r = &regions[id];
+        for (uint32_t p = 0; r->live && p < r->npages; p++) {
+            int level;
+            uint64_t *pte = vm_walk(as_root[r->as], r->va + p * PAGE_SIZE, &level);
+            if (pte && (*pte & PTE_V)) {
+                epoch_add(PTE2PA(*pte), PAGE_SIZE);
+            }
+        }
+    }
+    qsort(epoch_ranges, nepoch_ranges, sizeof(*epoch_ranges), range_cmp);
+    for (uint64_t i = 0; i < nepoch_ranges;) {
+        uint64_t start = epoch_ranges[i].start, end = start + epoch_ranges[i].len;
+        for (i++; i < nepoch_ranges && epoch_ranges[i].start == end; i++) {
+            end += epoch_ranges[i].len;
+        }
+        madvise((void *)start, end - start, MADV_DONTNEED);
+    }
+    nepoch_ids = 0;
+    epoch_pages = 0;
+}
+
+static void record(int type, uint64_t ns, uint64_t pages, int ok) {
+    struct lat_stats *l = &lat[type];
+    unsigned int b = 63 - __builtin_clzl(ns | 1);
+    l->count++;
+    l->pages += pages;
+    l->failed += !ok;
+    l->total_ns += ns;
+    l->hist[b < SIM_LAT_BUCKETS ? b : SIM_LAT_BUCKETS - 1]++;
+}
+
+static int map_region(struct region *r) {
+    pagetable_t root = as_root[r->as];
+    for (uint32_t p = 0; p < r->npages; p++) {
+        void *frame = pfa_alloc();
+        if (!frame) {
+            return -1;
+        }
+        if (vm_map(root, r->va + p * PAGE_SIZE, (uint64_t)frame, SIM_MAP_FLAGS) != 0) {
+            pfa_free(frame);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void replay(void) {
+    for (uint64_t i = 0; i < nops; i++) {
+        struct op *op = &ops[i];
+        uint64_t t0 = host_clock_ns();
+        uint64_t pages = 0;
+        int ok = 1;
+
+        switch (op->type) {
+        case OP_ALLOC: {
+            struct block *b = &blocks[op->id];
+            b->pa = op->order ? pfa_alloc_order(op->order) : pfa_alloc();
+            b->order = op->order;
+            ok = b->pa != NULL;
+            pages = 1UL << op->order;
+            break;
+        }
+        case OP_FREE: {
+            struct block *b = &blocks[op->id];
+            if (b->pa) {
+                if (b->order) {
+                    pfa_free_order(b->pa, b->order);
+                } else {
+                    pfa_free(b->pa);
+                }
+                pages = 1UL << b->order;
+                b->pa = NULL;
+            }
+            break;
+        }
+        case OP_MAP: {
+            struct region *r = &regions[op->id];
+            *r = (struct region){ .va = op->va, .npages = op->npages, .as = op->as,
+                                  .live = 1 };
+            ok = map_region(r) == 0;
+            pages = op->npages;
+            break;
+        }
+        case OP_UNMAP: {
+            struct region *r = &regions[op->id];
+            if (r->live) {
+                ok = vm_unmap_range(as_root[r->as], r->va, (uint64_t)r->npages * PAGE_SIZE,
+                                    r->as + 1) == 0;
+                pages = r->npages;
+                r->live = 0;
+            }
+            break;
+        }
+        }
+        record(op->type, host_clock_ns() - t0, pages, ok);
+
+        if (release_mode && (op->type == OP_ALLOC || op->type == OP_MAP)) {
+            epoch_ids[nepoch_ids++] = op->id | (op->type == OP_MAP ? EPOCH_REGION : 0);
+            epoch_pages += pages;
+            if (epoch_pages >= SIM_EPOCH_PAGES) {
+                epoch_release();
+            }
+        }
+    }
+}
+
+// --- Reporting ---
+
+// Count the table pages under 'table' and the leaf pages it maps.
+static void walk_tables(pagetable_t table, int level, uint64_t *tables, uint64_t *leaves) {
+    (*tables)++;
+    for (int i = 0; i < 512; i++) {
+        uint64_t pte = table[i];
+        if (!(pte & PTE_V) || (pte & PTE_G)) {
+            continue;
+        }
+        if (pte & (PTE_R | PTE_W | PTE_X)) {
+            *leaves += 1UL << (9 * level);
+        } else {
+            walk_tables((pagetable_t)PTE2PA(pte), level - 1, tables, leaves);
+        }
+    }
+}
+
+static uint64_t hist_percentile(const uint64_t *hist, uint64_t count, double frac) {
+    uint64_t seen = 0;
+    for (int b = 0; b < SIM_LAT_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen >= count * frac) {
+            return 2UL << b;
+        }
+    }
+    return 0;
+}
+
+static void report(uint64_t mem_bytes, double seconds) {
+    printf("ops %llu in %.3f s (%.2f Mops/s)\n", (unsigned long long)nops, seconds,
+           nops / seconds / 1e6);
+    printf("%-6s %10s %10s %8s %10s %10s %10s\n", "op", "count", "failed", "avg_ns", "~p50_ns",
+           "~p99_ns", "Mpages/s");
+    for (int t = 0; t < OP_NTYPES; t++) {
+        struct lat_stats *l = &lat[t];
+        if (!l->count) {
+            continue;
+        }
+        printf("%-6s %10llu %10llu %8llu %10llu %10llu %10.2f\n", op_names[t],
+               (unsigned long long)l->count, (unsigned long long)l->failed,
+               (unsigned long long)(l->total_ns / l->count),
+               (unsigned long long)hist_percentile(l->hist, l->count, 0.5),
+               (unsigned long long)hist_percentile(l->hist, l->count, 0.99),
+               l->total_ns ? l->pages * 1e3 / l->total_ns : 0.0);
+    }
+
+    struct pfa_stats st;
+    pfa_get_stats(&st);
+    uint64_t free_pages = st.free_pages;
+    printf("\nmemory %llu MiB: %llu pages, %llu free (%.1f%%), %llu in magazines\n",
+           (unsigned long long)(mem_bytes >> 20), (unsigned long long)st.total_pages,
+           (unsigned long long)free_pages, 100.0 * free_pages / st.total_pages,
+           (unsigned long long)st.mag_pages);
+    printf("free blocks by order:");
+    int largest = -1;
+    for (int k = 0; k <= PFA_MAX_ORDER; k++) {
+        printf(" %llu", (unsigned long long)st.free_blocks[k]);
+        if (st.free_blocks[k]) {
+            largest = k;
+        }
+    }
+    printf("\nlargest free order: %d\n", largest);
+    // Unusable free space index: share of free memory in blocks too small for order j.
+    int orders[] = { 4, 9, PFA_MAX_ORDER };
+    for (unsigned int i = 0; i < sizeof(orders) / sizeof(orders[0]); i++) {
+        uint64_t usable = 0;
+        for (int k = orders[i]; k <= PFA_MAX_ORDER; k++) {
+            usable += st.free_blocks[k] << k;
+        }
+        printf("unusable free space for order %d: %.1f%%\n", orders[i],
+               free_pages ? 100.0 * (free_pages - usable) / free_pages : 0.0);
+    }
+
+    uint64_t tables = 0, leaves = 0;
+    for (uint32_t a = 0; a < nas; a++) {
+        walk_tables(as_root[a], 2, &tables, &leaves);
+    }
+    printf("\npage tables: %u address spaces, %llu table pages for %llu mapped pages "
+           "(%.2f%% overhead)\n", nas, (unsigned long long)tables, (unsigned long long)leaves,
+           leaves ? 100.0 * tables / leaves : 0.0);
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    printf("host: %s mode, peak RSS %ld MiB, %ld page faults\n",
+           release_mode ? "release" : "pre-faulted", ru.ru_maxrss / 1024, ru.ru_minflt);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-m GiB] [-n ops] [-o occupancy] [-a address-spaces] [-s seed]\n"
+            "          [-t trace-in] [-w trace-out] [-r]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    uint64_t mem_gib = 16, n = 4000000;
+    double occupancy = 0.85;
+    const char *trace_in = NULL, *trace_out = NULL;
+    int opt;
+
+    nas = 64;
+    while ((opt = getopt(argc, argv, "m:n:o:a:s:t:w:r")) != -1) {
+        switch (opt) {
+        case 'm': mem_gib = strtoull(optarg, NULL, 0); break;
+        case 'n': n = strtoull(optarg, NULL, 0); break;
+        case 'o': occupancy = strtod(optarg, NULL); break;
+        case 'a': nas = strtoul(optarg, NULL, 0); break;
+        case 's': rng_state = strtoull(optarg, NULL, 0) | 1; break;
+        case 't': trace_in = optarg; break;
+        case 'w': trace_out = optarg; break;
+        case 'r': release_mode = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (mem_gib == 0 || nas == 0 || nas > SIM_MAX_AS || occupancy <= 0 || occupancy >= 1) {
+        usage(argv[0]);
+    }
+
+    // Simulated RAM, aligned like the real thing so buddy alignment holds.
+    uint64_t mem_bytes = mem_gib << 30;
+    uint64_t align = PAGE_SIZE << PFA_MAX_ORDER;
+    uint64_t host_bytes = (uint64_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    if (mem_bytes > host_bytes / 2) {
+        release_mode = 1;
+    }
+    void *raw = mmap(NULL, mem_bytes + align, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+                     (release_mode ? 0 : MAP_POPULATE), -1, 0);
+    if (raw == MAP_FAILED) {
+        fprintf(stderr, "cannot reserve %llu GiB: %s\n", (unsigned long long)mem_gib,
+                strerror(errno));
+        return 1;
+    }
+    uint64_t base = ((uint64_t)raw + align - 1) & ~(align - 1);
+
+    pfa_init_range(base, mem_bytes, 0);
+    // Only builds tables (never walked by hardware): the kernel's usual virt layout.
+    enable_virtual_memory(0x80000000UL, GIGAPAGE_SIZE);
+
+    if (trace_in) {
+        nas = 0;
+        if (load_trace(trace_in) != 0) {
+            return 1;
+        }
+    } else {
+        struct pfa_stats st;
+        pfa_get_stats(&st);
+        generate(n, (uint64_t)(st.free_pages * occupancy));
+    }
+    if (trace_out && save_trace(trace_out) != 0) {
+        return 1;
+    }
+
+    blocks = calloc(nslots ? nslots : 1, sizeof(*blocks));
+    regions = calloc(nregions ? nregions : 1, sizeof(*regions));
+    epoch_ids = calloc(nops ? nops : 1, sizeof(*epoch_ids));
+    for (uint32_t a = 0; a < nas; a++) {
+        as_root[a] = vm_create_user_pagetable();
+        if (!blocks || !regions || !epoch_ids || !as_root[a]) {
+            fprintf(stderr, "setup failed\n");
+            return 1;
+        }
+    }
+
+    printf("simulated RAM %llu GiB, %u address spaces, %llu ops (%s)\n",
+           (unsigned long long)mem_gib, nas, (unsigned long long)nops,
+           trace_in ? trace_in : "generated");
+    uint64_t t0 = host_clock_ns();
+    replay();
+    report(mem_bytes, (host_clock_ns() - t0) / 1e9);
+    return 0;
+}
@@ -0,0 +1,435 @@
+#include "bench.h"
+#include "mem.h"
+#include "vm.h"
+#include "proc.h"
+#include "sched.h"
+#include "context.h"
+#include "klog.h"
+#include "kstring.h"
+#include "timer.h"
+#include "riscv.h"
+#include "uart.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// QEMU virt "sifive_test" finisher: a write stops the machine.
+#define SIFIVE_TEST_BASE 0x100000UL
+#define SIFIVE_TEST_PASS 0x5555
+#define SIFIVE_TEST_FAIL 0x3333 // Exit status in the upper 16 bits.
+
+// Order-0 pages held while measuring the buddy allocator under fragmentation.
+#define BENCH_ARENA_PAGES 2048
+
+// Fake processes cycled through the run queue by the scheduler benchmarks.
+#define BENCH_SCHED_PROCS 64
+
+static uint64_t cyc[BENCH_ITERS];
+static uint64_t ins[BENCH_ITERS];
+static uint64_t ovh_cyc, ovh_ins; // Cost of an empty sample.
+static int bench_failed;
+
+static void *pages[BENCH_ITERS];
+static void *arena[BENCH_ARENA_PAGES];
+static struct proc bench_procs[BENCH_SCHED_PROCS];
+
+static inline void sample_end(unsigned int i, uint64_t c0, uint64_t i0) {
+    uint64_t c1 = r_cycle();
+    uint64_t i1 = r_instret();
+    cyc[i] = (c1 - c0 > ovh_cyc) ? c1 - c0 - ovh_cyc : 0;
+    ins[i] = (i1 - i0 > ovh_ins) ? i1 - i0 - ovh_ins : 0;
+}
+
+// Time one execution of 'op' into sample slot 'i'.
+#define SAMPLE(i, op)                  \
+    do {                               \
+        uint64_t i0_ = r_instret();    \
+        uint64_t c0_ = r_cycle();      \
+        op;                            \
+        sample_end((i), c0_, i0_);     \
+    } while (0)
+
+static void put_dec(uint64_t v) {
+    char buf[21];
+    int n = sizeof(buf) - 1;
+    buf[n] = '\0';
+    do {
+        buf[--n] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    uart_puts(&buf[n]);
+}
+
+static void sort(uint64_t *v, unsigned int n) {
+    for (unsigned int i = 1; i < n; i++) {
+        uint64_t x = v[i];
+        unsigned int j = i;
+        for (; j > 0 && v[j - 1] > x; j--) {
+            v[j] = v[j - 1];
+        }
+        v[j] = x;
+    }
+}
+
+// Print the summary line for the first 'n' samples.
+static void report(const char *name, unsigned int n) {
+    sort(cyc, n);
+    sort(ins, n);
+    uart_puts("BENCH ");
+    uart_puts(name);
+    uart_puts(" n=");
+    put_dec(n);
+    uart_puts(" cyc_min=");
+    put_dec(cyc[0]);
+    uart_puts(" cyc_med=");
+    put_dec(cyc[n / 2]);
+    uart_puts(" cyc_p99=");
+    put_dec(cyc[(n * 99) / 100]);
+    uart_puts(" ins_med=");
+    put_dec(ins[n / 2]);
+    uart_puts("\n");
+}
+
+static void fail(const char *name) {
+    uart_puts("BENCH-FAIL ");
+    uart_puts(name);
+    uart_puts("\n");
+    bench_failed = 1;
+}
+
+static void bench_calibrate(void) {
+    ovh_cyc = ovh_ins = 0;
+    for (unsigned int i = 0; i < BENCH_ITERS; i++) {
+        SAMPLE(i, );
+    }
+    sort(cyc, BENCH_ITERS);
+    sort(ins, BENCH_ITERS);
+    ovh_cyc = cyc[0];
+    ovh_ins = ins[0];
+    uart_puts("BENCH overhead cyc=");
+    put_dec(ovh_cyc);
+    uart_puts(" ins=");
+    put_dec(ovh_ins);
+    uart_puts("\n");
+}
+
+// Single frames through the per-hart magazine, including its refills and drains.
+static void bench_pfa(void) {
+    for (unsigned int i = 0; i < BENCH_ITERS; i++) {
+        SAMPLE(i, pages[i] = pfa_alloc());
+        if (!pages[i]) {
+            fail("pfa_alloc");
+            for (unsigned int j = 0; j < i; j++) {
+                pfa_free(pages[j]);
+            }
+            return;
+        }
+    }
+    report("pfa_alloc", BENCH_ITERS);
+    for (unsigned int i = 0; i < BENCH_ITERS; i++) {
+        SAMPLE(i, pfa_free(pages[i]));
+    }
+    report("pfa_free", BENCH_ITERS);
+}
+
+/*
+ * Zeroed frames, first from a pool filled beforehand (as idle harts would),
+ * then with the pool disabled so every frame is zeroed on the spot.
+ */
+static void bench_pfa_zeroed(void) {
+    static const char *names[] = { "pfa_alloc_zeroed.pool", "pfa_alloc_zeroed.sync" };
+    for (int sync = 0; sync < 2; sync++) {
+        if (sync) {
+            pfa_zero_set_watermarks(0, 0);
+        } else {
+            pfa_zero_set_watermarks(BENCH_ITERS, BENCH_ITERS);
+            while (pfa_zero_idle()) {}
+        }
+        unsigned int n = 0;
+        for (; n < BENCH_ITERS; n++) {
+            SAMPLE(n, pages[n] = pfa_alloc_zeroed());
+            if (!pages[n]) {
+                break;
+            }
+        }
+        if (n == BENCH_ITERS) {
+            report(names[sync], BENCH_ITERS);
+        } else {
+            fail(names[sync]);
+        }
+        for (unsigned int i = 0; i < n; i++) {
+            pfa_free(pages[i]);
+        }
+    }
+    pfa_zero_set_watermarks(PFA_ZERO_LOW, PFA_ZERO_HIGH);
+}
+
+/*
+ * Buddy allocator alloc+free round trips of 'order' with 'pct' percent of
+ * an arena of order-0 pages freed as isolated holes (every other page, so
+ * no two holes can coalesce).
+ */
+static void bench_pfa_frag(unsigned int order, unsigned int pct, const char *name) {
+    unsigned int held = 0;
+    for (; held < BENCH_ARENA_PAGES; held++) {
+        arena[held] = pfa_alloc_order(0);
+        if (!arena[held]) {
+            break;
+        }
+    }
+    unsigned int holes_end = (held * pct) / 100;
+    for (unsigned int i = 1; i < holes_end; i += 2) {
+        pfa_free_order(arena[i], 0);
+        arena[i] = NULL;
+    }
+
+    int ok = held == BENCH_ARENA_PAGES;
+    for (unsigned int i = 0; ok && i < BENCH_ITERS; i++) {
+        void *p;
+        SAMPLE(i, p = pfa_alloc_order(order); if (p) pfa_free_order(p, order));
+        ok = p != NULL;
+    }
+    if (ok) {
+        report(name, BENCH_ITERS);
+    } else {
+        fail(name);
+    }
+
+    for (unsigned int i = 0; i < held; i++) {
+        if (arena[i]) {
+            pfa_free_order(arena[i], 0);
+        }
+    }
+}
+
+/*
+ * Page and memcpy/memcmp kernels, scalar and (when the harts have V) RVV.
+ * Names end in .scalar or .rvv.
+ */
+static void bench_kstring(void) {
+    static const char *names[2][4] = {
+        { "page_zero.scalar", "page_copy.scalar", "memcpy4k.scalar", "memcmp4k.scalar" },
+        { "page_zero.rvv", "page_copy.rvv", "memcpy4k.rvv", "memcmp4k.rvv" },
+    };
+    uint8_t *a = pfa_alloc();
+    uint8_t *b = pfa_alloc();
+    if (!a || !b) {
+        fail("page_zero");
+        goto out;
+    }
+    int saved = kstring_vector_enabled();
+    for (int vec = 0; vec < 2; vec++) {
+        kstring_set_vector(vec);
+        if (kstring_vector_enabled() != vec) {
+            continue; // No V extension.
+        }
+        memset(a, 0x5a, PAGE_SIZE);
+        for (unsigned int i = 0; i < BENCH_ITERS; i++) {
+            SAMPLE(i, page_zero(b));
+        }
+        report(names[vec][0], BENCH_ITERS);
+        for (unsigned int i = 0; i < BENCH_ITERS; i++) {
+            SAMPLE(i, page_copy(b, a));
+        }
+        report(names[vec][1], BENCH_ITERS);
+        for (unsigned int i = 0; i < BENCH_ITERS; i++) {
+            SAMPLE(i, memcpy(b, a, PAGE_SIZE));
+        }
+        report(names[vec][2], BENCH_ITERS);
+        int r = 0;
+        for (unsigned int i = 0; i < BENCH_ITERS; i++) {
+            SAMPLE(i, r |= memcmp(b, a, PAGE_SIZE));
+        }
+        if (r == 0) {
+            report(names[vec][3], BENCH_ITERS);
+        } else {
+            fail(names[vec][3]);
+        }
+    }
+    kstring_set_vector(saved);
+out:
+    if (a) {
+        pfa_free(a);
+    }
+    if (b) {
+        pfa_free(b);
+    }
+}
+
+static void bench_vm(void) {
+    static pagetable_t tables[BENCH_ITERS];
+    uint64_t flags = PTE_R | PTE_W | PTE_A | PTE_D;
+    void *frame = pfa_alloc();
+    pagetable_t pt = vm_create_pagetable();
+    if (!frame || !pt) {
+        fail("vm_map");
+        goto out;
+    }
+
+    // Neighbouring pages: after the first, every map reuses the same leaf table.
+    int ok = 1;
+    for (unsigned int i = 0; ok && i < BENCH_ITERS; i++) {
+        uint64_t va = 0x10000000UL + i * PAGE_SIZE;
+        int ret;
+        SAMPLE(i, ret = vm_map(pt, va, (uint64_t)frame, flags));
+        ok = ret == 0;
+    }
+    if (ok) {
+        report("vm_map.dense", BENCH_ITERS);
+    } else {
+        fail("vm_map.dense");
+    }
+
+    // One page per 2 MiB: every map allocates and zeroes a new leaf table.
+    for (unsigned int i = 0; ok && i < BENCH_ITERS; i++) {
+        uint64_t va = 0x40000000UL + i * MEGAPAGE_SIZE;
+        int ret;
+        SAMPLE(i, ret = vm_map(pt, va, (uint64_t)frame, flags));
+        ok = ret == 0;
+    }
+    if (ok) {
+        report("vm_map.sparse", BENCH_ITERS);
+    } else {
+        fail("vm_map.sparse");
+    }
+
+    // The mappings are not PTE_OWNED, so this frees only the tables.
+    vm_destroy(pt, ASID_KERNEL);
+
+    for (unsigned int i = 0; i < BENCH_ITERS; i++) {
+        SAMPLE(i, tables[i] = vm_create_user_pagetable());
+        if (!tables[i]) {
+            fail("vm_create_user_pagetable");
+            for (unsigned int j = 0; j < i; j++) {
+                vm_destroy(tables[j], ASID_KERNEL);
+            }
+            goto out;
+        }
+    }
+    report("vm_create_user_pagetable", BENCH_ITERS);
+    for (unsigned int i = 0; i < BENCH_ITERS; i++) {
+        SAMPLE(i, vm_destroy(tables[i], ASID_KERNEL));
+    }
+    report("vm_destroy.empty", BENCH_ITERS);
+
+out:
+    if (frame) {
+        pfa_free(frame);
+    }
+}
+
+/*
+ * swtch() round trip against a partner that immediately switches back.
+ * The partner never touches the stack, so it can run on this one: its
+ * context starts with the current sp, below which nothing is live.
+ */
+static struct context bench_main_ctx __attribute__((used));
+static struct context bench_partner_ctx __attribute__((used));
+
+void bench_swtch_partner(void);
+asm(".text\n"
+    ".type bench_swtch_partner, @function\n"
+    "bench_swtch_partner:\n"
+    "1:  la a0, bench_partner_ctx\n"
+    "    la a1, bench_main_ctx\n"
+    "    call swtch\n"
+    "    j 1b\n");
+
+static void bench_swtch(void) {
+    uint64_t sp;
+    asm volatile("mv %0, sp" : "=r"(sp));
+    bench_partner_ctx.ra = (uint64_t)bench_swtch_partner;
+    bench_partner_ctx.sp = sp;
+    for (unsigned int i = 0; i < BENCH_ITERS; i++) {
+        SAMPLE(i, swtch(&bench_main_ctx, &bench_partner_ctx));
+    }
+    report("swtch.roundtrip", BENCH_ITERS);
+}
+
+/*
+ * Kernel-mode trap entry, dispatch and sret, driven by c.ebreak (the
+ * breakpoint handler steps over the 2-byte instruction). Its log message
+ * is filtered out at the call site for the duration.
+ */
+static void bench_trap(void) {
+    int threshold = klog_threshold;
+    klog_threshold = KLOG_ERR;
+    for (unsigned int i = 0; i < BENCH_ITERS; i++) {
+        SAMPLE(i, asm volatile("c.ebreak" ::: "memory"));
+    }
+    klog_threshold = threshold;
+    report("trap.roundtrip", BENCH_ITERS);
+}
+
+/*
+ * Run-queue insert and pick-next with BENCH_SCHED_PROCS tasks spread over
+ * every priority level. The first pass times sched_enqueue(), the second
+ * sched_pick_next().
+ */
+static void bench_sched(void) {
+    for (int pass = 0; pass < 2; pass++) {
+        unsigned int n = 0;
+        while (n + BENCH_SCHED_PROCS <= BENCH_ITERS) {
+            for (unsigned int k = 0; k < BENCH_SCHED_PROCS; k++) {
+                struct proc *p = &bench_procs[k];
+                p->cpu = NHART;
+                p->prio = k % SCHED_NPRIO;
+                if (pass == 0) {
+                    SAMPLE(n + k, sched_enqueue(p));
+                } else {
+                    sched_enqueue(p);
+                }
+            }
+            for (unsigned int k = 0; k < BENCH_SCHED_PROCS; k++) {
+                struct proc *p;
+                if (pass == 1) {
+                    SAMPLE(n + k, p = sched_pick_next());
+                } else {
+                    p = sched_pick_next();
+                }
+                if (!p) {
+                    fail("sched");
+                    return;
+                }
+            }
+            n += BENCH_SCHED_PROCS;
+        }
+        report(pass == 0 ? "sched_enqueue" : "sched_pick_next", n);
+    }
+}
+
+static void __attribute__((noreturn)) bench_exit(int code) {
+    volatile uint32_t *test = (volatile uint32_t *)SIFIVE_TEST_BASE;
+    *test = code ? ((uint32_t)code << 16) | SIFIVE_TEST_FAIL : SIFIVE_TEST_PASS;
+    while (1) {}
+}
+
+void bench_run(void) {
+    uint64_t start = r_time();
+
+    // Get queued boot messages out first so they do not land mid-report.
+    klog_flush();
+    uart_puts("BENCH-BEGIN iters=");
+    put_dec(BENCH_ITERS);
+    uart_puts("\n");
+
+    bench_calibrate();
+    bench_pfa();
+    bench_pfa_zeroed();
+    bench_pfa_frag(0, 0, "pfa_order0.frag0");
+    bench_pfa_frag(0, 50, "pfa_order0.frag50");
+    bench_pfa_frag(0, 90, "pfa_order0.frag90");
+    bench_pfa_frag(2, 0, "pfa_order2.frag0");
+    bench_pfa_frag(2, 50, "pfa_order2.frag50");
+    bench_pfa_frag(2, 90, "pfa_order2.frag90");
+    bench_kstring();
+    bench_vm();
+    bench_swtch();
+    bench_trap();
+    bench_sched();
+
+    uart_puts("BENCH-END elapsed_us=");
+    put_dec(timer_ticks_to_us(r_time() - start));
+    uart_puts(bench_failed ? " status=fail\n" : " status=ok\n");
+    bench_exit(bench_failed);
+}
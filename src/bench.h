@@ -0,0 +1,24 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/*
+ * Built-in microbenchmarks, compiled in by `make bench` (CHIMERA_BENCH).
+ * Each benchmark times BENCH_ITERS single operations with rdcycle and
+ * rdinstret and prints one line per benchmark:
+ *
+ *   BENCH <name> n=<samples> cyc_min=<c> cyc_med=<c> cyc_p99=<c> ins_med=<i>
+ *
+ * between "BENCH-BEGIN" and "BENCH-END" lines. The cost of reading the
+ * counters themselves is measured first and subtracted from every sample.
+ */
+#define BENCH_ITERS 512
+
+/*
+ * Run every benchmark on the boot hart, then stop QEMU through the SiFive
+ * test device (exit status 0 if every benchmark ran). Call from kmain()
+ * after the scheduler is initialized and before uart_init(), so output is
+ * written synchronously and nothing else is running.
+ */
+void bench_run(void) __attribute__((noreturn));
+
+#endif // BENCH_H
@@ -6,10 +6,11 @@
 /*
  * The context structure used for context switching.
  * It saves the callee-saved registers that the C calling convention requires.
- * These include: ra (return address) and s0-s11.
+ * These include: ra (return address), sp and s0-s11.
  */
 struct context {
     uint64_t ra;
+    uint64_t sp;
     uint64_t s0;
     uint64_t s1;
     uint64_t s2;
@@ -24,4 +25,16 @@ struct context {
     uint64_t s11;
 };
 
+/*
+ * Save the callee-saved registers into 'old' and load them from 'new'
+ * (src/switch.S). Returns on the stack and at the ra saved in 'new'.
+ */
+void swtch(struct context *old, struct context *new);
+
+/*
+ * Where a new process's context starts (src/switch.S): finishes the switch
+ * with sched_first_run() and enters U-mode through __trap_return().
+ */
+void proc_trampoline(void);
+
 #endif // CONTEXT_H
@@ -0,0 +1,178 @@
+#include "fault.h"
+#include "trap.h"
+#include "proc.h"
+#include "vm.h"
+#include "mem.h"
+#include "kstring.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Check that a fault of type 'cause' is an access the permission bits
+ * 'flags' (region flags or a PTE) allow.
+ */
+static int access_allowed(uint64_t flags, uint64_t cause) {
+    switch (cause) {
+    case EXC_INST_PAGE_FAULT:  return (flags & PTE_X) != 0;
+    case EXC_LOAD_PAGE_FAULT:  return (flags & PTE_R) != 0;
+    case EXC_STORE_PAGE_FAULT: return (flags & PTE_W) != 0;
+    default:                   return 0;
+    }
+}
+
+/*
+ * Store to a copy-on-write leaf. A frame nobody else references any more
+ * is simply made writable again; a shared one is copied first.
+ */
+static int cow_fault(uint64_t *pte, uint64_t page, uint64_t asid) {
+    void *old = (void *)PTE2PA(*pte);
+    uint64_t flags = ((*pte & 0x3FF) | PTE_W | PTE_D) & ~PTE_COW;
+
+    if (pfa_refcount(old) == 1) {
+        *pte = PA2PTE((uint64_t)old) | flags;
+        vm_flush_page(page, asid);
+        return 0;
+    }
+
+    void *copy = pfa_alloc();
+    if (!copy) {
+        return -1;
+    }
+    page_copy(copy, old);
+    *pte = PA2PTE((uint64_t)copy) | flags;
+    vm_flush_page(page, asid);
+
+    // The other sharers may have gone away since the check above.
+    if (pfa_unref(old) == 0) {
+        pfa_free(old);
+    }
+    return 0;
+}
+
+/*
+ * Demand-zero fault: back the page with a fresh zeroed frame owned by
+ * the mapping, so vm_unmap_range()/vm_destroy() give it back.
+ */
+int handle_page_fault(uint64_t cause, uint64_t va) {
+    struct proc *p = myproc();
+    if (!p) {
+        return -1;
+    }
+    uint64_t page = va & ~(PAGE_SIZE - 1UL);
+    uint64_t asid = vm_asid_get(&p->asid);
+    int level;
+    uint64_t *pte = vm_walk(p->pagetable, page, &level);
+
+    // vm_fork() only marks 4 KiB leaves copy-on-write.
+    if (pte && cause == EXC_STORE_PAGE_FAULT && PTE_IS_COW(*pte) && level == 0) {
+        return cow_fault(pte, page, asid);
+    }
+
+    struct vm_region *r = proc_find_region(p, va);
+    if (!r || !access_allowed(r->flags, cause)) {
+        return -1;
+    }
+
+    // Already mapped with the needed permission: the TLB held a stale
+    // invalid entry (or another hart got here first). Flush and retry.
+    if (pte) {
+        if (!access_allowed(*pte, cause)) {
+            return -1;
+        }
+        vm_flush_page(page, asid);
+        return 0;
+    }
+
+    void *frame = pfa_alloc_zeroed();
+    if (!frame) {
+        return -1;
+    }
+
+    // A and D are set up front so the first access does not fault again.
+    uint64_t flags = r->flags | PTE_U | PTE_A | PTE_D | PTE_OWNED;
+    if (vm_map(p->pagetable, page, (uint64_t)frame, flags) != 0) {
+        pfa_free(frame);
+        return -1;
+    }
+    vm_flush_page(page, asid);
+    return 0;
+}
+
+/*
+ * Kernel address of user byte 'va' in the current process, usable for an
+ * access of type 'cause' up to the end of its page. Missing or
+ * copy-on-write pages are faulted in the way a user access would be.
+ * Returns NULL if the process could not make that access itself.
+ */
+static uint8_t *user_addr(struct proc *p, uint64_t va, uint64_t cause) {
+    if (va >= VM_USER_END) {
+        return NULL;
+    }
+    for (int tries = 0; tries < 2; tries++) {
+        int level;
+        uint64_t *pte = vm_walk(p->pagetable, va, &level);
+        if (pte && (*pte & PTE_U) && access_allowed(*pte, cause)) {
+            uint64_t size = (uint64_t)PAGE_SIZE << (9 * level);
+            return (uint8_t *)(PTE2PA(*pte) + (va & (size - 1)));
+        }
+        if (handle_page_fault(cause, va) != 0) {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+void *user_kaddr(uint64_t va, int write) {
+    struct proc *p = myproc();
+    if (!p) {
+        return NULL;
+    }
+    return user_addr(p, va, write ? EXC_STORE_PAGE_FAULT : EXC_LOAD_PAGE_FAULT);
+}
+
+int copy_from_user(void *dst, uint64_t src_va, uint64_t len) {
+    struct proc *p = myproc();
+    uint8_t *out = dst;
+    if (!p) {
+        return -1;
+    }
+    while (len > 0) {
+        uint8_t *src = user_addr(p, src_va, EXC_LOAD_PAGE_FAULT);
+        if (!src) {
+            return -1;
+        }
+        uint64_t n = PAGE_SIZE - (src_va & (PAGE_SIZE - 1));
+        if (n > len) {
+            n = len;
+        }
+        memcpy(out, src, n);
+        out += n;
+        src_va += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int copy_to_user(uint64_t dst_va, const void *src, uint64_t len) {
+    struct proc *p = myproc();
+    const uint8_t *in = src;
+    if (!p) {
+        return -1;
+    }
+    while (len > 0) {
+        uint8_t *dst = user_addr(p, dst_va, EXC_STORE_PAGE_FAULT);
+        if (!dst) {
+            return -1;
+        }
+        uint64_t n = PAGE_SIZE - (dst_va & (PAGE_SIZE - 1));
+        if (n > len) {
+            n = len;
+        }
+        memcpy(dst, in, n);
+        in += n;
+        dst_va += n;
+        len -= n;
+    }
+    return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef FAULT_H
+#define FAULT_H
+
+#include <stdint.h>
+
+/*
+ * Try to resolve a page fault on 'va' with exception cause 'cause'
+ * (EXC_INST/LOAD/STORE_PAGE_FAULT) for the current process: demand-zero
+ * faults in a declared region and stores to copy-on-write pages.
+ * Returns 0 if the faulting access can be retried, -1 if the fault is fatal.
+ * The resolved path does no console output.
+ */
+int handle_page_fault(uint64_t cause, uint64_t va);
+
+/*
+ * Copy between the kernel and the current process's user memory, faulting
+ * pages in as the process itself would. Returns 0, or -1 if any part of the
+ * user range is not accessible to the process.
+ */
+int copy_from_user(void *dst, uint64_t src_va, uint64_t len);
+int copy_to_user(uint64_t dst_va, const void *src, uint64_t len);
+
+/*
+ * Kernel address of the current process's user byte 'va', valid to the end
+ * of its page, for a load (write == 0) or a store. Pages are faulted in as
+ * for copy_from_user()/copy_to_user(). NULL if the process has no such access.
+ */
+void *user_kaddr(uint64_t va, int write);
+
+#endif // FAULT_H
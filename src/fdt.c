@@ -0,0 +1,428 @@
+#include "fdt.h"
+#include "klog.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Structure block tokens.
+#define FDT_BEGIN_NODE 1
+#define FDT_END_NODE   2
+#define FDT_PROP       3
+#define FDT_NOP        4
+#define FDT_END        9
+
+// Nesting tracked by the parser; deeper nodes are skipped.
+#define FDT_MAX_DEPTH 16
+
+struct fdt_header {
+    uint32_t magic;
+    uint32_t totalsize;
+    uint32_t off_dt_struct;
+    uint32_t off_dt_strings;
+    uint32_t off_mem_rsvmap;
+    uint32_t version;
+    uint32_t last_comp_version;
+    uint32_t boot_cpuid_phys;
+    uint32_t size_dt_strings;
+    uint32_t size_dt_struct;
+};
+
+// What a node turned out to be, from its name, its parent and its properties.
+enum fdt_kind {
+    NODE_OTHER,
+    NODE_CPUS,
+    NODE_CPU,
+    NODE_MEMORY,
+    NODE_RESERVED,      // /reserved-memory itself.
+    NODE_RESERVED_CHILD,
+    NODE_CLINT,
+    NODE_PLIC,
+    NODE_UART,
+};
+
+// Per-depth state. Cells apply to the node's children, as in the spec.
+struct fdt_node {
+    uint32_t addr_cells;
+    uint32_t size_cells;
+    const uint8_t *reg;
+    uint32_t reg_len;
+    uint32_t irq;
+    uint32_t isa;       // Single-letter extensions of a cpu node ('a' is bit 0).
+    uint8_t has_isa;
+    uint8_t kind;
+    uint8_t disabled;
+};
+
+// Devices already taken from the tree; the first match wins.
+#define FOUND_CLINT (1u << 0)
+#define FOUND_PLIC  (1u << 1)
+#define FOUND_UART  (1u << 2)
+#define FOUND_TB    (1u << 3)
+
+static uint32_t be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint64_t be64(const uint8_t *p) {
+    return ((uint64_t)be32(p) << 32) | be32(p + 4);
+}
+
+// Read a value of 'cells' (1 or 2) 32-bit cells.
+static uint64_t read_cells(const uint8_t *p, uint32_t cells) {
+    return cells == 2 ? be64(p) : be32(p);
+}
+
+static int str_eq(const char *a, const char *b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+// "name" or "name@unit-address".
+static int node_is(const char *name, const char *base) {
+    while (*base && *name == *base) {
+        name++;
+        base++;
+    }
+    return *base == '\0' && (*name == '\0' || *name == '@');
+}
+
+// Does the string list 'val' (as in "compatible") contain 'want'?
+static int list_has(const uint8_t *val, uint32_t len, const char *want) {
+    uint32_t i = 0;
+    while (i < len) {
+        const char *s = (const char *)val + i;
+        uint32_t n = 0;
+        while (i + n < len && s[n]) {
+            n++;
+        }
+        if (i + n < len && str_eq(s, want)) {
+            return 1;
+        }
+        i += n + 1;
+    }
+    return 0;
+}
+
+// Add a single-letter extension to 'isa'; "g" stands for "imafd".
+static uint32_t isa_add(uint32_t isa, char c) {
+    if (c == 'g') {
+        return isa | (1u << ('i' - 'a')) | (1u << ('m' - 'a')) | (1u << ('a' - 'a')) |
+               (1u << ('f' - 'a')) | (1u << ('d' - 'a'));
+    }
+    if (c >= 'a' && c <= 'z') {
+        isa |= 1u << (c - 'a');
+    }
+    return isa;
+}
+
+/*
+ * "riscv,isa" is "rv64" followed by single letters, then multi-letter
+ * extensions separated by '_'. Only the single letters are kept.
+ */
+static uint32_t isa_from_string(const uint8_t *val, uint32_t len) {
+    uint32_t isa = 0;
+    if (len < 5 || val[0] != 'r' || val[1] != 'v') {
+        return 0;
+    }
+    for (uint32_t i = 4; i < len && val[i] && val[i] != '_'; i++) {
+        if (val[i] == 'z' || val[i] == 's' || val[i] == 'x') {
+            break; // Multi-letter extension without a separator.
+        }
+        isa = isa_add(isa, (char)val[i]);
+    }
+    return isa;
+}
+
+// "riscv,isa-extensions" lists every extension as its own string.
+static uint32_t isa_from_list(const uint8_t *val, uint32_t len) {
+    uint32_t isa = 0;
+    for (uint32_t i = 0; i + 1 < len; i++) {
+        if ((i == 0 || val[i - 1] == 0) && val[i + 1] == 0) {
+            isa = isa_add(isa, (char)val[i]);
+        }
+    }
+    return isa;
+}
+
+static void add_region(struct fdt_region *r, uint32_t *n, uint32_t max, uint32_t *dropped,
+                       uint64_t base, uint64_t size) {
+    if (size == 0) {
+        return;
+    }
+    if (*n == max) {
+        (*dropped)++;
+        return;
+    }
+    r[*n].base = base;
+    r[*n].size = size;
+    (*n)++;
+}
+
+// Classify a node from its name and its parent when it begins.
+static uint8_t kind_from_name(const char *name, int depth, const struct fdt_node *parent) {
+    if (depth == 1) {
+        if (node_is(name, "cpus")) {
+            return NODE_CPUS;
+        }
+        if (node_is(name, "memory")) {
+            return NODE_MEMORY;
+        }
+        if (node_is(name, "reserved-memory")) {
+            return NODE_RESERVED;
+        }
+    } else if (depth == 2) {
+        if (parent->kind == NODE_CPUS && node_is(name, "cpu")) {
+            return NODE_CPU;
+        }
+        if (parent->kind == NODE_RESERVED) {
+            return NODE_RESERVED_CHILD;
+        }
+    }
+    return NODE_OTHER;
+}
+
+static uint8_t kind_from_compatible(const uint8_t *val, uint32_t len) {
+    if (list_has(val, len, "riscv,clint0") || list_has(val, len, "sifive,clint0")) {
+        return NODE_CLINT;
+    }
+    if (list_has(val, len, "riscv,plic0") || list_has(val, len, "sifive,plic-1.0.0")) {
+        return NODE_PLIC;
+    }
+    if (list_has(val, len, "ns16550a") || list_has(val, len, "ns16550")) {
+        return NODE_UART;
+    }
+    return NODE_OTHER;
+}
+
+/*
+ * A node ends: everything about it is known, so record it. Its 'reg' is
+ * decoded with the cell sizes its parent declared.
+ */
+static void finish_node(const struct fdt_node *node, const struct fdt_node *parent,
+                        struct fdt_info *out, uint32_t *found) {
+    if (node->disabled) {
+        return;
+    }
+    uint32_t ac = parent->addr_cells;
+    uint32_t sc = parent->size_cells;
+    uint32_t entry = 4 * (ac + sc);
+    if (ac < 1 || ac > 2 || sc > 2) {
+        return;
+    }
+    // First (address, size) pair, for devices.
+    int has_reg = node->reg_len >= entry;
+    struct fdt_region first = { 0, 0 };
+    if (has_reg) {
+        first.base = read_cells(node->reg, ac);
+        first.size = sc ? read_cells(node->reg + 4 * ac, sc) : 0;
+    }
+
+    switch (node->kind) {
+    case NODE_MEMORY:
+    case NODE_RESERVED_CHILD:
+        if (sc == 0) {
+            return;
+        }
+        for (uint32_t off = 0; off + entry <= node->reg_len; off += entry) {
+            uint64_t b = read_cells(node->reg + off, ac);
+            uint64_t s = read_cells(node->reg + off + 4 * ac, sc);
+            if (node->kind == NODE_MEMORY) {
+                add_region(out->mem, &out->nmem, FDT_MAX_MEM, &out->dropped, b, s);
+            } else {
+                add_region(out->rsv, &out->nrsv, FDT_MAX_RSV, &out->dropped, b, s);
+            }
+        }
+        break;
+    case NODE_CLINT:
+        if (has_reg && !(*found & FOUND_CLINT)) {
+            out->clint = first;
+            *found |= FOUND_CLINT;
+        }
+        break;
+    case NODE_PLIC:
+        if (has_reg && !(*found & FOUND_PLIC)) {
+            out->plic = first;
+            *found |= FOUND_PLIC;
+        }
+        break;
+    case NODE_UART:
+        if (has_reg && !(*found & FOUND_UART)) {
+            out->uart = first;
+            if (node->irq) {
+                out->uart_irq = node->irq;
+            }
+            *found |= FOUND_UART;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static void parse_prop(struct fdt_node *node, const char *pname, const uint8_t *val,
+                       uint32_t len, struct fdt_info *out, uint32_t *found) {
+    if (str_eq(pname, "#address-cells") && len == 4) {
+        node->addr_cells = be32(val);
+    } else if (str_eq(pname, "#size-cells") && len == 4) {
+        node->size_cells = be32(val);
+    } else if (str_eq(pname, "reg")) {
+        node->reg = val;
+        node->reg_len = len;
+    } else if (str_eq(pname, "riscv,isa-extensions")) {
+        node->isa = isa_from_list(val, len);
+        node->has_isa = 1;
+    } else if (str_eq(pname, "riscv,isa") && !node->has_isa) {
+        node->isa = isa_from_string(val, len);
+        node->has_isa = 1;
+    } else if (str_eq(pname, "interrupts") && len >= 4) {
+        node->irq = be32(val);
+    } else if (str_eq(pname, "status")) {
+        node->disabled = !list_has(val, len, "okay") && !list_has(val, len, "ok");
+    } else if (str_eq(pname, "device_type")) {
+        if (list_has(val, len, "memory")) {
+            node->kind = NODE_MEMORY;
+        }
+    } else if (str_eq(pname, "compatible")) {
+        uint8_t kind = kind_from_compatible(val, len);
+        if (kind != NODE_OTHER) {
+            node->kind = kind;
+        }
+    } else if (str_eq(pname, "timebase-frequency") && !(*found & FOUND_TB) &&
+               (node->kind == NODE_CPUS || node->kind == NODE_CPU)) {
+        // Usually one cell on /cpus, but a cpu node may carry it and two cells are legal.
+        if (len == 4 || len == 8) {
+            out->timebase_hz = len == 8 ? be64(val) : be32(val);
+            *found |= FOUND_TB;
+        }
+    }
+}
+
+int fdt_parse(uint64_t dtb, struct fdt_info *out) {
+    const uint8_t *blob = (const uint8_t *)dtb;
+    if (!blob || be32(blob) != FDT_MAGIC) {
+        return -1;
+    }
+    struct fdt_header h = {
+        .magic = FDT_MAGIC,
+        .totalsize = be32(blob + 4),
+        .off_dt_struct = be32(blob + 8),
+        .off_dt_strings = be32(blob + 12),
+        .off_mem_rsvmap = be32(blob + 16),
+        .version = be32(blob + 20),
+        .last_comp_version = be32(blob + 24),
+        .boot_cpuid_phys = be32(blob + 28),
+        .size_dt_strings = be32(blob + 32),
+        .size_dt_struct = be32(blob + 36),
+    };
+    if (h.version < 16 || h.off_dt_struct >= h.totalsize || h.off_dt_strings >= h.totalsize ||
+        h.off_mem_rsvmap >= h.totalsize) {
+        return -1;
+    }
+    // Version 16 headers stop before the block sizes; bound the blocks by the blob.
+    uint32_t struct_size = h.version >= 17 ? h.size_dt_struct : h.totalsize - h.off_dt_struct;
+    uint32_t strings_size = h.version >= 17 ? h.size_dt_strings : h.totalsize - h.off_dt_strings;
+    if (struct_size > h.totalsize - h.off_dt_struct ||
+        strings_size > h.totalsize - h.off_dt_strings) {
+        return -1;
+    }
+    out->dtb_size = h.totalsize;
+
+    // Memory reservation block: (address, size) pairs up to a zero-sized entry.
+    uint32_t found = 0;
+    for (uint32_t off = h.off_mem_rsvmap; off + 16 <= h.totalsize; off += 16) {
+        uint64_t base = be64(blob + off);
+        uint64_t size = be64(blob + off + 8);
+        if (base == 0 && size == 0) {
+            break;
+        }
+        add_region(out->rsv, &out->nrsv, FDT_MAX_RSV, &out->dropped, base, size);
+    }
+
+    // Structure block: nodes and properties, one token at a time.
+    const uint8_t *p = blob + h.off_dt_struct;
+    const uint8_t *end = p + struct_size;
+    const char *strings = (const char *)blob + h.off_dt_strings;
+    struct fdt_node stack[FDT_MAX_DEPTH];
+    int depth = -1;       // Depth of the current node; -1 outside the root.
+    uint32_t harts = 0;
+    uint32_t isa = ~0u, isa_seen = 0; // Extensions common to the harts that list theirs.
+
+    // The root's "parent" supplies the default cell sizes for the root's reg.
+    struct fdt_node top = { .addr_cells = 2, .size_cells = 1 };
+
+    while (p + 4 <= end) {
+        uint32_t token = be32(p);
+        p += 4;
+        if (token == FDT_BEGIN_NODE) {
+            const char *name = (const char *)p;
+            while (p < end && *p) {
+                p++;
+            }
+            p = (const uint8_t *)(((uint64_t)p + 4) & ~3UL); // Skip the NUL and pad.
+            depth++;
+            if (depth < FDT_MAX_DEPTH) {
+                struct fdt_node *parent = depth ? &stack[depth - 1] : &top;
+                struct fdt_node *node = &stack[depth];
+                node->addr_cells = 2;
+                node->size_cells = 1;
+                node->reg = NULL;
+                node->reg_len = 0;
+                node->irq = 0;
+                node->isa = 0;
+                node->has_isa = 0;
+                node->disabled = 0;
+                node->kind = kind_from_name(name, depth, parent);
+            }
+        } else if (token == FDT_END_NODE) {
+            if (depth < 0) {
+                break;
+            }
+            if (depth < FDT_MAX_DEPTH) {
+                struct fdt_node *parent = depth ? &stack[depth - 1] : &top;
+                if (stack[depth].kind == NODE_CPU && !stack[depth].disabled) {
+                    harts++;
+                    if (stack[depth].has_isa) {
+                        isa &= stack[depth].isa;
+                        isa_seen = 1;
+                    }
+                }
+                finish_node(&stack[depth], parent, out, &found);
+            }
+            depth--;
+        } else if (token == FDT_PROP) {
+            if (p + 8 > end) {
+                break;
+            }
+            uint32_t len = be32(p);
+            uint32_t nameoff = be32(p + 4);
+            const uint8_t *val = p + 8;
+            p = val + ((len + 3) & ~3u);
+            if (p > end || nameoff >= strings_size) {
+                break;
+            }
+            if (depth >= 0 && depth < FDT_MAX_DEPTH) {
+                parse_prop(&stack[depth], strings + nameoff, val, len, out, &found);
+            }
+        } else if (token == FDT_NOP) {
+            continue;
+        } else {
+            // FDT_END or a corrupt token.
+            if (token != FDT_END) {
+                klog(KLOG_WARN, "fdt: bad token %x at offset %x, stopping.", token,
+                     (uint64_t)(p - 4 - blob));
+            }
+            break;
+        }
+    }
+
+    // A tree without cpu nodes says nothing about the hart count; keep the default.
+    if (harts) {
+        out->nharts = harts;
+    }
+    if (isa_seen) {
+        out->isa_ext = isa;
+    }
+    return 0;
+}
@@ -0,0 +1,54 @@
+#ifndef FDT_H
+#define FDT_H
+
+#include <stdint.h>
+
+/*
+ * Flattened device tree (DTB) parsing.
+ *
+ * fdt_parse() makes one pass over the structure block and keeps only what
+ * the kernel needs to size itself: RAM, regions firmware asked us to leave
+ * alone, the number of harts, the timebase and the bases of the devices we
+ * drive. Nothing points back into the blob afterwards, so the memory it
+ * occupies can be reused once the allocator is up.
+ */
+
+#define FDT_MAGIC 0xd00dfeedu
+
+#define FDT_MAX_MEM   8  // /memory ranges kept; further ones are dropped.
+#define FDT_MAX_RSV  16  // Reserved ranges kept (memreserve block and /reserved-memory).
+
+struct fdt_region {
+    uint64_t base;
+    uint64_t size;
+};
+
+/*
+ * Fields fdt_parse() finds nothing for keep the value the caller put there,
+ * so callers fill in their defaults first. Ranges are appended to 'mem' and
+ * 'rsv'.
+ */
+struct fdt_info {
+    struct fdt_region mem[FDT_MAX_MEM];
+    uint32_t nmem;
+    struct fdt_region rsv[FDT_MAX_RSV];
+    uint32_t nrsv;
+    uint32_t dropped;        // Memory or reserved ranges that did not fit above.
+    uint32_t nharts;         // Enabled cpu nodes under /cpus.
+    uint32_t isa_ext;        // ISA_EXT() letters every enabled hart lists; 0 if none says.
+    uint64_t timebase_hz;    // /cpus timebase-frequency.
+    struct fdt_region clint; // riscv,clint0
+    struct fdt_region plic;  // riscv,plic0
+    struct fdt_region uart;  // First ns16550(a).
+    uint32_t uart_irq;
+    uint64_t dtb_size;       // totalsize from the header.
+};
+
+/*
+ * Parse the DTB at physical address 'dtb' into 'out'.
+ * Returns 0 on success, -1 if there is no valid DTB there ('out' is then
+ * left untouched).
+ */
+int fdt_parse(uint64_t dtb, struct fdt_info *out);
+
+#endif // FDT_H
@@ -0,0 +1,64 @@
+#include "futex.h"
+#include "wait.h"
+#include "fault.h"
+#include "timer.h"
+#include "syscall.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Hash buckets; static storage, so they start out empty and unlocked.
+static struct wait_queue futex_queues[FUTEX_BUCKETS];
+
+static struct wait_queue *futex_queue(uint64_t key) {
+    return &futex_queues[((key >> 2) * 0x9E3779B97F4A7C15UL) >> 58];
+}
+
+/*
+ * Kernel address of the futex word, which is also its physical address and
+ * so its key. It is resolved for writing: a copy-on-write page is split
+ * first, so the key is the frame this process keeps rather than one it
+ * still shares with a fork relative.
+ */
+static uint32_t *futex_word(uint64_t uaddr, int64_t *err) {
+    if (uaddr & 3) {
+        *err = -EINVAL;
+        return NULL;
+    }
+    uint32_t *word = user_kaddr(uaddr, 1);
+    if (!word) {
+        *err = -EFAULT;
+    }
+    return word;
+}
+
+int64_t futex_wait(uint64_t uaddr, uint32_t expected, uint64_t timeout_us) {
+    int64_t err;
+    uint32_t *word = futex_word(uaddr, &err);
+    if (!word) {
+        return err;
+    }
+    uint64_t deadline = timeout_us ? r_time() + timer_us_to_ticks(timeout_us) : TIMER_NEVER;
+    uint64_t key = (uint64_t)word;
+    struct wait_queue *wq = futex_queue(key);
+
+    // A waker changes the word before it takes the bucket lock, so either
+    // the change is visible here or the wakeup finds this waiter queued.
+    uint64_t flags = spin_lock_irqsave(&wq->lock);
+    if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != expected) {
+        spin_unlock_irqrestore(&wq->lock, flags);
+        return -EAGAIN;
+    }
+    return wait_queue_sleep(wq, key, deadline, flags) == 0 ? 0 : -ETIMEDOUT;
+}
+
+int64_t futex_wake(uint64_t uaddr, uint32_t n) {
+    int64_t err;
+    uint32_t *word = futex_word(uaddr, &err);
+    if (!word) {
+        return err;
+    }
+    uint64_t key = (uint64_t)word;
+    return wait_queue_wake(futex_queue(key), key, n);
+}
@@ -0,0 +1,27 @@
+#ifndef FUTEX_H
+#define FUTEX_H
+
+#include <stdint.h>
+
+/*
+ * Futexes: user-space locks that only enter the kernel under contention.
+ *
+ * A futex is an aligned 32-bit word in user memory. Waiters sleep on the
+ * physical address of the word, hashed into FUTEX_BUCKETS wait queues, so
+ * every mapping of the same frame names the same futex.
+ */
+
+#define FUTEX_BUCKETS 64
+
+/*
+ * If the word at 'uaddr' still holds 'expected', sleep until futex_wake()
+ * on it or for 'timeout_us' microseconds (0: no timeout).
+ * Returns 0 when woken, -EAGAIN if the word had changed, -ETIMEDOUT, or
+ * -EINVAL / -EFAULT for a bad address.
+ */
+int64_t futex_wait(uint64_t uaddr, uint32_t expected, uint64_t timeout_us);
+
+// Wake up to 'n' waiters on the word at 'uaddr'. Returns how many, or a negative error.
+int64_t futex_wake(uint64_t uaddr, uint32_t n);
+
+#endif // FUTEX_H
@@ -0,0 +1,258 @@
+#include "ipc.h"
+#include "proc.h"
+#include "sched.h"
+#include "smp.h"
+#include "vm.h"
+#include "mem.h"
+#include "fault.h"
+#include "spinlock.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Check the receive window of the current process: page-aligned, in the
+ * user range, and with nothing declared or mapped there yet.
+ */
+static int64_t window_check(struct proc *p, uint64_t window, uint64_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    if (((window | len) & (PAGE_SIZE - 1)) != 0 || window >= VM_USER_END ||
+        VM_USER_END - window < len) {
+        return -EINVAL;
+    }
+    for (struct vm_region *r = p->regions; r; r = r->next) {
+        if (window < r->end && r->start < window + len) {
+            return -EINVAL;
+        }
+    }
+    for (uint64_t off = 0; off < len; off += PAGE_SIZE) {
+        if (vm_walk(p->pagetable, window + off, NULL)) {
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Fault in the pages of the current process's grant so that ipc_grant()
+ * finds private 4 KiB frames. A writable grant splits copy-on-write pages,
+ * and so does any grant that is not a move: the sender must keep the frame
+ * it shares rather than copy it on its next store.
+ */
+static int64_t grant_prepare(const struct ipc_msg *m) {
+    if (m->grant_len == 0) {
+        return 0;
+    }
+    if (((m->grant_va | m->grant_len) & (PAGE_SIZE - 1)) != 0 ||
+        m->grant_len > IPC_GRANT_MAX || m->grant_va >= VM_USER_END ||
+        VM_USER_END - m->grant_va < m->grant_len) {
+        return -EINVAL;
+    }
+    int write = (m->grant_flags & IPC_GRANT_WRITE) != 0;
+    int move = (m->grant_flags & IPC_GRANT_MOVE) != 0;
+    for (uint64_t off = 0; off < m->grant_len; off += PAGE_SIZE) {
+        uint64_t va = m->grant_va + off;
+        uint64_t *pte = vm_walk(myproc()->pagetable, va, NULL);
+        int split = write || (!move && pte && PTE_IS_COW(*pte));
+        if (!user_kaddr(va, split)) {
+            return -EFAULT;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Map the grant of message 'm' from 'src' into the receive window of 'dst'.
+ * Each frame gains a reference for the new mapping. A move then unmaps it
+ * from 'src', which drops that side's reference, and 'dst' owns it as
+ * 'src' did. Otherwise both sides map it PTE_SHARED, so a later fork of
+ * either keeps it shared and writable instead of copy-on-write. 'src' is either
+ * the current process or asleep in ipc_send(), and 'dst' either current or
+ * asleep in ipc_recv(), so neither address space changes underneath.
+ * Called with dst's endpoint lock held. Returns 0 or a negative error.
+ */
+static int64_t ipc_grant(struct proc *src, struct proc *dst, const struct ipc_msg *m) {
+    uint64_t len = m->grant_len;
+    uint64_t window = dst->ipc.window;
+    if (len == 0) {
+        return 0;
+    }
+    if (len > dst->ipc.window_len) {
+        return -EMSGSIZE;
+    }
+
+    uint64_t perm = PTE_R | ((m->grant_flags & IPC_GRANT_WRITE) ? PTE_W : 0);
+    int move = (m->grant_flags & IPC_GRANT_MOVE) != 0;
+    int64_t err = 0;
+    uint64_t off;
+    for (off = 0; off < len; off += PAGE_SIZE) {
+        int level;
+        uint64_t *pte = vm_walk(src->pagetable, m->grant_va + off, &level);
+        // Only frames the sender owns or shares can be granted, and never a COW one writably.
+        if (!pte || level != 0 || !(*pte & PTE_U) || !PTE_REFCOUNTED(*pte) ||
+            ((perm & PTE_W) && !(*pte & PTE_W))) {
+            err = -EINVAL;
+            break;
+        }
+        void *frame = (void *)PTE2PA(*pte);
+        uint64_t share = (move && (*pte & PTE_OWNED)) ? PTE_OWNED : PTE_SHARED;
+        pfa_ref(frame);
+        if (vm_map(dst->pagetable, window + off, (uint64_t)frame,
+                   perm | PTE_U | PTE_A | PTE_D | share) != 0) {
+            if (pfa_unref(frame) == 0) {
+                pfa_free(frame);
+            }
+            err = -ENOMEM;
+            break;
+        }
+    }
+    if (err == 0 && proc_add_region(dst, window, len, perm) != 0) {
+        err = -ENOMEM;
+    }
+    if (err != 0) {
+        if (off > 0) {
+            vm_unmap_range(dst->pagetable, window, off, vm_asid_get(&dst->asid));
+        }
+        return err;
+    }
+
+    if (!move) {
+        // The sender's side becomes shared too. Only software bits change,
+        // so there is nothing to flush.
+        for (off = 0; off < len; off += PAGE_SIZE) {
+            uint64_t *pte = vm_walk(src->pagetable, m->grant_va + off, NULL);
+            if (!PTE_IS_COW(*pte)) {
+                *pte = (*pte & ~PTE_OWNED) | PTE_SHARED;
+            }
+        }
+    } else {
+        vm_unmap_range(src->pagetable, m->grant_va, len, vm_asid_get(&src->asid));
+        // The unmap flushed this hart only. Retiring the ASID leaves stale
+        // entries on other harts tagged with one the sender never uses again.
+        src->asid = 0;
+        if (src == mycpu()->proc) {
+            vm_switch(src->pagetable, &src->asid);
+        }
+    }
+    return 0;
+}
+
+int64_t ipc_send(uint64_t pid, const struct ipc_msg *msg) {
+    struct proc *self = myproc();
+    if (pid == self->pid || (msg->grant_flags & ~IPC_GRANT_FLAGS) != 0) {
+        return -EINVAL;
+    }
+    int64_t err = grant_prepare(msg);
+    if (err != 0) {
+        return err;
+    }
+
+    // The endpoint lock keeps the receiver from exiting under us.
+    uint64_t flags = intr_save();
+    struct proc *dst = proc_find_locked(pid);
+    if (!dst) {
+        intr_restore(flags);
+        return -ESRCH;
+    }
+    struct ipc_endpoint *ep = &dst->ipc;
+    if (ep->receiving && (ep->recv_from == IPC_ANY || ep->recv_from == self->pid)) {
+        // Fast path: the receiver is waiting for us. Hand it the message
+        // and the CPU.
+        err = ipc_grant(self, dst, msg);
+        if (err != 0) {
+            spin_unlock_irqrestore(&ep->lock, flags);
+            return err;
+        }
+        ep->msg = *msg;
+        ep->msg.from = self->pid;
+        ep->receiving = 0;
+        spin_unlock(&ep->lock);
+        sched_yield_to(dst);
+        intr_restore(flags);
+        return 0;
+    }
+
+    // Queue on the receiver; it maps the grant when it takes the message.
+    struct ipc_waiter w;
+    w.proc = self;
+    w.msg = *msg;
+    w.msg.from = self->pid;
+    w.result = 0;
+    w.next = NULL;
+    if (ep->senders_tail) {
+        ep->senders_tail->next = &w;
+    } else {
+        ep->senders = &w;
+    }
+    ep->senders_tail = &w;
+
+    // Only the receiver taking the message, or its exit, wakes a queued
+    // sender, and the endpoint may be gone from then on: do not touch it.
+    sched_block(&ep->lock, TIMER_NEVER);
+    intr_restore(flags);
+    return w.result;
+}
+
+int64_t ipc_recv(uint64_t pid, uint64_t window, uint64_t window_len, struct ipc_msg *out) {
+    struct proc *self = myproc();
+    int64_t err = window_check(self, window, window_len);
+    if (err != 0) {
+        return err;
+    }
+
+    struct ipc_endpoint *ep = &self->ipc;
+    uint64_t flags = spin_lock_irqsave(&ep->lock);
+    ep->window = window;
+    ep->window_len = window_len;
+
+    // A queued sender first. One whose grant cannot be mapped fails alone.
+    struct ipc_waiter **pp = &ep->senders;
+    struct ipc_waiter *prev = NULL;
+    while (*pp) {
+        struct ipc_waiter *w = *pp;
+        if (pid != IPC_ANY && w->msg.from != pid) {
+            prev = w;
+            pp = &w->next;
+            continue;
+        }
+        *pp = w->next;
+        if (ep->senders_tail == w) {
+            ep->senders_tail = prev;
+        }
+        w->result = ipc_grant(w->proc, self, &w->msg);
+        if (w->result == 0) {
+            *out = w->msg;
+        }
+        err = w->result;
+        sched_wakeup(w->proc);
+        if (err == 0) {
+            spin_unlock_irqrestore(&ep->lock, flags);
+            return 0;
+        }
+    }
+
+    // Nobody queued: wait for a sender to deposit a message.
+    ep->recv_from = pid;
+    ep->receiving = 1;
+    do {
+        sched_block(&ep->lock, TIMER_NEVER);
+        spin_lock(&ep->lock);
+    } while (ep->receiving);
+    *out = ep->msg;
+    spin_unlock_irqrestore(&ep->lock, flags);
+    return 0;
+}
+
+void ipc_exit(struct proc *p) {
+    struct ipc_endpoint *ep = &p->ipc;
+    spin_lock(&ep->lock);
+    while (ep->senders) {
+        struct ipc_waiter *w = ep->senders;
+        ep->senders = w->next;
+        w->result = -ESRCH;
+        sched_wakeup(w->proc);
+    }
+    ep->senders_tail = NULL;
+    spin_unlock(&ep->lock);
+}
@@ -0,0 +1,66 @@
+#ifndef IPC_H
+#define IPC_H
+
+#include <stdint.h>
+#include "spinlock.h"
+#include "syscall.h"  // IPC_MSG_WORDS, IPC_GRANT_*.
+
+struct proc;
+
+/*
+ * Synchronous message passing between processes (SYS_IPC_SEND/RECV).
+ *
+ * Every process is an endpoint. A sender that finds its receiver waiting
+ * deposits the message and switches to it directly; otherwise it queues on
+ * the receiver and sleeps until the receiver takes the message. Page grants
+ * travel with a message by mapping the sender's frames into the receiver's
+ * window; nothing is copied.
+ */
+
+struct ipc_msg {
+    uint64_t from;                  // Sender pid.
+    uint64_t words[IPC_MSG_WORDS];
+    uint64_t grant_va;              // Sender address of the grant.
+    uint64_t grant_len;             // 0: no grant.
+    uint64_t grant_flags;           // IPC_GRANT_*.
+};
+
+// A sender queued on its receiver, on the sender's kernel stack.
+struct ipc_waiter {
+    struct proc *proc;
+    struct ipc_msg msg;
+    int64_t result;                 // Set, under the receiver's lock, before the wakeup.
+    struct ipc_waiter *next;
+};
+
+struct ipc_endpoint {
+    struct spinlock lock;
+    struct ipc_waiter *senders;     // Queued senders, oldest first.
+    struct ipc_waiter *senders_tail;
+    int receiving;                  // Blocked in ipc_recv() with the fields below.
+    uint64_t recv_from;             // Sender accepted, or IPC_ANY.
+    uint64_t window;                // Where a grant is mapped.
+    uint64_t window_len;
+    struct ipc_msg msg;             // Message handed to the blocked receiver.
+};
+
+/*
+ * Send a message (and optional grant) to process 'pid' and wait until it
+ * is received. Returns 0, or a negative error for the sender.
+ */
+int64_t ipc_send(uint64_t pid, const struct ipc_msg *msg);
+
+/*
+ * Receive a message from 'pid' (IPC_ANY: from anyone) into '*out', with
+ * grants mapped at 'window' (up to 'window_len' bytes). Returns 0 or a
+ * negative error.
+ */
+int64_t ipc_recv(uint64_t pid, uint64_t window, uint64_t window_len, struct ipc_msg *out);
+
+/*
+ * Fail every sender queued on the exiting process 'p' with -ESRCH. 'p' is
+ * off the process list already, so no new sender can queue. Interrupts are off.
+ */
+void ipc_exit(struct proc *p);
+
+#endif // IPC_H
@@ -1,60 +1,215 @@
 #include "uart.h"
+#include "klog.h"
+#include "panic.h"
 #include "mem.h"
+#include "slab.h"
 #include "trap.h"
 #include "vm.h"
 #include "proc.h"      // Include process management.
+#include "sched.h"
+#include "smp.h"
+#include "timer.h"
+#include "plic.h"
+#include "fdt.h"
+#include "kstring.h"
+#ifdef CHIMERA_BENCH
+#include "bench.h"
+#endif
 #include <stdint.h>
 
+// Physical memory of the virt machine as QEMU configures it by default,
+// assumed when the device tree has no /memory node.
+#define MEM_START_ADDR 0x80000000UL
+#define MEM_SIZE_BYTES (128UL * 1024 * 1024)
+
+// Register windows of the default devices, for when the device tree has no 'reg' size.
+#define CLINT_DEFAULT_SIZE 0x10000UL
+#define PLIC_DEFAULT_SIZE  0x600000UL
+#define UART_DEFAULT_SIZE  0x100UL
+
+// Start and end of the kernel image (bss included), from linker.ld.
+extern char _text_start[];
+extern char _memory_end[];
+
+// What the boot hart learned from the device tree.
+static struct fdt_info boot_info;
+
+// RAM handed to the frame allocator and identity-mapped by the kernel.
+static uint64_t ram_base, ram_size;
+
 // Externally defined trap vector from trap.S.
 extern void __trap_vector(void);
 // Externally defined user process.
 extern void user_process_1(void);
 
-void kmain(uint64_t hartid, uint64_t dtb_paddr) {
-    uart_puts("Chimera OS: kmain entered.\n");
-    uart_puts("Hart ID: ");
-    uart_puts_hex(hartid);
-    uart_puts("\n");
-    uart_puts("DTB Physical Address: ");
-    uart_puts_hex(dtb_paddr);
-    uart_puts("\n");
+/*
+ * Per-hart trap and timer setup, run by every hart before it schedules.
+ */
+static void hart_init(uint64_t hartid) {
+    cpus[hartid].hartid = hartid;
 
     // Install trap vector.
     asm volatile("csrw stvec, %0" : : "r"((uint64_t)__trap_vector));
-    uart_puts("Trap vector installed.\n");
-
-    // Initialize timer interrupts.
-    // (Timer interrupt setup remains from previous code.)
-    {
-        volatile uint64_t *mtime = (volatile uint64_t *)0x200BFF8;
-        volatile uint64_t *mtimecmp = (volatile uint64_t *)(0x2004000 + (0 * 8));
-        *mtimecmp = *mtime + 1000000ULL;
-        
-        uint64_t sie;
-        asm volatile("csrr %0, sie" : "=r"(sie));
-        sie |= (1 << 5);
-        asm volatile("csrw sie, %0" :: "r"(sie));
-        
-        uint64_t sstatus;
-        asm volatile("csrr %0, sstatus" : "=r"(sstatus));
-        sstatus |= (1 << 1);
-        asm volatile("csrw sstatus, %0" :: "r"(sstatus));
-    }
-
-    // Enable virtual memory.
-    // (Assume enable_virtual_memory() is defined in kernel.c or another file, as before.)
-    extern void enable_virtual_memory(void);
-    enable_virtual_memory();
-
-    // Initialize process table.
+
+    // Timer interrupts only arrive once something arms a timer on this hart.
+    timer_init_hart();
+    plic_init_hart();
+    smp_init_hart();
+}
+
+/*
+ * Read the device tree and point the drivers at what it describes. Anything
+ * it leaves out keeps the QEMU virt value.
+ */
+static void platform_init(uint64_t dtb_paddr) {
+    boot_info = (struct fdt_info){
+        .nharts = NHART,
+        .timebase_hz = TIMER_HZ_DEFAULT,
+        .clint = { CLINT_BASE_DEFAULT, CLINT_DEFAULT_SIZE },
+        .plic = { PLIC_BASE_DEFAULT, PLIC_DEFAULT_SIZE },
+        .uart = { UART_BASE_DEFAULT, UART_DEFAULT_SIZE },
+        .uart_irq = UART0_IRQ,
+    };
+    if (fdt_parse(dtb_paddr, &boot_info) != 0) {
+        klog(KLOG_WARN, "No device tree at %p, assuming QEMU virt defaults.", dtb_paddr);
+    }
+    if (boot_info.nmem == 0) {
+        boot_info.mem[0] = (struct fdt_region){ MEM_START_ADDR, MEM_SIZE_BYTES };
+        boot_info.nmem = 1;
+    }
+    if (boot_info.dropped) {
+        klog(KLOG_WARN, "Device tree: %u memory ranges ignored (table full).", boot_info.dropped);
+    }
+    if (boot_info.timebase_hz == 0) {
+        boot_info.timebase_hz = TIMER_HZ_DEFAULT;
+    }
+    if (boot_info.nharts > NHART) {
+        klog(KLOG_WARN, "%u harts present, only %u are used.", boot_info.nharts, NHART);
+    }
+
+    timer_hz = boot_info.timebase_hz;
+    timer_clint_base = boot_info.clint.base;
+    plic_set_base(boot_info.plic.base);
+    uart_set_base(boot_info.uart.base, boot_info.uart_irq);
+    klog(KLOG_INFO, "Platform: %u harts, timebase %u Hz.", boot_info.nharts, boot_info.timebase_hz);
+    klog(KLOG_INFO, "Devices: CLINT %p, PLIC %p, UART %p (irq %u).", boot_info.clint.base,
+         boot_info.plic.base, boot_info.uart.base, boot_info.uart_irq);
+}
+
+/*
+ * The allocator manages one span: from the kernel image up to the end of
+ * the highest RAM bank above it. Holes between banks, firmware-reserved
+ * ranges and the device tree blob are taken back out of it.
+ */
+static void memory_init(uint64_t dtb_paddr) {
+    uint64_t kbase = (uint64_t)_text_start;
+    uint64_t lo = 0, hi = 0;
+    for (uint32_t i = 0; i < boot_info.nmem; i++) {
+        struct fdt_region *r = &boot_info.mem[i];
+        if (kbase >= r->base && kbase < r->base + r->size) {
+            lo = kbase;
+            hi = r->base + r->size;
+        }
+    }
+    if (hi == 0) {
+        panic("memory_init: no RAM bank holds the kernel image");
+    }
+    for (uint32_t i = 0; i < boot_info.nmem; i++) {
+        struct fdt_region *r = &boot_info.mem[i];
+        if (r->base >= lo && r->base + r->size > hi) {
+            hi = r->base + r->size;
+        } else if (r->base + r->size <= lo) {
+            klog(KLOG_WARN, "RAM bank at %p below the kernel is not used.", r->base);
+        }
+    }
+    ram_base = lo;
+    ram_size = hi - lo;
+    pfa_init_range(ram_base, ram_size, (uint64_t)_memory_end - ram_base);
+
+    // Cover [lo, hi) with banks in address order; whatever they leave out is a hole.
+    uint64_t cursor = lo;
+    while (cursor < hi) {
+        uint64_t next = hi, next_end = hi;
+        for (uint32_t i = 0; i < boot_info.nmem; i++) {
+            struct fdt_region *r = &boot_info.mem[i];
+            if (r->base + r->size > cursor && r->base < next) {
+                next = r->base;
+                next_end = r->base + r->size;
+            }
+        }
+        if (next > cursor) {
+            pfa_reserve_range(cursor, next - cursor);
+        }
+        cursor = next_end;
+    }
+
+    for (uint32_t i = 0; i < boot_info.nrsv; i++) {
+        struct fdt_region *r = &boot_info.rsv[i];
+        if (pfa_reserve_range(r->base, r->size) != 0) {
+            klog(KLOG_WARN, "Reserved range %p (%x bytes) overlaps the kernel or allocator data.",
+                 r->base, r->size);
+        }
+    }
+    if (boot_info.dtb_size) {
+        pfa_reserve_range(dtb_paddr, boot_info.dtb_size);
+    }
+}
+
+void kmain(uint64_t hartid, uint64_t dtb_paddr) {
+    klog(KLOG_INFO, "Chimera OS: kmain entered on hart %u, DTB at %p.", hartid, dtb_paddr);
+
+    platform_init(dtb_paddr);
+    kstring_init(boot_info.isa_ext);
+    timer_init();
+    plic_init();
+    hart_init(hartid);
+    klog(KLOG_INFO, "Trap vector installed.");
+
+    // Initialize the physical frame allocator and the slab allocator on top of it.
+    memory_init(dtb_paddr);
+    kmem_init();
+
+    // Enable virtual memory, with the devices mapped wherever the board puts them.
+    enable_virtual_memory(ram_base, ram_size);
+    if (vm_map_mmio(boot_info.clint.base, boot_info.clint.size) != 0 ||
+        vm_map_mmio(boot_info.plic.base, boot_info.plic.size) != 0 ||
+        vm_map_mmio(boot_info.uart.base, boot_info.uart.size) != 0) {
+        klog(KLOG_ERR, "cannot map the device registers.");
+    }
+
+    // Initialize process table and run queues.
     proc_init();
+    sched_init();
+
+#ifdef CHIMERA_BENCH
+    // Benchmark build: measure, report and power off instead of booting on.
+    bench_run();
+#endif
+
+    // From here on console output is buffered and drained by the UART interrupt.
+    uart_init();
 
     // Create our first user process.
     proc_create_user(user_process_1);
 
-    // Start scheduler loop.
+    // Let the secondary harts join, then start this hart's scheduler loop.
+    smp_release();
     scheduler();
 
     // Should never reach here.
     while (1) {}
 }
+
+/*
+ * Entry point for harts other than hart 0 (see boot.S).
+ * They wait until the boot hart has set up the shared kernel state.
+ */
+void kmain_secondary(uint64_t hartid) {
+    smp_wait_release();
+
+    hart_init(hartid);
+    vm_init_hart();
+    scheduler();
+
+    while (1) {}
+}
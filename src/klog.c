@@ -0,0 +1,234 @@
+#include "klog.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "timer.h"
+#include "uart.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Longest line the drainer renders; the rest of a record is cut off.
+#define KLOG_LINE_MAX 160
+
+struct klog_rec {
+    uint64_t ts;                   // time CSR when logged.
+    const char *fmt;
+    uint64_t args[KLOG_MAX_ARGS];
+    uint8_t level;
+    uint8_t nargs;
+};
+
+/*
+ * Single-producer ring: only the owning hart (with interrupts off) writes
+ * records and advances 'head'; only the drainer advances 'tail'.
+ */
+struct klog_ring {
+    uint32_t head;
+    uint32_t tail;
+    uint64_t dropped;              // Records lost to a full ring, reported by the drainer.
+    struct klog_rec recs[KLOG_RING_SIZE];
+} __attribute__((aligned(64)));
+
+static struct klog_ring klog_rings[NHART];
+static struct spinlock klog_drain_lock = SPINLOCK_INIT;
+
+int klog_threshold = KLOG_INFO;
+
+void klog_emit(int level, const char *fmt, const uint64_t *args, unsigned int nargs) {
+    if (level > klog_threshold) {
+        return;
+    }
+    if (nargs > KLOG_MAX_ARGS) {
+        nargs = KLOG_MAX_ARGS;
+    }
+    uint64_t flags = intr_save();
+    struct klog_ring *r = &klog_rings[cpuid()];
+    uint32_t head = r->head;
+
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= KLOG_RING_SIZE) {
+        r->dropped++;
+    } else {
+        struct klog_rec *rec = &r->recs[head % KLOG_RING_SIZE];
+        rec->ts = r_time();
+        rec->fmt = fmt;
+        rec->level = level;
+        rec->nargs = nargs;
+        for (unsigned int i = 0; i < nargs; i++) {
+            rec->args[i] = args[i];
+        }
+        __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    }
+    intr_restore(flags);
+}
+
+/*
+ * Minimal line builder for the drainer.
+ */
+struct klog_line {
+    char buf[KLOG_LINE_MAX];
+    uint32_t len;
+};
+
+static void line_putc(struct klog_line *l, char c) {
+    if (l->len < KLOG_LINE_MAX - 1) {
+        l->buf[l->len++] = c;
+    }
+}
+
+static void line_puts(struct klog_line *l, const char *s) {
+    while (*s) {
+        line_putc(l, *s++);
+    }
+}
+
+static void line_putu(struct klog_line *l, uint64_t v, unsigned int base, int min_digits) {
+    char tmp[20];
+    int n = 0;
+    do {
+        unsigned int d = v % base;
+        tmp[n++] = (d < 10) ? '0' + d : 'a' + (d - 10);
+        v /= base;
+    } while (v);
+    while (n < min_digits) {
+        tmp[n++] = '0';
+    }
+    while (n) {
+        line_putc(l, tmp[--n]);
+    }
+}
+
+static void render(struct klog_line *l, uint64_t hart, const struct klog_rec *rec) {
+    static const char level_tag[] = { 'E', 'W', 'I', 'D' };
+    uint64_t usec = timer_ticks_to_us(rec->ts);
+
+    l->len = 0;
+    line_putc(l, '[');
+    line_putu(l, usec / 1000000, 10, 1);
+    line_putc(l, '.');
+    line_putu(l, usec % 1000000, 10, 6);
+    line_puts(l, "] h");
+    line_putu(l, hart, 10, 1);
+    line_putc(l, ' ');
+    line_putc(l, rec->level < sizeof(level_tag) ? level_tag[rec->level] : '?');
+    line_puts(l, ": ");
+
+    unsigned int arg = 0;
+    for (const char *f = rec->fmt; *f; f++) {
+        if (*f != '%') {
+            line_putc(l, *f);
+            continue;
+        }
+        f++;
+        while (*f == 'l') {
+            f++; // Every argument is 64-bit already.
+        }
+        if (*f == '%') {
+            line_putc(l, '%');
+            continue;
+        }
+        if (*f == '\0') {
+            break;
+        }
+        uint64_t v = (arg < rec->nargs) ? rec->args[arg] : 0;
+        arg++;
+        switch (*f) {
+        case 'd':
+        case 'i':
+            if ((int64_t)v < 0) {
+                line_putc(l, '-');
+                v = -v;
+            }
+            line_putu(l, v, 10, 1);
+            break;
+        case 'u':
+            line_putu(l, v, 10, 1);
+            break;
+        case 'x':
+            line_putu(l, v, 16, 1);
+            break;
+        case 'p':
+            line_puts(l, "0x");
+            line_putu(l, v, 16, 16);
+            break;
+        case 'c':
+            line_putc(l, (char)v);
+            break;
+        case 's':
+            line_puts(l, v ? (const char *)v : "(null)");
+            break;
+        default:
+            line_putc(l, '?');
+            break;
+        }
+    }
+    if (l->len == 0 || l->buf[l->len - 1] != '\n') {
+        line_putc(l, '\n');
+    }
+}
+
+/*
+ * Emit up to 'budget' records in timestamp order. Caller is the only
+ * consumer (holds klog_drain_lock, or is panicking).
+ */
+static unsigned int drain_locked(unsigned int budget) {
+    struct klog_line line;
+    unsigned int done = 0;
+
+    for (uint64_t h = 0; h < NHART; h++) {
+        struct klog_ring *r = &klog_rings[h];
+        uint64_t dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped) {
+            line.len = 0;
+            line_puts(&line, "klog: hart ");
+            line_putu(&line, h, 10, 1);
+            line_puts(&line, " dropped ");
+            line_putu(&line, dropped, 10, 1);
+            line_puts(&line, " records\n");
+            uart_write(line.buf, line.len);
+        }
+    }
+
+    while (done < budget) {
+        struct klog_ring *oldest = NULL;
+        uint64_t oldest_hart = 0;
+        for (uint64_t h = 0; h < NHART; h++) {
+            struct klog_ring *r = &klog_rings[h];
+            uint32_t tail = r->tail;
+            if (tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) {
+                continue;
+            }
+            if (!oldest || r->recs[tail % KLOG_RING_SIZE].ts <
+                           oldest->recs[oldest->tail % KLOG_RING_SIZE].ts) {
+                oldest = r;
+                oldest_hart = h;
+            }
+        }
+        if (!oldest) {
+            break;
+        }
+        render(&line, oldest_hart, &oldest->recs[oldest->tail % KLOG_RING_SIZE]);
+        __atomic_store_n(&oldest->tail, oldest->tail + 1, __ATOMIC_RELEASE);
+        uart_write(line.buf, line.len);
+        done++;
+    }
+    return done;
+}
+
+void klog_drain(unsigned int budget) {
+    uint64_t flags = intr_save();
+    if (spin_trylock(&klog_drain_lock)) {
+        drain_locked(budget);
+        spin_unlock(&klog_drain_lock);
+    }
+    intr_restore(flags);
+}
+
+void klog_flush(void) {
+    uint64_t flags = intr_save();
+    // Best effort: a panic inside the drainer must still get its records out.
+    int locked = spin_trylock(&klog_drain_lock);
+    while (drain_locked(KLOG_RING_SIZE) > 0) {}
+    if (locked) {
+        spin_unlock(&klog_drain_lock);
+    }
+    intr_restore(flags);
+}
@@ -0,0 +1,59 @@
+#ifndef KLOG_H
+#define KLOG_H
+
+#include <stdint.h>
+
+/*
+ * Kernel log. klog() only copies the format pointer, up to KLOG_MAX_ARGS
+ * raw 64-bit arguments and a timestamp into the calling hart's ring; the
+ * text is rendered later by klog_drain(), off the hot path. Formats must
+ * be string literals (they are kept by address), and so must any "%s"
+ * argument. Supported conversions: %d %u %x %p %c %s %%.
+ */
+enum klog_level {
+    KLOG_ERR = 0,
+    KLOG_WARN,
+    KLOG_INFO,
+    KLOG_DEBUG,
+};
+
+#define KLOG_MAX_ARGS 5
+
+// Records per hart ring (a power of two). When full, new records are dropped and counted.
+#define KLOG_RING_SIZE 256
+
+// Records emitted per drain from the scheduler tick and from the idle loop.
+#define KLOG_TICK_BUDGET 8
+#define KLOG_IDLE_BUDGET 64
+
+/*
+ * klog(level, "format", args...): arguments are integers or pointers cast
+ * to uint64_t. More than KLOG_MAX_ARGS is a compile-time error.
+ */
+#define KLOG_NARGS(...) (sizeof((const uint64_t[]){ 0, ##__VA_ARGS__ }) / sizeof(uint64_t) - 1)
+
+#define klog(level, fmt, ...)                                                   \
+    do {                                                                        \
+        _Static_assert(KLOG_NARGS(__VA_ARGS__) <= KLOG_MAX_ARGS,                \
+                       "klog: more than KLOG_MAX_ARGS arguments");              \
+        klog_emit((level), (fmt),                                               \
+                  (const uint64_t[KLOG_MAX_ARGS + 1]){ 0, ##__VA_ARGS__ } + 1,  \
+                  KLOG_NARGS(__VA_ARGS__));                                     \
+    } while (0)
+
+// Records above this level are discarded at the call site. Defaults to KLOG_INFO.
+extern int klog_threshold;
+
+// Backend of klog(); arguments past KLOG_MAX_ARGS are dropped.
+void klog_emit(int level, const char *fmt, const uint64_t *args, unsigned int nargs);
+
+/*
+ * Render up to 'budget' pending records, oldest first across all harts,
+ * to the console. Returns immediately if another hart is draining.
+ */
+void klog_drain(unsigned int budget);
+
+// Render every pending record, even if a drain is in progress. For panic().
+void klog_flush(void);
+
+#endif // KLOG_H
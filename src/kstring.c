@@ -0,0 +1,256 @@
+#include "kstring.h"
+#include "klog.h"
+#include "riscv.h"
+#include "vm.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * This file must not be compiled into calls to itself: the Makefile builds
+ * it with -fno-tree-loop-distribute-patterns so that GCC does not turn the
+ * loops below back into memset()/memcpy() calls.
+ */
+
+// RVV routines (kstring_rvv.S). Callers enable sstatus.VS around them.
+void kstring_rvv_memset(void *dst, int c, size_t n);
+void kstring_rvv_memcpy(void *dst, const void *src, size_t n);
+int kstring_rvv_memcmp(const void *a, const void *b, size_t n);
+void kstring_rvv_page_zero(void *page);
+void kstring_rvv_page_copy(void *dst, const void *src);
+uint64_t kstring_rvv_vlenb(void);
+
+// misa, recorded by boot.S.
+extern uint64_t boot_misa;
+
+static int kstring_have_vector;  // Hardware support, fixed by kstring_init().
+static int kstring_use_vector;   // Vector routines selected.
+
+static inline uint64_t vec_begin(void) {
+    uint64_t flags = intr_save();
+    w_sstatus(r_sstatus() | SSTATUS_VS_INITIAL);
+    return flags;
+}
+
+static inline void vec_end(uint64_t flags) {
+    w_sstatus(r_sstatus() & ~SSTATUS_VS_MASK);
+    intr_restore(flags);
+}
+
+void kstring_init(uint32_t dt_isa) {
+    kstring_have_vector = (boot_misa & ISA_EXT('v')) && (dt_isa == 0 || (dt_isa & ISA_EXT('v')));
+    kstring_use_vector = kstring_have_vector;
+    if (kstring_have_vector) {
+        uint64_t flags = vec_begin();
+        uint64_t vlenb = kstring_rvv_vlenb();
+        vec_end(flags);
+        klog(KLOG_INFO, "kstring: RVV routines, VLEN %u bits.", vlenb * 8);
+    } else {
+        klog(KLOG_INFO, "kstring: scalar routines.");
+    }
+}
+
+int kstring_vector_enabled(void) {
+    return kstring_use_vector;
+}
+
+int kstring_set_vector(int on) {
+    int old = kstring_use_vector;
+    kstring_use_vector = on && kstring_have_vector;
+    return old;
+}
+
+// Scalar implementations.
+
+static void scalar_memset(uint8_t *d, int c, size_t n) {
+    while (n && ((uint64_t)d & 7)) {
+        *d++ = (uint8_t)c;
+        n--;
+    }
+    uint64_t pattern = 0x0101010101010101UL * (uint8_t)c;
+    uint64_t *w = (uint64_t *)d;
+    for (; n >= 32; n -= 32, w += 4) {
+        w[0] = pattern;
+        w[1] = pattern;
+        w[2] = pattern;
+        w[3] = pattern;
+    }
+    for (; n >= 8; n -= 8) {
+        *w++ = pattern;
+    }
+    d = (uint8_t *)w;
+    while (n--) {
+        *d++ = (uint8_t)c;
+    }
+}
+
+// Forward copy, a word at a time when source and destination are equally aligned.
+static void scalar_memcpy(uint8_t *d, const uint8_t *s, size_t n) {
+    if ((((uint64_t)d ^ (uint64_t)s) & 7) == 0) {
+        while (n && ((uint64_t)d & 7)) {
+            *d++ = *s++;
+            n--;
+        }
+        uint64_t *dw = (uint64_t *)d;
+        const uint64_t *sw = (const uint64_t *)s;
+        for (; n >= 32; n -= 32, dw += 4, sw += 4) {
+            uint64_t a = sw[0], b = sw[1], c = sw[2], e = sw[3];
+            dw[0] = a;
+            dw[1] = b;
+            dw[2] = c;
+            dw[3] = e;
+        }
+        for (; n >= 8; n -= 8) {
+            *dw++ = *sw++;
+        }
+        d = (uint8_t *)dw;
+        s = (const uint8_t *)sw;
+    }
+    while (n--) {
+        *d++ = *s++;
+    }
+}
+
+static int scalar_memcmp(const uint8_t *a, const uint8_t *b, size_t n) {
+    if (((((uint64_t)a) | (uint64_t)b) & 7) == 0) {
+        // Skip equal words; the byte loop below finds the first difference.
+        while (n >= 8 && *(const uint64_t *)a == *(const uint64_t *)b) {
+            a += 8;
+            b += 8;
+            n -= 8;
+        }
+    }
+    for (; n; n--, a++, b++) {
+        if (*a != *b) {
+            return *a - *b;
+        }
+    }
+    return 0;
+}
+
+// Exported routines: vector for large sizes, in bounded interrupts-off chunks.
+
+void *memset(void *dst, int c, size_t n) {
+    uint8_t *d = dst;
+    if (kstring_use_vector && n >= KSTRING_VEC_MIN) {
+        while (n) {
+            size_t chunk = n < KSTRING_VEC_CHUNK ? n : KSTRING_VEC_CHUNK;
+            uint64_t flags = vec_begin();
+            kstring_rvv_memset(d, c, chunk);
+            vec_end(flags);
+            d += chunk;
+            n -= chunk;
+        }
+        return dst;
+    }
+    scalar_memset(d, c, n);
+    return dst;
+}
+
+void *memcpy(void *dst, const void *src, size_t n) {
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    if (kstring_use_vector && n >= KSTRING_VEC_MIN) {
+        while (n) {
+            size_t chunk = n < KSTRING_VEC_CHUNK ? n : KSTRING_VEC_CHUNK;
+            uint64_t flags = vec_begin();
+            kstring_rvv_memcpy(d, s, chunk);
+            vec_end(flags);
+            d += chunk;
+            s += chunk;
+            n -= chunk;
+        }
+        return dst;
+    }
+    scalar_memcpy(d, s, n);
+    return dst;
+}
+
+void *memmove(void *dst, const void *src, size_t n) {
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    // A forward copy is safe unless the destination starts inside the source.
+    if (d <= s || d >= s + n) {
+        return memcpy(dst, src, n);
+    }
+    d += n;
+    s += n;
+    if ((((uint64_t)d ^ (uint64_t)s) & 7) == 0) {
+        while (n && ((uint64_t)d & 7)) {
+            *--d = *--s;
+            n--;
+        }
+        for (; n >= 8; n -= 8) {
+            d -= 8;
+            s -= 8;
+            *(uint64_t *)d = *(const uint64_t *)s;
+        }
+    }
+    while (n--) {
+        *--d = *--s;
+    }
+    return dst;
+}
+
+int memcmp(const void *a, const void *b, size_t n) {
+    if (kstring_use_vector && n >= KSTRING_VEC_MIN) {
+        const uint8_t *pa = a, *pb = b;
+        while (n) {
+            size_t chunk = n < KSTRING_VEC_CHUNK ? n : KSTRING_VEC_CHUNK;
+            uint64_t flags = vec_begin();
+            int r = kstring_rvv_memcmp(pa, pb, chunk);
+            vec_end(flags);
+            if (r) {
+                return r;
+            }
+            pa += chunk;
+            pb += chunk;
+            n -= chunk;
+        }
+        return 0;
+    }
+    return scalar_memcmp(a, b, n);
+}
+
+void page_zero(void *page) {
+    if (kstring_use_vector) {
+        uint64_t flags = vec_begin();
+        kstring_rvv_page_zero(page);
+        vec_end(flags);
+        return;
+    }
+    uint64_t *w = page;
+    for (uint64_t i = 0; i < PAGE_SIZE / 8; i += 8) {
+        w[i + 0] = 0;
+        w[i + 1] = 0;
+        w[i + 2] = 0;
+        w[i + 3] = 0;
+        w[i + 4] = 0;
+        w[i + 5] = 0;
+        w[i + 6] = 0;
+        w[i + 7] = 0;
+    }
+}
+
+void page_copy(void *dst, const void *src) {
+    if (kstring_use_vector) {
+        uint64_t flags = vec_begin();
+        kstring_rvv_page_copy(dst, src);
+        vec_end(flags);
+        return;
+    }
+    uint64_t *d = dst;
+    const uint64_t *s = src;
+    for (uint64_t i = 0; i < PAGE_SIZE / 8; i += 8) {
+        uint64_t a0 = s[i + 0], a1 = s[i + 1], a2 = s[i + 2], a3 = s[i + 3];
+        uint64_t a4 = s[i + 4], a5 = s[i + 5], a6 = s[i + 6], a7 = s[i + 7];
+        d[i + 0] = a0;
+        d[i + 1] = a1;
+        d[i + 2] = a2;
+        d[i + 3] = a3;
+        d[i + 4] = a4;
+        d[i + 5] = a5;
+        d[i + 6] = a6;
+        d[i + 7] = a7;
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef KSTRING_H
+#define KSTRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Kernel memory primitives. memset, memcpy, memmove and memcmp (the ones
+ * the compiler calls, declared in <string.h>) are defined in kstring.c,
+ * together with whole-page helpers for the allocator and copy-on-write.
+ *
+ * Each has a scalar implementation and, when every hart has the V
+ * extension, an RVV one (kstring_rvv.S) that is used for large enough
+ * sizes. Vector code runs with interrupts disabled and sstatus.VS switched
+ * on only for its duration, so no vector state is ever live across a trap
+ * or a context switch; U-mode always runs with VS off.
+ */
+
+// Below this many bytes the scalar routines win over the vector setup cost.
+#define KSTRING_VEC_MIN   256
+// Most bytes handled per interrupts-off stretch of vector code.
+#define KSTRING_VEC_CHUNK 16384
+
+// Pick the implementations from misa and the device tree's ISA letters (0: unknown).
+void kstring_init(uint32_t dt_isa);
+
+// Non-zero while the vector routines are in use.
+int kstring_vector_enabled(void);
+
+/*
+ * Switch the vector routines off (0) or back on (non-zero, only honoured
+ * when the hardware has them). Returns the previous setting. For benchmarks.
+ */
+int kstring_set_vector(int on);
+
+// Zero one 4 KiB page.
+void page_zero(void *page);
+
+// Copy one 4 KiB page. The pages must not overlap.
+void page_copy(void *dst, const void *src);
+
+#endif // KSTRING_H
@@ -1,96 +1,639 @@
 #include "mem.h"
-#include "uart.h"
+#include "klog.h"
+#include "kstring.h"
 #include "panic.h"
+#include "riscv.h"
+#include "spinlock.h"
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 
-// --- Memory Layout Definitions ---
-#define MEM_START_ADDR      0x80000000UL          // Base of physical memory.
-#define MEM_SIZE_BYTES      (128UL * 1024 * 1024) // 128MB total.
 #define PAGE_SIZE_BYTES     4096UL                // 4KB per page.
 
-#define NUM_PAGES           (MEM_SIZE_BYTES / PAGE_SIZE_BYTES)
-#define BITMAP_SIZE_BYTES   ((NUM_PAGES + 7) / 8)  // Size of bitmap in bytes.
-
-// --- Kernel and Bitmap Occupancy ---
-// Assume kernel occupies the first 1MB (256 pages).
-#define KERNEL_SIZE_PAGES   (1UL * 1024 * 1024 / PAGE_SIZE_BYTES)
+// Marker in pfa_block_order[] for pages that do not start a free block.
+#define PFA_ORDER_NONE      0xFF
+// Marker for a free frame held in a magazine; the bitmap still counts it as allocated.
+#define PFA_ORDER_CACHED    0xFE
 
 // --- PFA Internal State ---
-static uint8_t pfa_bitmap[BITMAP_SIZE_BYTES];
+// Managed range, fixed by pfa_init_range().
+static uint64_t pfa_base;   // Physical address of page 0.
+static uint64_t pfa_npages; // Pages managed.
+
+// One bit per page: set while the page is allocated or reserved.
+static uint8_t *pfa_bitmap;
+
+/*
+ * Buddy allocator state.
+ * A free block of 2^k pages is linked into pfa_free_lists[k] through a
+ * header stored in its first page, and pfa_block_order[] records k for
+ * that first page so a freed buddy can be found and merged in O(1).
+ */
+struct pfa_block {
+    struct pfa_block *next;
+    struct pfa_block *prev;
+};
+
+static struct pfa_block *pfa_free_lists[PFA_MAX_ORDER + 1];
+static uint64_t pfa_free_blocks[PFA_MAX_ORDER + 1]; // Length of each list.
+static uint64_t pfa_free_pages;                      // Pages on all the lists.
+static uint8_t *pfa_block_order;                     // One entry per page.
+static uint32_t pfa_order_mask; // Bit k set when pfa_free_lists[k] is non-empty.
+
+// References to each allocated page; only meaningful while the page is allocated.
+static uint32_t *pfa_refcnt;
+
+// Protects the bitmap and the buddy lists.
+static struct spinlock pfa_lock = SPINLOCK_INIT;
+
+/*
+ * Per-hart magazines.
+ * Each hart allocates and frees order-0 frames from its own small stack
+ * with interrupts disabled and no shared writes; only refills and drains
+ * take pfa_lock, and they move PFA_MAG_BATCH frames at a time.
+ */
+struct pfa_magazine {
+    void *frames[PFA_MAG_SIZE];
+    uint64_t count;
+    struct pfa_mag_stats stats;
+} __attribute__((aligned(64)));
+
+static struct pfa_magazine pfa_mags[NHART];
+
+/*
+ * Pool of pre-zeroed frames, linked through their first word (cleared again
+ * when a frame leaves the pool). Idle harts refill it once it drops below
+ * pfa_zero_low and stop at pfa_zero_high, so they do not wake for every
+ * frame taken. Pool frames are allocated as far as the buddy lists know.
+ */
+static struct spinlock pfa_zero_lock = SPINLOCK_INIT;
+static void *pfa_zero_head;
+static uint32_t pfa_zero_count;
+static uint32_t pfa_zero_low = PFA_ZERO_LOW;
+static uint32_t pfa_zero_high = PFA_ZERO_HIGH;
+static int pfa_zero_refilling = 1;
+static struct pfa_zero_stats pfa_zero_stats;
 
 static int get_bit(uint64_t page_idx) {
-    if (page_idx >= NUM_PAGES) {
-        uart_puts("Error: get_bit() for invalid page index.\n");
+    if (page_idx >= pfa_npages) {
+        klog(KLOG_ERR, "get_bit() for invalid page index.");
         return -1;
     }
     return (pfa_bitmap[page_idx / 8] >> (page_idx % 8)) & 1;
 }
 
 static void set_bit(uint64_t page_idx) {
-    if (page_idx >= NUM_PAGES) {
-        uart_puts("Error: set_bit() for invalid page index.\n");
+    if (page_idx >= pfa_npages) {
+        klog(KLOG_ERR, "set_bit() for invalid page index.");
         return;
     }
     pfa_bitmap[page_idx / 8] |= (1 << (page_idx % 8));
 }
 
 static void clear_bit(uint64_t page_idx) {
-    if (page_idx >= NUM_PAGES) {
-        uart_puts("Error: clear_bit() for invalid page index.\n");
+    if (page_idx >= pfa_npages) {
+        klog(KLOG_ERR, "clear_bit() for invalid page index.");
         return;
     }
     pfa_bitmap[page_idx / 8] &= ~(1 << (page_idx % 8));
 }
 
-void pfa_init(void) {
-    memset(pfa_bitmap, 0, BITMAP_SIZE_BYTES);
+/*
+ * Set or clear the bitmap bits for a block of 'count' pages.
+ * The caller guarantees the range is in bounds, so whole bytes are
+ * written directly once the start is byte-aligned.
+ */
+static void mark_range(uint64_t page_idx, uint64_t count, int used) {
+    uint64_t end = page_idx + count;
+    while (page_idx < end && (page_idx % 8) != 0) {
+        if (used) set_bit(page_idx); else clear_bit(page_idx);
+        page_idx++;
+    }
+    if (end - page_idx >= 8) {
+        uint64_t bytes = (end - page_idx) / 8;
+        memset(&pfa_bitmap[page_idx / 8], used ? 0xFF : 0x00, bytes);
+        page_idx += bytes * 8;
+    }
+    while (page_idx < end) {
+        if (used) set_bit(page_idx); else clear_bit(page_idx);
+        page_idx++;
+    }
+}
+
+static inline struct pfa_block *idx_to_block(uint64_t page_idx) {
+    return (struct pfa_block *)(pfa_base + page_idx * PAGE_SIZE_BYTES);
+}
+
+static inline uint64_t block_to_idx(struct pfa_block *b) {
+    return ((uint64_t)b - pfa_base) / PAGE_SIZE_BYTES;
+}
+
+static void free_list_push(uint64_t page_idx, unsigned int order) {
+    struct pfa_block *b = idx_to_block(page_idx);
+    b->prev = NULL;
+    b->next = pfa_free_lists[order];
+    if (b->next) {
+        b->next->prev = b;
+    }
+    pfa_free_lists[order] = b;
+    pfa_order_mask |= (1U << order);
+    pfa_block_order[page_idx] = order;
+    pfa_free_blocks[order]++;
+    pfa_free_pages += 1UL << order;
+}
+
+static void free_list_remove(uint64_t page_idx, unsigned int order) {
+    struct pfa_block *b = idx_to_block(page_idx);
+    if (b->prev) {
+        b->prev->next = b->next;
+    } else {
+        pfa_free_lists[order] = b->next;
+    }
+    if (b->next) {
+        b->next->prev = b->prev;
+    }
+    if (!pfa_free_lists[order]) {
+        pfa_order_mask &= ~(1U << order);
+    }
+    pfa_block_order[page_idx] = PFA_ORDER_NONE;
+    pfa_free_blocks[order]--;
+    pfa_free_pages -= 1UL << order;
+}
+
+void pfa_init_range(uint64_t base, uint64_t size, uint64_t reserved) {
+    // Buddies are found by page index, so index alignment must be address alignment.
+    if (base % (PAGE_SIZE_BYTES << PFA_MAX_ORDER) != 0) {
+        panic("pfa_init_range: base not aligned to the largest block");
+    }
+    pfa_base = base;
+    pfa_npages = size / PAGE_SIZE_BYTES;
 
-    // Mark pages occupied by the kernel.
-    for (uint64_t i = 0; i < KERNEL_SIZE_PAGES; i++) {
-        set_bit(i);
+    // Lay the metadata out in the first pages after the reserved prefix.
+    uint64_t reserved_pages = (reserved + PAGE_SIZE_BYTES - 1) / PAGE_SIZE_BYTES;
+    uint64_t bitmap_bytes = (pfa_npages + 7) / 8;
+    uint64_t meta_bytes = bitmap_bytes + pfa_npages * sizeof(uint8_t) +
+                          pfa_npages * sizeof(uint32_t) + sizeof(uint32_t);
+    uint64_t meta = base + reserved_pages * PAGE_SIZE_BYTES;
+    pfa_bitmap = (uint8_t *)meta;
+    pfa_block_order = pfa_bitmap + bitmap_bytes;
+    pfa_refcnt = (uint32_t *)(((uint64_t)(pfa_block_order + pfa_npages) + 3) & ~3UL);
+    uint64_t used_pages = reserved_pages + (meta_bytes + PAGE_SIZE_BYTES - 1) / PAGE_SIZE_BYTES;
+    if (used_pages >= pfa_npages) {
+        panic("pfa_init_range: no memory left after the allocator metadata");
     }
-    // Mark pages occupied by the bitmap itself.
-    uint64_t bitmap_start_byte_offset = KERNEL_SIZE_PAGES * PAGE_SIZE_BYTES;
-    uint64_t bitmap_start_page_idx = bitmap_start_byte_offset / PAGE_SIZE_BYTES;
-    uint64_t bitmap_size_pages = (BITMAP_SIZE_BYTES + PAGE_SIZE_BYTES - 1) / PAGE_SIZE_BYTES;
-    for (uint64_t i = 0; i < bitmap_size_pages; i++) {
-        set_bit(bitmap_start_page_idx + i);
+
+    memset(pfa_bitmap, 0, bitmap_bytes);
+    memset(pfa_block_order, PFA_ORDER_NONE, pfa_npages);
+    for (unsigned int k = 0; k <= PFA_MAX_ORDER; k++) {
+        pfa_free_lists[k] = NULL;
+        pfa_free_blocks[k] = 0;
     }
-    uart_puts("Memory allocator (PFA) initialized.\n");
+    pfa_free_pages = 0;
+    pfa_order_mask = 0;
+    pfa_zero_head = NULL;
+    pfa_zero_count = 0;
+    pfa_zero_refilling = 1;
+
+    // The kernel image and the metadata stay allocated for good.
+    mark_range(0, used_pages, 1);
+
+    // Hand every remaining page to the buddy lists as the largest
+    // naturally aligned blocks that fit. Reserved pages form a prefix.
+    uint64_t idx = used_pages;
+    while (idx < pfa_npages) {
+        unsigned int order = PFA_MAX_ORDER;
+        while (order > 0 &&
+               ((idx & ((1UL << order) - 1)) != 0 || idx + (1UL << order) > pfa_npages)) {
+            order--;
+        }
+        free_list_push(idx, order);
+        idx += 1UL << order;
+    }
+    klog(KLOG_INFO, "Memory allocator (PFA) initialized: %u pages at %p, %u free.",
+         pfa_npages, base, pfa_free_pages);
 }
 
-void* pfa_alloc(void) {
-    for (uint64_t i = 0; i < NUM_PAGES; i++) {
-        if (get_bit(i) == 0) {
-            set_bit(i);
-            void* addr = (void*)(MEM_START_ADDR + (i * PAGE_SIZE_BYTES));
-            if (((uint64_t)addr % PAGE_SIZE_BYTES) != 0) {
-                uart_puts("Critical: Page allocation returned misaligned address!\n");
-                panic("pfa_alloc alignment error");
+uint64_t pfa_reserve_range(uint64_t start, uint64_t len) {
+    uint64_t end_addr = start + len;
+    uint64_t limit = pfa_base + pfa_npages * PAGE_SIZE_BYTES;
+    if (start < pfa_base) {
+        start = pfa_base;
+    }
+    if (end_addr > limit) {
+        end_addr = limit;
+    }
+    if (start >= end_addr) {
+        return 0;
+    }
+    uint64_t idx = (start - pfa_base) / PAGE_SIZE_BYTES;
+    uint64_t end = (end_addr - pfa_base + PAGE_SIZE_BYTES - 1) / PAGE_SIZE_BYTES;
+    uint64_t in_use = 0;
+
+    uint64_t flags = spin_lock_irqsave(&pfa_lock);
+    while (idx < end) {
+        if (get_bit(idx)) {
+            in_use++;
+            idx++;
+            continue;
+        }
+        // A free page lies in exactly one free block; find its head.
+        unsigned int k = 0;
+        uint64_t cur = idx;
+        while (pfa_block_order[cur] != k) {
+            if (++k > PFA_MAX_ORDER) {
+                panic("pfa_reserve_range: free page outside every free block");
             }
-            return addr;
+            cur = idx & ~((1UL << k) - 1);
         }
+        free_list_remove(cur, k);
+
+        // Give back the halves that stick out of the range, then take the rest.
+        while (cur < idx || cur + (1UL << k) > end) {
+            k--;
+            uint64_t half = 1UL << k;
+            if (idx >= cur + half) {
+                free_list_push(cur, k);
+                cur += half;
+            } else {
+                free_list_push(cur + half, k);
+            }
+        }
+        mark_range(cur, 1UL << k, 1);
+        idx = cur + (1UL << k);
     }
-    uart_puts("Warning: pfa_alloc found no free pages!\n");
-    return NULL;
+    spin_unlock_irqrestore(&pfa_lock, flags);
+    return in_use;
 }
 
-void pfa_free(void* ptr) {
-    if (ptr == NULL) {
-        uart_puts("Warning: pfa_free called with NULL pointer.\n");
+/*
+ * Remove a block of 2^order pages from the buddy lists.
+ * Returns the index of its first page, or -1 if nothing fits.
+ * Caller holds pfa_lock.
+ */
+static int64_t buddy_alloc(unsigned int order) {
+    // Smallest non-empty order that can satisfy the request.
+    uint32_t candidates = pfa_order_mask & ~((1U << order) - 1);
+    if (candidates == 0) {
+        return -1;
+    }
+    unsigned int k = __builtin_ctz(candidates);
+
+    uint64_t idx = block_to_idx(pfa_free_lists[k]);
+    free_list_remove(idx, k);
+
+    // Split down to the requested size, returning upper halves to the lists.
+    while (k > order) {
+        k--;
+        free_list_push(idx + (1UL << k), k);
+    }
+    mark_range(idx, 1UL << order, 1);
+    return (int64_t)idx;
+}
+
+/*
+ * Return a block of 2^order pages to the buddy lists, merging with its
+ * buddy for as long as that is a free block of the same order.
+ * Caller holds pfa_lock.
+ */
+static void buddy_free(uint64_t page_idx, unsigned int order) {
+    if (get_bit(page_idx) != 1) {
+        klog(KLOG_WARN, "pfa_free called on a page that is not allocated.");
         return;
     }
+    mark_range(page_idx, 1UL << order, 0);
+
+    while (order < PFA_MAX_ORDER) {
+        uint64_t buddy = page_idx ^ (1UL << order);
+        if (buddy + (1UL << order) > pfa_npages || pfa_block_order[buddy] != order) {
+            break;
+        }
+        free_list_remove(buddy, order);
+        page_idx &= ~(1UL << order);
+        order++;
+    }
+    free_list_push(page_idx, order);
+}
+
+/*
+ * Validate a block handed to one of the free routines.
+ * Returns 0 if the block may be freed.
+ */
+static int check_free(void* ptr, unsigned int order) {
+    if (ptr == NULL) {
+        klog(KLOG_WARN, "pfa_free called with NULL pointer.");
+        return -1;
+    }
+    if (order > PFA_MAX_ORDER) {
+        klog(KLOG_ERR, "pfa_free_order called with order above PFA_MAX_ORDER.");
+        panic("pfa_free order error");
+    }
     uint64_t addr = (uint64_t)ptr;
-    if (addr < MEM_START_ADDR || addr >= (MEM_START_ADDR + MEM_SIZE_BYTES)) {
-        uart_puts("Error: Attempt to free memory outside managed region.\n");
+    if (addr < pfa_base || addr >= pfa_base + pfa_npages * PAGE_SIZE_BYTES) {
+        klog(KLOG_ERR, "Attempt to free memory outside managed region.");
         panic("pfa_free region error");
     }
-    if (addr % PAGE_SIZE_BYTES != 0) {
-        uart_puts("Error: Attempt to free non-page-aligned memory.\n");
+    if (addr % (PAGE_SIZE_BYTES << order) != 0) {
+        klog(KLOG_ERR, "Attempt to free non-page-aligned memory.");
         panic("pfa_free alignment error");
     }
-    uint64_t page_idx = (addr - MEM_START_ADDR) / PAGE_SIZE_BYTES;
-    clear_bit(page_idx);
+    return 0;
+}
+
+void* pfa_alloc_order(unsigned int order) {
+    if (order > PFA_MAX_ORDER) {
+        klog(KLOG_WARN, "pfa_alloc_order called with order above PFA_MAX_ORDER.");
+        return NULL;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&pfa_lock);
+    int64_t idx = buddy_alloc(order);
+    spin_unlock_irqrestore(&pfa_lock, flags);
+
+    if (idx < 0) {
+        klog(KLOG_WARN, "pfa_alloc found no free pages!");
+        return NULL;
+    }
+    for (uint64_t i = 0; i < (1UL << order); i++) {
+        pfa_refcnt[idx + i] = 1;
+    }
+    void* addr = (void*)(pfa_base + ((uint64_t)idx * PAGE_SIZE_BYTES));
+    if (((uint64_t)addr % (PAGE_SIZE_BYTES << order)) != 0) {
+        klog(KLOG_ERR, "Page allocation returned misaligned address!");
+        panic("pfa_alloc alignment error");
+    }
+    return addr;
+}
+
+void pfa_free_order(void* ptr, unsigned int order) {
+    if (check_free(ptr, order) != 0) {
+        return;
+    }
+    uint64_t page_idx = ((uint64_t)ptr - pfa_base) / PAGE_SIZE_BYTES;
+
+    uint64_t flags = spin_lock_irqsave(&pfa_lock);
+    buddy_free(page_idx, order);
+    spin_unlock_irqrestore(&pfa_lock, flags);
+}
+
+/*
+ * Pull up to PFA_MAG_BATCH frames into an empty magazine.
+ * A single contiguous block is preferred; when memory is too fragmented
+ * for that, frames are taken one at a time under the same lock hold.
+ */
+static void mag_refill(struct pfa_magazine *mag) {
+    unsigned int batch_order = __builtin_ctz(PFA_MAG_BATCH);
+
+    spin_lock(&pfa_lock);
+    int64_t idx = buddy_alloc(batch_order);
+    if (idx >= 0) {
+        for (uint64_t i = 0; i < PFA_MAG_BATCH; i++) {
+            pfa_block_order[idx + i] = PFA_ORDER_CACHED;
+            mag->frames[mag->count++] = idx_to_block(idx + i);
+        }
+    } else {
+        while (mag->count < PFA_MAG_BATCH && (idx = buddy_alloc(0)) >= 0) {
+            pfa_block_order[idx] = PFA_ORDER_CACHED;
+            mag->frames[mag->count++] = idx_to_block(idx);
+        }
+    }
+    spin_unlock(&pfa_lock);
+    mag->stats.refills++;
+}
+
+/*
+ * Return the PFA_MAG_BATCH coldest frames of a full magazine to the
+ * global allocator, keeping the most recently freed (cache-hot) ones.
+ */
+static void mag_drain(struct pfa_magazine *mag) {
+    spin_lock(&pfa_lock);
+    for (uint64_t i = 0; i < PFA_MAG_BATCH; i++) {
+        uint64_t idx = block_to_idx(mag->frames[i]);
+        pfa_block_order[idx] = PFA_ORDER_NONE;
+        buddy_free(idx, 0);
+    }
+    spin_unlock(&pfa_lock);
+
+    for (uint64_t i = PFA_MAG_BATCH; i < mag->count; i++) {
+        mag->frames[i - PFA_MAG_BATCH] = mag->frames[i];
+    }
+    mag->count -= PFA_MAG_BATCH;
+    mag->stats.drains++;
+}
+
+// Take a frame from the zeroed pool, or NULL if it is empty.
+static void *zero_pool_pop(void) {
+    uint64_t flags = spin_lock_irqsave(&pfa_zero_lock);
+    void *frame = pfa_zero_head;
+    if (frame) {
+        pfa_zero_head = *(void **)frame;
+        pfa_zero_count--;
+        if (pfa_zero_count < pfa_zero_low) {
+            pfa_zero_refilling = 1;
+        }
+    }
+    spin_unlock_irqrestore(&pfa_zero_lock, flags);
+
+    if (frame) {
+        *(void **)frame = NULL;
+    }
+    return frame;
+}
+
+void* pfa_alloc(void) {
+    uint64_t flags = intr_save();
+    struct pfa_magazine *mag = &pfa_mags[cpuid()];
+
+    mag->stats.allocs++;
+    if (mag->count > 0) {
+        mag->stats.hits++;
+    } else {
+        mag_refill(mag);
+    }
+    void* addr = (mag->count > 0) ? mag->frames[--mag->count] : NULL;
+    intr_restore(flags);
+
+    // Out of memory: a zeroed frame is still a frame.
+    if (addr == NULL) {
+        addr = zero_pool_pop();
+    }
+    if (addr == NULL) {
+        klog(KLOG_WARN, "pfa_alloc found no free pages!");
+        return NULL;
+    }
+    uint64_t idx = block_to_idx(addr);
+    __atomic_store_n(&pfa_block_order[idx], PFA_ORDER_NONE, __ATOMIC_RELAXED);
+    pfa_refcnt[idx] = 1;
+    return addr;
+}
+
+void* pfa_alloc_zeroed(void) {
+    void *frame = zero_pool_pop();
+    if (frame) {
+        __atomic_add_fetch(&pfa_zero_stats.hits, 1, __ATOMIC_RELAXED);
+        pfa_refcnt[block_to_idx(frame)] = 1;
+        return frame;
+    }
+    frame = pfa_alloc();
+    if (frame) {
+        __atomic_add_fetch(&pfa_zero_stats.misses, 1, __ATOMIC_RELAXED);
+        page_zero(frame);
+    }
+    return frame;
+}
+
+unsigned int pfa_zero_idle(void) {
+    if (!__atomic_load_n(&pfa_zero_refilling, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    unsigned int added = 0;
+    while (added < PFA_ZERO_BATCH) {
+        // Leave the last PFA_ZERO_RESERVE free frames to real allocations.
+        uint64_t flags = spin_lock_irqsave(&pfa_lock);
+        int64_t idx = pfa_free_pages > PFA_ZERO_RESERVE ? buddy_alloc(0) : -1;
+        spin_unlock_irqrestore(&pfa_lock, flags);
+        if (idx < 0) {
+            break;
+        }
+
+        // The expensive part runs without any lock held.
+        void *frame = idx_to_block(idx);
+        page_zero(frame);
+
+        flags = spin_lock_irqsave(&pfa_zero_lock);
+        *(void **)frame = pfa_zero_head;
+        pfa_zero_head = frame;
+        pfa_zero_count++;
+        pfa_zero_stats.zeroed++;
+        int full = pfa_zero_count >= pfa_zero_high;
+        if (full) {
+            pfa_zero_refilling = 0;
+        }
+        spin_unlock_irqrestore(&pfa_zero_lock, flags);
+
+        added++;
+        if (full) {
+            break;
+        }
+    }
+    return added;
+}
+
+void pfa_zero_set_watermarks(uint32_t low, uint32_t high) {
+    if (high < low) {
+        high = low;
+    }
+    // Frames above the new high watermark go back to the buddy lists.
+    void *excess = NULL;
+    uint64_t flags = spin_lock_irqsave(&pfa_zero_lock);
+    pfa_zero_low = low;
+    pfa_zero_high = high;
+    while (pfa_zero_count > high) {
+        void *frame = pfa_zero_head;
+        pfa_zero_head = *(void **)frame;
+        pfa_zero_count--;
+        *(void **)frame = excess;
+        excess = frame;
+    }
+    pfa_zero_refilling = pfa_zero_count < low;
+    spin_unlock_irqrestore(&pfa_zero_lock, flags);
+
+    pfa_free_chain(excess);
+}
+
+void pfa_zero_get_stats(struct pfa_zero_stats *out) {
+    uint64_t flags = spin_lock_irqsave(&pfa_zero_lock);
+    *out = pfa_zero_stats;
+    out->pages = pfa_zero_count;
+    spin_unlock_irqrestore(&pfa_zero_lock, flags);
+}
+
+void pfa_free(void* ptr) {
+    if (check_free(ptr, 0) != 0) {
+        return;
+    }
+    // The bitmap cannot tell a magazine frame from an allocated one, so a
+    // frame is marked as cached before it goes in. Only one of two racing
+    // frees of the same frame gets to do that.
+    uint64_t idx = block_to_idx(ptr);
+    uint8_t expected = PFA_ORDER_NONE;
+    if (get_bit(idx) != 1 ||
+        !__atomic_compare_exchange_n(&pfa_block_order[idx], &expected, PFA_ORDER_CACHED, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        klog(KLOG_WARN, "pfa_free called on a page that is not allocated.");
+        return;
+    }
+
+    uint64_t flags = intr_save();
+    struct pfa_magazine *mag = &pfa_mags[cpuid()];
+
+    mag->stats.frees++;
+    if (mag->count == PFA_MAG_SIZE) {
+        mag_drain(mag);
+    }
+    mag->frames[mag->count++] = ptr;
+    intr_restore(flags);
+}
+
+void pfa_free_chain(void* head) {
+    uint64_t flags = spin_lock_irqsave(&pfa_lock);
+    while (head) {
+        void* next = *(void**)head;
+        if (check_free(head, 0) == 0) {
+            buddy_free(((uint64_t)head - pfa_base) / PAGE_SIZE_BYTES, 0);
+        }
+        head = next;
+    }
+    spin_unlock_irqrestore(&pfa_lock, flags);
+}
+
+static inline uint64_t ref_idx(void* pa) {
+    uint64_t addr = (uint64_t)pa;
+    if (addr < pfa_base || addr >= pfa_base + pfa_npages * PAGE_SIZE_BYTES) {
+        klog(KLOG_ERR, "reference count for memory outside managed region.");
+        panic("pfa refcount region error");
+    }
+    return (addr - pfa_base) / PAGE_SIZE_BYTES;
+}
+
+void pfa_ref(void* pa) {
+    __atomic_add_fetch(&pfa_refcnt[ref_idx(pa)], 1, __ATOMIC_RELAXED);
+}
+
+uint32_t pfa_unref(void* pa) {
+    uint32_t *cnt = &pfa_refcnt[ref_idx(pa)];
+    uint32_t old = __atomic_load_n(cnt, __ATOMIC_RELAXED);
+    // A count of zero means the frame was never tracked; it has one user.
+    while (old != 0 &&
+           !__atomic_compare_exchange_n(cnt, &old, old - 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+    }
+    return old ? old - 1 : 0;
+}
+
+uint32_t pfa_refcount(void* pa) {
+    return __atomic_load_n(&pfa_refcnt[ref_idx(pa)], __ATOMIC_ACQUIRE);
+}
+
+void pfa_mag_get_stats(uint64_t hart, struct pfa_mag_stats *out) {
+    if (hart >= NHART) {
+        klog(KLOG_ERR, "pfa_mag_get_stats() for invalid hart.");
+        return;
+    }
+    *out = pfa_mags[hart].stats;
+}
+
+void pfa_get_stats(struct pfa_stats *out) {
+    uint64_t flags = spin_lock_irqsave(&pfa_lock);
+    out->total_pages = pfa_npages;
+    out->free_pages = pfa_free_pages;
+    for (unsigned int k = 0; k <= PFA_MAX_ORDER; k++) {
+        out->free_blocks[k] = pfa_free_blocks[k];
+    }
+    spin_unlock_irqrestore(&pfa_lock, flags);
+
+    // Magazines are read without their owners' cooperation; close enough for stats.
+    out->zero_pages = __atomic_load_n(&pfa_zero_count, __ATOMIC_RELAXED);
+    out->mag_pages = 0;
+    for (int h = 0; h < NHART; h++) {
+        out->mag_pages += __atomic_load_n(&pfa_mags[h].count, __ATOMIC_RELAXED);
+    }
 }
@@ -3,13 +3,115 @@
 
 #include <stdint.h>
 
-// Initialize the Physical Page Frame Allocator
-void pfa_init(void);
+// Largest block order handed out by the buddy allocator (2^PFA_MAX_ORDER pages, 4MB).
+#define PFA_MAX_ORDER 10
 
-// Allocate a single physical page frame
+// Per-hart page magazine sizing.
+#define PFA_MAG_SIZE   32 // Frames cached per hart.
+#define PFA_MAG_BATCH  16 // Frames moved per refill or drain (a power of two).
+
+// Pre-zeroed frame pool defaults (see pfa_zero_set_watermarks()).
+#define PFA_ZERO_LOW   32 // Idle harts start refilling below this many frames...
+#define PFA_ZERO_HIGH 128 // ...and stop once the pool holds this many.
+#define PFA_ZERO_BATCH  4 // Frames zeroed per pfa_zero_idle() call.
+#define PFA_ZERO_RESERVE 128 // Free frames the idle zeroer never takes.
+
+// Per-hart magazine counters. Hit rate is hits / allocs.
+struct pfa_mag_stats {
+    uint64_t allocs;  // pfa_alloc() calls on this hart.
+    uint64_t hits;    // Allocations served without touching the global allocator.
+    uint64_t frees;   // pfa_free() calls on this hart.
+    uint64_t refills; // Batches pulled from the global allocator.
+    uint64_t drains;  // Batches returned to the global allocator.
+};
+
+// Zeroed-pool counters. Hit rate is hits / (hits + misses).
+struct pfa_zero_stats {
+    uint64_t pages;   // Frames in the pool now.
+    uint64_t hits;    // pfa_alloc_zeroed() calls served from the pool.
+    uint64_t misses;  // Calls that had to zero synchronously.
+    uint64_t zeroed;  // Frames zeroed in idle time.
+};
+
+// Allocator-wide counters, see pfa_get_stats().
+struct pfa_stats {
+    uint64_t total_pages;                   // Pages in the managed range.
+    uint64_t free_pages;                    // Pages on the buddy lists.
+    uint64_t mag_pages;                     // Free frames cached in per-hart magazines.
+    uint64_t zero_pages;                    // Free frames waiting in the zeroed pool.
+    uint64_t free_blocks[PFA_MAX_ORDER + 1]; // Free blocks of each order.
+};
+
+/*
+ * Initialize the Physical Page Frame Allocator over [base, base + size).
+ * The first 'reserved' bytes (the kernel image) are never handed out, and
+ * the allocator's own metadata (about 5.1 bytes per page) is placed right
+ * after them. 'base' must be aligned to the largest block
+ * (PAGE_SIZE << PFA_MAX_ORDER).
+ */
+void pfa_init_range(uint64_t base, uint64_t size, uint64_t reserved);
+
+/*
+ * Take the pages overlapping [start, start + len) off the free lists for
+ * good (firmware regions, the device tree blob, holes between RAM banks).
+ * Parts outside the managed range are ignored. Meant for boot, before
+ * anything is allocated; returns how many of the pages were already in use.
+ */
+uint64_t pfa_reserve_range(uint64_t start, uint64_t len);
+
+// Allocate a single physical page frame (served from the calling hart's magazine)
 void* pfa_alloc(void);
 
-// Free a previously allocated physical page frame
+// Free a previously allocated physical page frame (returned to the calling hart's magazine)
 void pfa_free(void* ptr);
 
+/*
+ * Allocate a single frame filled with zeroes. Frames come from a pool that
+ * idle harts keep topped up; when it is empty the frame is zeroed here.
+ */
+void* pfa_alloc_zeroed(void);
+
+/*
+ * Idle-loop hook: if the zeroed pool is being refilled, zero up to
+ * PFA_ZERO_BATCH more frames with interrupts left as they are. Returns the
+ * number of frames added, so the caller can wait for an interrupt on 0.
+ */
+unsigned int pfa_zero_idle(void);
+
+/*
+ * Refill the zeroed pool whenever it falls below 'low' frames, up to
+ * 'high'. The pool never takes the last 'high' free frames from the buddy
+ * lists, and plain pfa_alloc() falls back on it when memory runs out.
+ * 0, 0 disables the pool.
+ */
+void pfa_zero_set_watermarks(uint32_t low, uint32_t high);
+
+void pfa_zero_get_stats(struct pfa_zero_stats *out);
+
+// Allocate 2^order physically contiguous page frames, aligned to their size.
+void* pfa_alloc_order(unsigned int order);
+
+// Free a block previously returned by pfa_alloc_order() with the same order.
+void pfa_free_order(void* ptr, unsigned int order);
+
+/*
+ * Free a chain of order-0 frames linked through their first word
+ * (NULL-terminated), taking the allocator lock once for the whole batch.
+ */
+void pfa_free_chain(void* head);
+
+/*
+ * Per-frame reference counts, used to share frames between address spaces
+ * (copy-on-write). Every frame starts with one reference when allocated.
+ */
+void pfa_ref(void* pa);          // Take another reference to the frame holding 'pa'.
+uint32_t pfa_unref(void* pa);    // Drop one; returns the count left (0: caller frees the frame).
+uint32_t pfa_refcount(void* pa); // Current number of references.
+
+// Snapshot the free-page counters.
+void pfa_get_stats(struct pfa_stats *out);
+
+// Copy the magazine counters of 'hart' into 'out'.
+void pfa_mag_get_stats(uint64_t hart, struct pfa_mag_stats *out);
+
 #endif // MEM_H
@@ -1,9 +1,15 @@
 #include "panic.h"
+#include "klog.h"
+#include "riscv.h"
 #include "uart.h"
 
 void panic(const char* msg) {
+    intr_save();
+    // Get whatever was logged before the panic out first, in order.
+    klog_flush();
     uart_puts("Kernel Panic: ");
     uart_puts(msg);
     uart_puts("\nHalting system.\n");
+    uart_flush();
     while (1) {}
 }
@@ -0,0 +1,74 @@
+#include "plic.h"
+#include "riscv.h"
+#include "klog.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Register layout. QEMU virt gives hart h context 2h (M-mode) and 2h+1 (S-mode).
+#define PLIC_PRIORITY(irq)    (plic_base + 4 * (irq))
+#define PLIC_SCONTEXT(hart)   (2 * (hart) + 1)
+#define PLIC_SENABLE(hart)    (plic_base + 0x2000 + 0x80 * PLIC_SCONTEXT(hart))
+#define PLIC_STHRESHOLD(hart) (plic_base + 0x200000 + 0x1000 * PLIC_SCONTEXT(hart))
+#define PLIC_SCLAIM(hart)     (plic_base + 0x200004 + 0x1000 * PLIC_SCONTEXT(hart))
+
+#define SIE_SEIE (1UL << 9) // Supervisor external interrupt enable.
+
+struct plic_handler {
+    void (*fn)(void *arg);
+    void *arg;
+};
+
+static struct plic_handler plic_handlers[PLIC_NSOURCES];
+
+static uint64_t plic_base = PLIC_BASE_DEFAULT;
+
+static inline volatile uint32_t *plic_reg(uint64_t addr) {
+    return (volatile uint32_t *)addr;
+}
+
+void plic_set_base(uint64_t base) {
+    plic_base = base;
+}
+
+void plic_init(void) {
+    for (uint32_t irq = 1; irq < PLIC_NSOURCES; irq++) {
+        *plic_reg(PLIC_PRIORITY(irq)) = 0;
+    }
+}
+
+void plic_init_hart(void) {
+    uint64_t hart = cpuid();
+    for (uint32_t word = 0; word < PLIC_NSOURCES / 32; word++) {
+        plic_reg(PLIC_SENABLE(hart))[word] = 0;
+    }
+    *plic_reg(PLIC_STHRESHOLD(hart)) = 0;
+
+    uint64_t sie;
+    asm volatile("csrr %0, sie" : "=r"(sie));
+    sie |= SIE_SEIE;
+    asm volatile("csrw sie, %0" :: "r"(sie));
+}
+
+void plic_register(uint32_t irq, void (*handler)(void *arg), void *arg) {
+    if (irq == 0 || irq >= PLIC_NSOURCES) {
+        klog(KLOG_ERR, "plic_register with an invalid source.");
+        return;
+    }
+    plic_handlers[irq].fn = handler;
+    plic_handlers[irq].arg = arg;
+
+    uint64_t hart = cpuid();
+    *plic_reg(PLIC_PRIORITY(irq)) = 1;
+    plic_reg(PLIC_SENABLE(hart))[irq / 32] |= 1U << (irq % 32);
+}
+
+void plic_interrupt(void) {
+    volatile uint32_t *claim = plic_reg(PLIC_SCLAIM(cpuid()));
+    uint32_t irq;
+    while ((irq = *claim) != 0) {
+        if (irq < PLIC_NSOURCES && plic_handlers[irq].fn) {
+            plic_handlers[irq].fn(plic_handlers[irq].arg);
+        }
+        *claim = irq; // Complete.
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef PLIC_H
+#define PLIC_H
+
+#include <stdint.h>
+
+// PLIC on the QEMU virt machine, used until plic_set_base() says otherwise.
+#define PLIC_BASE_DEFAULT 0x0C000000UL
+#define PLIC_NSOURCES 128
+
+// Interrupt sources wired to the PLIC on QEMU virt.
+#define UART0_IRQ 10
+
+// Use the PLIC at physical address 'base'. Call before plic_init().
+void plic_set_base(uint64_t base);
+
+// Clear every source priority. Called once by the boot hart.
+void plic_init(void);
+
+// Accept all enabled sources on this hart's S-mode context and enable SEIE.
+void plic_init_hart(void);
+
+/*
+ * Route source 'irq' to the calling hart's S-mode context and run
+ * 'handler(arg)' when it fires.
+ */
+void plic_register(uint32_t irq, void (*handler)(void *arg), void *arg);
+
+// Claim and dispatch every pending external interrupt. Called on the S-mode external interrupt.
+void plic_interrupt(void);
+
+#endif // PLIC_H
@@ -1,34 +1,85 @@
 #include "proc.h"
 #include "mem.h"
 #include "vm.h"
-#include "uart.h"
-#include "context.h" // To reference struct context if needed.
+#include "klog.h"
+#include "slab.h"
+#include "spinlock.h"
+#include "sched.h"
+#include "syscall.h"
+#include "kstring.h"
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
-// Maximum number of processes.
-#define NPROC 64
+// Fixed virtual address the user image (see linker.ld) is mapped at.
+// The first gigabyte is a global kernel mapping (MMIO) in every address space.
+#define USER_VA 0x40000000UL
 
-// Fixed virtual address for mapping the user process's entry point.
-#define USER_VA 0x1000
+// The user image: text, then rodata, then data and bss, each page-aligned.
+extern char _user_start[], _user_rodata_start[], _user_data_start[], _user_end[];
 
-// Array of process control blocks.
-static struct proc procs[NPROC];
+// Lazily backed user stack, growing down from the top of the user gigabyte.
+#define USER_STACK_TOP  0x80000000UL
+#define USER_STACK_SIZE (64UL * 1024)
 
-// Pointer to the currently running process.
-struct proc *current_proc = NULL;
-
-// Scheduler context – used for context switching back to the scheduler.
-struct context scheduler_context;
+// Process control blocks are allocated from a slab cache and kept on a list.
+static struct kmem_cache *proc_cache;
+static struct proc *proc_list = NULL;
+static struct spinlock proc_lock = SPINLOCK_INIT;
+static uint64_t next_pid = 0;
 
 /*
  * Initialize the process table.
- * Set each PCB's state to UNUSED.
+ * Creates the slab cache that PCBs are allocated from.
  */
 void proc_init(void) {
-    for (int i = 0; i < NPROC; i++) {
-        procs[i].state = UNUSED;
+    proc_cache = kmem_cache_create("proc", sizeof(struct proc), 0, NULL);
+    if (!proc_cache) {
+        klog(KLOG_ERR, "Failed to create process cache.");
+    }
+}
+
+/*
+ * Make the first switch to 'p' start proc_trampoline() on an empty kernel
+ * stack, which enters U-mode with the registers in p->tf.
+ */
+static void proc_init_context(struct proc *p) {
+    memset(&p->context, 0, sizeof(p->context));
+    p->context.ra = (uint64_t)proc_trampoline;
+    p->context.sp = (uint64_t)p->kstack + KSTACK_SIZE;
+}
+
+/*
+ * Map the user image at USER_VA with its link-time layout, so PC-relative
+ * references between its sections still work. Text and rodata are shared
+ * by every process; data and bss get private frames owned by the mapping.
+ */
+static int map_user_image(struct proc *p) {
+    uint64_t start = (uint64_t)_user_start;
+    for (uint64_t pa = start; pa < (uint64_t)_user_end; pa += PAGE_SIZE) {
+        uint64_t va = USER_VA + (pa - start);
+        int err;
+        if (pa < (uint64_t)_user_rodata_start) {
+            err = vm_map(p->pagetable, va, pa, PTE_R | PTE_X | PTE_U | PTE_A);
+        } else if (pa < (uint64_t)_user_data_start) {
+            err = vm_map(p->pagetable, va, pa, PTE_R | PTE_U | PTE_A);
+        } else {
+            void *frame = pfa_alloc();
+            if (!frame) {
+                return -1;
+            }
+            page_copy(frame, (void *)pa);
+            err = vm_map(p->pagetable, va, (uint64_t)frame,
+                         PTE_R | PTE_W | PTE_U | PTE_A | PTE_D | PTE_OWNED);
+            if (err != 0) {
+                pfa_free(frame);
+            }
+        }
+        if (err != 0) {
+            return -1;
+        }
     }
+    return 0;
 }
 
 /*
@@ -36,82 +87,234 @@ void proc_init(void) {
  * It sets up the kernel stack, user pagetable, maps the user code,
  * and initializes the process trap frame.
  */
-void proc_create_user(void (*entry_point)(void)) {
-    // Find an unused process slot.
-    for (int i = 0; i < NPROC; i++) {
-        if (procs[i].state == UNUSED) {
-            procs[i].pid = i;
-            procs[i].state = RUNNABLE;
-            
-            // Allocate a kernel stack for the process.
-            procs[i].kstack = pfa_alloc();
-            if (!procs[i].kstack) {
-                uart_puts("Failed to allocate kernel stack for process.\n");
-                return;
-            }
-            
-            // Create a new user page table.
-            procs[i].pagetable = vm_create_pagetable();
-            if (!procs[i].pagetable) {
-                uart_puts("Failed to create user pagetable.\n");
-                return;
-            }
-            
-            // Map the user program's code.
-            // For simplicity, assume the process code fits in one page.
-            vm_map(procs[i].pagetable, USER_VA, (uint64_t)entry_point, PTE_R | PTE_X);
-            
-            // Map the UART device into the user page table so the user process can print.
-            vm_map(procs[i].pagetable, 0x10000000, 0x10000000, PTE_R | PTE_W);
-            
-            // Initialize the process's trap frame.
-            procs[i].tf.sepc = USER_VA; // Start execution at the user program.
-            
-            // Clear register state in trap frame.
-            for (int j = 0; j < 31; j++) {
-                procs[i].tf.regs[j] = 0;
-            }
-            procs[i].tf.scause = 0;
-            procs[i].tf.stval = 0;
-            
-            return;
+struct proc *proc_create_user(void (*entry_point)(void)) {
+    if ((char *)entry_point < _user_start || (char *)entry_point >= _user_rodata_start) {
+        klog(KLOG_ERR, "User entry point %p is outside the user image.", (uint64_t)entry_point);
+        return NULL;
+    }
+
+    struct proc *p = kmem_cache_alloc(proc_cache);
+    if (!p) {
+        klog(KLOG_ERR, "No memory for a new process!");
+        return NULL;
+    }
+    memset(p, 0, sizeof(*p));
+    p->cpu = NHART;
+
+    // Allocate a kernel stack for the process.
+    p->kstack = pfa_alloc_order(KSTACK_ORDER);
+    if (!p->kstack) {
+        klog(KLOG_ERR, "Failed to allocate kernel stack for process.");
+        proc_free(p);
+        return NULL;
+    }
+    proc_init_context(p);
+
+    // Create a new user page table.
+    p->pagetable = vm_create_user_pagetable();
+    if (!p->pagetable) {
+        klog(KLOG_ERR, "Failed to create user pagetable.");
+        proc_free(p);
+        return NULL;
+    }
+
+    // Map the user program image.
+    if (map_user_image(p) != 0) {
+        klog(KLOG_ERR, "Failed to map user code.");
+        proc_free(p);
+        return NULL;
+    }
+
+    // Reserve the user stack; its frames only appear as the process touches them.
+    if (proc_add_region(p, USER_STACK_TOP - USER_STACK_SIZE, USER_STACK_SIZE,
+                        PTE_R | PTE_W) != 0) {
+        klog(KLOG_ERR, "Failed to reserve user stack.");
+        proc_free(p);
+        return NULL;
+    }
+
+    // Initialize the process's trap frame; registers are already zeroed.
+    p->tf.sepc = USER_VA + ((uint64_t)entry_point - (uint64_t)_user_start);
+    p->tf.regs[1] = USER_STACK_TOP; // sp (x2).
+
+    // Publish the process.
+    spin_lock(&proc_lock);
+    p->pid = next_pid++;
+    p->next = proc_list;
+    proc_list = p;
+    spin_unlock(&proc_lock);
+
+    sched_enqueue(p);
+    return p;
+}
+
+struct proc *proc_fork(void) {
+    struct proc *parent = myproc();
+    if (!parent) {
+        return NULL;
+    }
+
+    struct proc *child = kmem_cache_alloc(proc_cache);
+    if (!child) {
+        klog(KLOG_ERR, "No memory for a new process!");
+        return NULL;
+    }
+    memset(child, 0, sizeof(*child));
+    child->cpu = NHART;
+
+    child->kstack = pfa_alloc_order(KSTACK_ORDER);
+    child->pagetable = vm_create_user_pagetable();
+    if (!child->kstack || !child->pagetable) {
+        klog(KLOG_ERR, "Failed to allocate fork resources.");
+        proc_free(child);
+        return NULL;
+    }
+    proc_init_context(child);
+
+    // Share every owned frame copy-on-write; only page tables are copied.
+    int err = vm_fork(parent->pagetable, child->pagetable);
+    // Parent leaves lost PTE_W even on failure, so always flush them.
+    vm_flush_asid(vm_asid_get(&parent->asid));
+    if (err != 0) {
+        klog(KLOG_ERR, "Failed to copy address space for fork.");
+        proc_free(child);
+        return NULL;
+    }
+
+    for (struct vm_region *r = parent->regions; r; r = r->next) {
+        if (proc_add_region(child, r->start, r->end - r->start, r->flags) != 0) {
+            proc_free(child);
+            return NULL;
+        }
+    }
+
+    // The ring page is the parent's alone (see sys_ring_setup()); drop the shared mapping.
+    if (parent->ring) {
+        vm_unmap_range(child->pagetable, SYS_RING_VA, PAGE_SIZE, vm_asid_get(&child->asid));
+    }
+
+    child->tf = parent->tf;
+    child->tf.regs[9] = 0; // a0 (x10): fork returns 0 in the child.
+
+    spin_lock(&proc_lock);
+    child->pid = next_pid++;
+    child->next = proc_list;
+    proc_list = child;
+    spin_unlock(&proc_lock);
+
+    // The child inherits the parent's priority but starts with a fresh slice.
+    child->prio = parent->prio;
+    sched_enqueue(child);
+    return child;
+}
+
+int proc_add_region(struct proc *p, uint64_t va, uint64_t len, uint64_t flags) {
+    if (((va | len) & (PAGE_SIZE - 1)) != 0 || len == 0) {
+        return -1;
+    }
+    for (struct vm_region *r = p->regions; r; r = r->next) {
+        if (va < r->end && r->start < va + len) {
+            return -1;
+        }
+    }
+    struct vm_region *r = kmalloc(sizeof(*r));
+    if (!r) {
+        return -1;
+    }
+    r->start = va;
+    r->end = va + len;
+    r->flags = flags & (PTE_R | PTE_W | PTE_X);
+    r->next = p->regions;
+    p->regions = r;
+    return 0;
+}
+
+struct proc *proc_find(uint64_t pid) {
+    spin_lock(&proc_lock);
+    struct proc *p = proc_list;
+    while (p && p->pid != pid) {
+        p = p->next;
+    }
+    spin_unlock(&proc_lock);
+    return p;
+}
+
+struct proc *proc_find_locked(uint64_t pid) {
+    spin_lock(&proc_lock);
+    struct proc *p = proc_list;
+    while (p && p->pid != pid) {
+        p = p->next;
+    }
+    if (p) {
+        spin_lock(&p->ipc.lock);
+    }
+    spin_unlock(&proc_lock);
+    return p;
+}
+
+struct vm_region *proc_find_region(struct proc *p, uint64_t va) {
+    for (struct vm_region *r = p->regions; r; r = r->next) {
+        if (va >= r->start && va < r->end) {
+            return r;
         }
     }
-    uart_puts("No available process slot!\n");
+    return NULL;
 }
 
 /*
- * The scheduler function.
- * Iterates through the process table and context switches to RUNNABLE processes.
+ * Free a process that is no longer running anywhere.
+ * Unlinks it from the process list and tears down its address space
+ * with a single TLB flush for its ASID.
  */
-void scheduler(void) {
-    while (1) {
-        // Iterate over process table.
-        for (int i = 0; i < NPROC; i++) {
-            if (procs[i].state == RUNNABLE) {
-                current_proc = &procs[i];
-                current_proc->state = RUNNING;
-                
-                // Switch context from scheduler to process.
-                // swtch will save scheduler_context and load current_proc->context.
-                extern void swtch(struct context **old, struct context *new);
-                swtch(&scheduler_context, &current_proc->context);
-                
-                // When the user process yields, execution resumes here.
-                // It might have changed state (e.g., back to RUNNABLE).
-            }
+void proc_free(struct proc *p) {
+    spin_lock(&proc_lock);
+    for (struct proc **pp = &proc_list; *pp; pp = &(*pp)->next) {
+        if (*pp == p) {
+            *pp = p->next;
+            break;
         }
     }
+    spin_unlock(&proc_lock);
+
+    if (p->pagetable) {
+        // A dying process must not take a fresh ASID (or force a rollover)
+        // just to flush it.
+        vm_destroy(p->pagetable, vm_asid_peek(p->asid));
+    }
+    if (p->kstack) {
+        pfa_free_order(p->kstack, KSTACK_ORDER);
+    }
+    if (p->ring) {
+        pfa_free(p->ring);
+    }
+    while (p->regions) {
+        struct vm_region *r = p->regions;
+        p->regions = r->next;
+        kfree(r);
+    }
+    p->state = UNUSED;
+    kmem_cache_free(proc_cache, p);
 }
 
 /*
- * Yield the CPU from the current process.
- * Mark the process as RUNNABLE and switch back to the scheduler.
+ * Unlinking under proc_lock first means no lookup can return the process
+ * any more, and one that already did holds its endpoint lock, which
+ * ipc_exit() waits for.
  */
-void yield(void) {
-    if (current_proc) {
-        current_proc->state = RUNNABLE;
-        extern void swtch(struct context **old, struct context *new);
-        swtch(&current_proc->context, &scheduler_context);
+void proc_exit(int64_t status) {
+    intr_save();
+    struct proc *p = myproc();
+    klog(KLOG_INFO, "Process %d exited with status %d.", p->pid, status);
+
+    spin_lock(&proc_lock);
+    for (struct proc **pp = &proc_list; *pp; pp = &(*pp)->next) {
+        if (*pp == p) {
+            *pp = p->next;
+            break;
+        }
     }
+    spin_unlock(&proc_lock);
+
+    ipc_exit(p);
+    sched_exit();
 }
@@ -3,48 +3,109 @@
 
 #include <stdint.h>
 #include "vm.h"
+#include "trap.h"     // struct TrapFrame.
+#include "context.h"  // struct context.
+#include "sched.h"    // struct sched_stats.
+#include "smp.h"      // myproc().
+#include "timer.h"    // struct timer.
+#include "ipc.h"      // struct ipc_endpoint.
+
+struct sys_ring;
+
+// Per-process kernel stack: 2^KSTACK_ORDER pages from the frame allocator.
+#define KSTACK_ORDER 1
+#define KSTACK_SIZE  (PAGE_SIZE << KSTACK_ORDER)
 
 /* Process States */
 enum proc_state {
     UNUSED = 0,
     SLEEPING,
     RUNNABLE,
-    RUNNING
+    RUNNING,
+    ZOMBIE      // Exited; freed once its hart has switched away from it.
 };
 
-/* 
- * Copy of the TrapFrame definition from src/trap.h.
- * Each process will have its own trap frame to store user-state.
+/*
+ * A lazily backed range of user virtual memory.
+ * Frames are allocated and zeroed on first touch by the page-fault handler.
  */
-struct TrapFrame {
-    uint64_t regs[31]; // x1 through x31.
-    uint64_t sepc;     // Supervisor Exception Program Counter.
-    uint64_t scause;   // Supervisor Cause Register.
-    uint64_t stval;    // Supervisor Trap Value Register.
+struct vm_region {
+    uint64_t start;             // First byte (page-aligned).
+    uint64_t end;               // One past the last byte (page-aligned).
+    uint64_t flags;             // PTE_R / PTE_W / PTE_X permissions.
+    struct vm_region *next;
 };
 
 /* The Process Control Block (PCB) keeping track of a process. */
 struct proc {
     uint64_t pid;                  // Unique process ID.
     enum proc_state state;         // Process state.
-    void *kstack;                  // Pointer to the top of the kernel stack.
+    void *kstack;                  // Lowest address of the kernel stack (KSTACK_SIZE bytes).
     pagetable_t pagetable;         // Pointer to the user-space pagetable.
+    uint64_t asid;                 // ASID context (generation | ASID), see vm_asid_get().
     struct TrapFrame tf;           // Process trap frame (user registers).
-    struct context {               // Context for switching (callee-saved registers).
-        uint64_t ra;
-        uint64_t s0;
-        uint64_t s1;
-        uint64_t s2;
-        uint64_t s3;
-        uint64_t s4;
-        uint64_t s5;
-        uint64_t s6;
-        uint64_t s7;
-        uint64_t s8;
-        uint64_t s9;
-        uint64_t s10;
-        uint64_t s11;
-    } context;
+    struct context context;        // Context for switching (callee-saved registers).
+    struct vm_region *regions;     // Demand-paged regions of the address space.
+    uint64_t mmap_next;            // Next address SYS_MMAP hands out when none is given.
+    struct sys_ring *ring;         // Submission/completion ring (kernel address), or NULL.
+    struct ipc_endpoint ipc;       // Message queue and receive state, owned by ipc.c.
+
+    // Scheduling state, owned by sched.c.
+    int prio;                      // Run-queue level (0 = highest).
+    uint32_t slice_left;           // Timer ticks left in the current slice.
+    struct proc *rq_next;          // Run-queue links.
+    struct proc *rq_prev;
+    uint64_t sched_ts;             // rdtime at the last enqueue or dispatch.
+    uint64_t cpu;                  // Hart it last ran on (NHART if never).
+    int on_cpu;                    // Set until its context is saved on the hart it last left.
+    struct sched_stats stats;      // Runtime, wait time and switch counters.
+    struct timer sleep_timer;      // Wakes the process from sched_sleep_until().
+    struct proc *next;             // Next PCB in the process list.
 };
 
+// Initialize the process table (creates the PCB cache).
+void proc_init(void);
+
+/*
+ * Create a user process starting at 'entry_point', a function of the user
+ * image (user.o). Returns NULL on failure.
+ */
+struct proc *proc_create_user(void (*entry_point)(void));
+
+/*
+ * Fork the current process. The child shares the parent's frames
+ * copy-on-write, gets a copy of its regions and trap frame, and sees 0 in a0.
+ * Returns the child, or NULL on failure.
+ */
+struct proc *proc_fork(void);
+
+/*
+ * Declare a demand-paged region of 'len' bytes at 'va' with PTE_R/W/X 'flags'.
+ * Returns 0, or -1 if the range is unaligned, overlaps a region or out of memory.
+ */
+int proc_add_region(struct proc *p, uint64_t va, uint64_t len, uint64_t flags);
+
+// Look up a live process by pid. Returns NULL if there is none.
+struct proc *proc_find(uint64_t pid);
+
+/*
+ * Look up a live process by pid and take its IPC endpoint lock, which keeps
+ * it from exiting until the lock is dropped. Called with interrupts off.
+ * Returns NULL (and takes no lock) if there is none.
+ */
+struct proc *proc_find_locked(uint64_t pid);
+
+// Find the region containing 'va', or NULL.
+struct vm_region *proc_find_region(struct proc *p, uint64_t va);
+
+// Release a process: its address space, kernel stack and PCB.
+void proc_free(struct proc *p);
+
+/*
+ * End the current process with 'status'. It leaves the process list, fails
+ * the senders queued on it and switches away for good; the next task to run
+ * on its hart frees it. Never returns.
+ */
+void proc_exit(int64_t status);
+
 #endif // PROC_H
@@ -0,0 +1,119 @@
+#include "prof.h"
+#include "proc.h"
+#include "trap.h"
+#include "riscv.h"
+#include "uart.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Per-hart profile. Each chunk header sits directly in front of its payload
+ * so a chunk goes out in one uart_write() and cannot be split by another
+ * hart's console output.
+ */
+struct prof_hart {
+    struct prof_chunk samples_hdr;
+    struct prof_sample samples[PROF_SAMPLES];
+    struct prof_chunk traps_hdr;
+    struct prof_traps traps;
+    uint32_t nsamples;
+    uint32_t ticks;               // Timer interrupts since the last sample.
+} __attribute__((aligned(64)));
+
+_Static_assert(offsetof(struct prof_hart, samples) ==
+               offsetof(struct prof_hart, samples_hdr) + sizeof(struct prof_chunk),
+               "sample chunk must be contiguous");
+_Static_assert(offsetof(struct prof_hart, traps) ==
+               offsetof(struct prof_hart, traps_hdr) + sizeof(struct prof_chunk),
+               "trap chunk must be contiguous");
+
+static struct prof_hart prof_harts[NHART];
+static int prof_running;
+static uint32_t prof_period = PROF_PERIOD;
+
+void prof_start(uint32_t period) {
+    __atomic_store_n(&prof_running, 0, __ATOMIC_RELEASE);
+    for (int h = 0; h < NHART; h++) {
+        struct prof_hart *ph = &prof_harts[h];
+        memset(&ph->traps, 0, sizeof(ph->traps));
+        ph->nsamples = 0;
+        ph->ticks = 0;
+    }
+    prof_period = period ? period : PROF_PERIOD;
+    __atomic_store_n(&prof_running, 1, __ATOMIC_RELEASE);
+}
+
+void prof_stop(void) {
+    __atomic_store_n(&prof_running, 0, __ATOMIC_RELEASE);
+}
+
+void prof_tick(struct TrapFrame *frame) {
+    if (!__atomic_load_n(&prof_running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    struct prof_hart *ph = &prof_harts[cpuid()];
+    if (++ph->ticks < prof_period) {
+        return;
+    }
+    ph->ticks = 0;
+    if (ph->nsamples >= PROF_SAMPLES) {
+        ph->traps.dropped++;
+        return;
+    }
+    // A trap from U-mode saves into the process's own frame.
+    struct proc *p = myproc();
+    struct prof_sample *s = &ph->samples[ph->nsamples++];
+    s->pc = frame->sepc;
+    s->pid = p ? (uint32_t)p->pid : 0;
+    s->mode = (p && frame == &p->tf) ? PROF_MODE_USER : PROF_MODE_KERNEL;
+}
+
+void prof_trap(uint64_t scause, uint64_t cycles) {
+    if (!__atomic_load_n(&prof_running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    uint64_t code = scause & ~SCAUSE_INTR;
+    if (code >= PROF_NCAUSE / 2) {
+        return;
+    }
+    unsigned int cause = code + ((scause & SCAUSE_INTR) ? PROF_NCAUSE / 2 : 0);
+    unsigned int bucket = 63 - __builtin_clzl(cycles | 1);
+    if (bucket >= PROF_BUCKETS) {
+        bucket = PROF_BUCKETS - 1;
+    }
+
+    // Runs with interrupts off on the trapping hart, so plain updates suffice.
+    struct prof_traps *t = &prof_harts[cpuid()].traps;
+    t->count[cause]++;
+    t->cycles[cause] += cycles;
+    t->hist[cause][bucket]++;
+}
+
+static void chunk_init(struct prof_chunk *c, int type, uint64_t hart, uint32_t len,
+                       uint32_t count) {
+    c->magic = PROF_MAGIC;
+    c->version = PROF_VERSION;
+    c->type = type;
+    c->hart = hart;
+    c->reserved = 0;
+    c->len = len;
+    c->count = count;
+}
+
+void prof_dump(void) {
+    prof_stop();
+    for (uint64_t h = 0; h < NHART; h++) {
+        struct prof_hart *ph = &prof_harts[h];
+        uint32_t n = ph->nsamples;
+        chunk_init(&ph->samples_hdr, PROF_CHUNK_SAMPLES, h, n * sizeof(struct prof_sample), n);
+        uart_write((const char *)&ph->samples_hdr,
+                   sizeof(struct prof_chunk) + n * sizeof(struct prof_sample));
+        chunk_init(&ph->traps_hdr, PROF_CHUNK_TRAPS, h, sizeof(struct prof_traps), 1);
+        uart_write((const char *)&ph->traps_hdr,
+                   sizeof(struct prof_chunk) + sizeof(struct prof_traps));
+    }
+    struct prof_chunk end;
+    chunk_init(&end, PROF_CHUNK_END, 0, 0, NHART);
+    uart_write((const char *)&end, sizeof(end));
+}
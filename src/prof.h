@@ -0,0 +1,82 @@
+#ifndef PROF_H
+#define PROF_H
+
+#include <stdint.h>
+
+struct TrapFrame;
+
+/*
+ * Sampling profiler and per-cause trap statistics.
+ *
+ * While running, every PROF_PERIOD-th timer interrupt on a hart records the
+ * interrupted pc, pid and privilege mode into that hart's sample buffer
+ * (PROF_SAMPLES entries; later samples are counted as dropped). Every trap
+ * also adds its handling time in cycles to a per-cause log2 histogram.
+ * Only code running with interrupts enabled can be sampled.
+ */
+#define PROF_SAMPLES   1024
+#define PROF_BUCKETS   32    // Bucket b counts traps that took [2^b, 2^(b+1)) cycles.
+#define PROF_NCAUSE    32    // Exception codes 0-15, then interrupt codes 0-15 (2 * TRAP_NCAUSE).
+
+// Default sampling period in timer interrupts.
+#define PROF_PERIOD    1
+
+/*
+ * Binary dump format (little-endian), written by prof_dump() as a series of
+ * self-delimiting chunks so that console text between them does no harm.
+ * Each chunk is a struct prof_chunk followed by 'len' payload bytes:
+ *   PROF_CHUNK_SAMPLES: 'count' struct prof_sample from hart 'hart'.
+ *   PROF_CHUNK_TRAPS:   struct prof_traps of hart 'hart'.
+ *   PROF_CHUNK_END:     no payload; 'count' is the number of harts dumped.
+ * tools/prof_symbolize.py decodes the stream.
+ */
+#define PROF_MAGIC 0x46525043u // "CPRF"
+#define PROF_VERSION 1
+
+enum prof_chunk_type {
+    PROF_CHUNK_SAMPLES = 1,
+    PROF_CHUNK_TRAPS,
+    PROF_CHUNK_END,
+};
+
+struct prof_chunk {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t type;
+    uint8_t hart;
+    uint8_t reserved;
+    uint32_t len;     // Payload bytes.
+    uint32_t count;   // Records in the payload (see above).
+};
+
+// Sample modes.
+#define PROF_MODE_USER 0
+#define PROF_MODE_KERNEL 1
+
+struct prof_sample {
+    uint64_t pc;
+    uint32_t pid;     // 0 if no process was running.
+    uint8_t mode;     // PROF_MODE_*.
+    uint8_t pad[3];
+};
+
+struct prof_traps {
+    uint64_t dropped;                            // Samples lost to a full buffer.
+    uint64_t count[PROF_NCAUSE];
+    uint64_t cycles[PROF_NCAUSE];                // Total handling cycles.
+    uint32_t hist[PROF_NCAUSE][PROF_BUCKETS];
+};
+
+// Clear all buffers and start sampling every 'period' timer interrupts (0: PROF_PERIOD).
+void prof_start(uint32_t period);
+
+void prof_stop(void);
+
+// Stop the profiler and write every hart's samples and trap statistics to the UART.
+void prof_dump(void);
+
+// Trap-path hooks, called from trap_handler().
+void prof_tick(struct TrapFrame *frame);
+void prof_trap(uint64_t scause, uint64_t cycles);
+
+#endif // PROF_H
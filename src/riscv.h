@@ -0,0 +1,107 @@
+#ifndef RISCV_H
+#define RISCV_H
+
+#include <stdint.h>
+
+// Maximum number of harts the kernel will bring up.
+#define NHART 4
+
+// sstatus bits.
+#define SSTATUS_SIE (1UL << 1) // Supervisor Interrupt Enable
+#define SSTATUS_VS_MASK    (3UL << 9) // Vector state: Off (0), Initial, Clean, Dirty.
+#define SSTATUS_VS_INITIAL (1UL << 9)
+
+// misa (and device tree ISA string) bit of single-letter extension 'c'.
+#define ISA_EXT(c) (1UL << ((c) - 'a'))
+
+#ifdef CHIMERA_HOST
+// Host build of the allocator and page-table code (see host/).
+#include "host/riscv_host.h"
+#else
+
+static inline uint64_t r_sstatus(void) {
+    uint64_t x;
+    asm volatile("csrr %0, sstatus" : "=r"(x));
+    return x;
+}
+
+static inline void w_sstatus(uint64_t x) {
+    asm volatile("csrw sstatus, %0" : : "r"(x));
+}
+
+// Current value of the platform timer (the time CSR).
+static inline uint64_t r_time(void) {
+    uint64_t x;
+    asm volatile("csrr %0, time" : "=r"(x));
+    return x;
+}
+
+// Cycle and retired-instruction counters (readable in S-mode via mcounteren).
+static inline uint64_t r_cycle(void) {
+    uint64_t x;
+    asm volatile("csrr %0, cycle" : "=r"(x));
+    return x;
+}
+
+static inline uint64_t r_instret(void) {
+    uint64_t x;
+    asm volatile("csrr %0, instret" : "=r"(x));
+    return x;
+}
+
+/*
+ * Hart ID of the calling hart.
+ * boot.S leaves mhartid in tp and the kernel never modifies it.
+ */
+static inline uint64_t cpuid(void) {
+    uint64_t x;
+    asm volatile("mv %0, tp" : "=r"(x));
+    return x;
+}
+
+/*
+ * Disable supervisor interrupts and return the previous SIE state,
+ * to be handed back to intr_restore().
+ */
+static inline uint64_t intr_save(void) {
+    uint64_t x;
+    asm volatile("csrrci %0, sstatus, 2" : "=r"(x) : : "memory");
+    return x & SSTATUS_SIE;
+}
+
+static inline void intr_restore(uint64_t saved) {
+    if (saved) {
+        asm volatile("csrsi sstatus, 2" : : : "memory");
+    }
+}
+
+static inline uint64_t r_satp(void) {
+    uint64_t x;
+    asm volatile("csrr %0, satp" : "=r"(x));
+    return x;
+}
+
+static inline void w_satp(uint64_t x) {
+    asm volatile("csrw satp, %0" : : "r"(x) : "memory");
+}
+
+// TLB maintenance. rs2 = x0 also reaches global (kernel) mappings.
+static inline void sfence_vma_all(void) {
+    asm volatile("sfence.vma zero, zero" ::: "memory");
+}
+
+static inline void sfence_vma_asid(uint64_t asid) {
+    asm volatile("sfence.vma zero, %0" : : "r"(asid) : "memory");
+}
+
+static inline void sfence_vma_page(uint64_t va) {
+    asm volatile("sfence.vma %0, zero" : : "r"(va) : "memory");
+}
+
+static inline void sfence_vma_page_asid(uint64_t va, uint64_t asid) {
+    asm volatile("sfence.vma %0, %1" : : "r"(va), "r"(asid) : "memory");
+}
+
+#endif // CHIMERA_HOST
+
+#endif // RISCV_H
@@ -0,0 +1,545 @@
+#include "sched.h"
+#include "proc.h"
+#include "smp.h"
+#include "context.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "timer.h"
+#include "klog.h"
+#include "mem.h"
+#include "panic.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Per-hart multi-level run queue.
+ * Each priority level is an intrusive FIFO of RUNNABLE processes, and bit k
+ * of 'bitmap' is set while level k is non-empty, so picking the next task is
+ * a single ctz regardless of how many processes exist. A hart with nothing
+ * to run steals from the hart with the most queued work.
+ */
+struct runqueue {
+    struct spinlock lock;
+    struct proc *head[SCHED_NPRIO];
+    struct proc *tail[SCHED_NPRIO];
+    uint32_t bitmap;
+    uint32_t nr_queued; // Read without the lock when picking a steal victim.
+    uint64_t ticks;     // Timer ticks since the last priority boost.
+} __attribute__((aligned(64)));
+
+static struct runqueue runqueues[NHART];
+
+// Per-hart scheduler tick, armed only while the hart runs a process.
+static struct timer tick_timers[NHART];
+
+// SCHED_TICK_US in time-CSR ticks, from the timebase found at boot.
+static uint64_t sched_tick_interval;
+
+// Time slice per level in timer ticks: interactive levels are short, batch ones long.
+static uint32_t sched_slice[SCHED_NPRIO] = { 1, 1, 2, 2, 4, 4, 8, 8 };
+
+void sched_init(void) {
+    sched_tick_interval = timer_us_to_ticks(SCHED_TICK_US);
+    for (int h = 0; h < NHART; h++) {
+        struct runqueue *rq = &runqueues[h];
+        rq->lock.locked = 0;
+        for (int i = 0; i < SCHED_NPRIO; i++) {
+            rq->head[i] = rq->tail[i] = NULL;
+        }
+        rq->bitmap = 0;
+        rq->nr_queued = 0;
+        rq->ticks = 0;
+        timer_setup(&tick_timers[h], NULL, NULL);
+    }
+}
+
+void sched_set_slice(int prio, uint32_t ticks) {
+    if (prio < 0 || prio >= SCHED_NPRIO) {
+        return;
+    }
+    sched_slice[prio] = ticks ? ticks : 1;
+}
+
+// Append 'p' to its level. Caller holds rq->lock.
+static void rq_push(struct runqueue *rq, struct proc *p) {
+    int prio = p->prio;
+    p->rq_next = NULL;
+    p->rq_prev = rq->tail[prio];
+    if (rq->tail[prio]) {
+        rq->tail[prio]->rq_next = p;
+    } else {
+        rq->head[prio] = p;
+    }
+    rq->tail[prio] = p;
+    rq->bitmap |= 1U << prio;
+    rq->nr_queued++;
+}
+
+// Unlink 'p' from level 'prio'. Caller holds rq->lock.
+static void rq_remove(struct runqueue *rq, struct proc *p, int prio) {
+    if (p->rq_prev) {
+        p->rq_prev->rq_next = p->rq_next;
+    } else {
+        rq->head[prio] = p->rq_next;
+    }
+    if (p->rq_next) {
+        p->rq_next->rq_prev = p->rq_prev;
+    } else {
+        rq->tail[prio] = p->rq_prev;
+    }
+    if (!rq->head[prio]) {
+        rq->bitmap &= ~(1U << prio);
+    }
+    p->rq_next = p->rq_prev = NULL;
+    rq->nr_queued--;
+    // Boosts splice whole levels without touching each task, so refresh here.
+    p->prio = prio;
+}
+
+// Remove and return the first task of the highest non-empty level. Caller holds rq->lock.
+static struct proc *rq_pop(struct runqueue *rq) {
+    if (rq->bitmap == 0) {
+        return NULL;
+    }
+    int prio = __builtin_ctz(rq->bitmap);
+    struct proc *p = rq->head[prio];
+    rq_remove(rq, p, prio);
+    return p;
+}
+
+/*
+ * Steal for another hart: take the most recently queued task of the lowest
+ * non-empty level, the one least likely to be cache-hot or latency-sensitive
+ * here. Caller holds rq->lock.
+ */
+static struct proc *rq_steal(struct runqueue *rq) {
+    if (rq->bitmap == 0) {
+        return NULL;
+    }
+    int prio = 31 - __builtin_clz(rq->bitmap);
+    struct proc *p = rq->tail[prio];
+    rq_remove(rq, p, prio);
+    return p;
+}
+
+/*
+ * Move every queued task to level 0 by splicing the lower levels onto it,
+ * so CPU-bound tasks cannot be starved by interactive ones. Caller holds rq->lock.
+ */
+static void rq_boost(struct runqueue *rq) {
+    for (int prio = 1; prio < SCHED_NPRIO; prio++) {
+        if (!rq->head[prio]) {
+            continue;
+        }
+        if (rq->tail[0]) {
+            rq->tail[0]->rq_next = rq->head[prio];
+            rq->head[prio]->rq_prev = rq->tail[0];
+        } else {
+            rq->head[0] = rq->head[prio];
+        }
+        rq->tail[0] = rq->tail[prio];
+        rq->head[prio] = rq->tail[prio] = NULL;
+    }
+    if (rq->bitmap) {
+        rq->bitmap = 1;
+    }
+}
+
+/*
+ * A task woken from another hart may still be switching away from the one
+ * it slept on; it must not run anywhere before its context is saved.
+ */
+static void wait_off_cpu(struct proc *p) {
+    while (__atomic_load_n(&p->on_cpu, __ATOMIC_ACQUIRE)) {
+        asm volatile("nop");
+    }
+}
+
+/*
+ * Queue 'p' on the hart it last ran on (for cache affinity); tasks that
+ * have never run go to the calling hart.
+ */
+void sched_enqueue(struct proc *p) {
+    uint64_t hart = (p->cpu < NHART) ? p->cpu : cpuid();
+    struct runqueue *rq = &runqueues[hart];
+
+    wait_off_cpu(p);
+
+    uint64_t flags = spin_lock_irqsave(&rq->lock);
+    p->state = RUNNABLE;
+    p->sched_ts = r_time();
+    rq_push(rq, p);
+    spin_unlock(&rq->lock);
+    // An idle hart sleeps in wfi with its tick stopped; nudge it. A busy one
+    // finds the task at its next switch.
+    if (hart != cpuid() && __atomic_load_n(&cpus[hart].proc, __ATOMIC_RELAXED) == NULL) {
+        smp_send_ipi(hart);
+    }
+    intr_restore(flags);
+}
+
+void sched_tick(void) {
+    uint64_t flags = intr_save();
+    struct runqueue *rq = &runqueues[cpuid()];
+    struct proc *p = mycpu()->proc;
+
+    spin_lock(&rq->lock);
+    if (++rq->ticks >= SCHED_BOOST_TICKS) {
+        rq->ticks = 0;
+        rq_boost(rq);
+        if (p) {
+            p->prio = 0;
+        }
+    }
+    spin_unlock(&rq->lock);
+    intr_restore(flags);
+
+    if (!p || p->state != RUNNING) {
+        return;
+    }
+    if (p->slice_left > 1) {
+        p->slice_left--;
+        return;
+    }
+    // Used its whole slice: looks CPU-bound, so demote it.
+    if (p->prio < SCHED_NPRIO - 1) {
+        p->prio++;
+    }
+    p->slice_left = 0;
+    p->stats.nr_preempt++;
+    mycpu()->need_resched = 1;
+}
+
+void sched_preempt(void) {
+    uint64_t flags = intr_save();
+    struct cpu *c = mycpu();
+    int resched = c->need_resched;
+    c->need_resched = 0;
+    intr_restore(flags);
+
+    if (resched) {
+        yield();
+    }
+}
+
+/*
+ * Tick timer callback. It re-arms itself while the hart has a process to
+ * charge; an idle hart lets it lapse and stops taking timer interrupts.
+ */
+static void sched_tick_fn(void *arg) {
+    struct timer *t = arg;
+    sched_tick();
+    // Console output for the log happens here and in the idle loop, never at the klog() call.
+    klog_drain(KLOG_TICK_BUDGET);
+    if (mycpu()->proc) {
+        timer_add(t, t->expires + sched_tick_interval);
+    }
+}
+
+/*
+ * Find work for an idle hart: the hart with the most queued tasks gives one up.
+ */
+static struct proc *steal_work(uint64_t self) {
+    struct runqueue *victim = NULL;
+    uint32_t most = 0;
+    for (uint64_t h = 0; h < NHART; h++) {
+        uint32_t n = __atomic_load_n(&runqueues[h].nr_queued, __ATOMIC_RELAXED);
+        if (h != self && n > most) {
+            most = n;
+            victim = &runqueues[h];
+        }
+    }
+    if (!victim) {
+        return NULL;
+    }
+    spin_lock(&victim->lock);
+    struct proc *p = rq_steal(victim);
+    spin_unlock(&victim->lock);
+    return p;
+}
+
+// Whether any hart has a task queued, i.e. whether sched_pick_next() could find one.
+static int sched_work_queued(void) {
+    for (int h = 0; h < NHART; h++) {
+        if (__atomic_load_n(&runqueues[h].nr_queued, __ATOMIC_RELAXED) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+struct proc *sched_pick_next(void) {
+    uint64_t hart = cpuid();
+    struct runqueue *rq = &runqueues[hart];
+    uint64_t flags = spin_lock_irqsave(&rq->lock);
+    struct proc *p = rq_pop(rq);
+    spin_unlock_irqrestore(&rq->lock, flags);
+    if (!p) {
+        p = steal_work(hart);
+    }
+    return p;
+}
+
+/*
+ * Start running 'p' on this hart: account its wait, give it a fresh slice
+ * and make sure the hart ticks. Interrupts are off.
+ */
+static void sched_dispatch(struct cpu *c, struct proc *p) {
+    uint64_t now = r_time();
+    p->stats.wait_time += now - p->sched_ts;
+    p->stats.nr_switches++;
+    p->sched_ts = now;
+    p->slice_left = sched_slice[p->prio];
+    p->state = RUNNING;
+    p->cpu = c->hartid;
+    c->proc = p;
+    c->need_resched = 0;
+    struct timer *tick = &tick_timers[c->hartid];
+    if (!timer_pending(tick)) {
+        timer_add(tick, now + sched_tick_interval);
+    }
+}
+
+/*
+ * Second half of every switch, run by whatever comes in: the task that was
+ * switched away from has its registers saved now, so it may run elsewhere.
+ * A preempted or yielding one goes back on this hart's run queue; a
+ * sleeping one is left to whoever wakes it, and an exited one is freed.
+ */
+static void sched_finish_switch(struct cpu *c) {
+    struct proc *prev = c->prev;
+    if (!prev) {
+        return;
+    }
+    c->prev = NULL;
+    // Only the process itself becomes ZOMBIE, and it cannot run again
+    // before on_cpu clears: look now, not after.
+    if (prev->state == ZOMBIE) {
+        proc_free(prev);
+        return;
+    }
+    __atomic_store_n(&prev->on_cpu, 0, __ATOMIC_RELEASE);
+    if (c->prev_requeue) {
+        struct runqueue *rq = &runqueues[c->hartid];
+        spin_lock(&rq->lock);
+        rq_push(rq, prev);
+        spin_unlock(&rq->lock);
+    }
+}
+
+/*
+ * Switch this hart from 'prev' (NULL: the idle loop) to 'next' (NULL: the
+ * idle loop) with a single swtch(), requeueing 'prev' afterwards if
+ * 'requeue' is set. Interrupts are off. Returns when 'prev' is switched
+ * back in, possibly on another hart.
+ */
+static void sched_switch_to(struct cpu *c, struct proc *prev, struct proc *next, int requeue) {
+    struct context *from = prev ? &prev->context : &c->context;
+    struct context *to = &c->context;
+    if (next) {
+        uint64_t last = next->cpu;
+        next->on_cpu = 1;
+        sched_dispatch(c, next);
+        // Kernel mappings are global, so switching the ASID-tagged satp
+        // leaves the rest of the TLB intact; vm_switch() does nothing at
+        // all when 'next' shares the address space already installed.
+        vm_switch(next->pagetable, &next->asid);
+        // TLB maintenance only reaches the local hart, and a process edits
+        // its page tables on the hart it runs on. After running elsewhere
+        // (a steal, a wakeup, a handoff) whatever this hart kept from an
+        // earlier visit may be stale, freed frames included: drop it.
+        if (last < NHART && last != c->hartid) {
+            vm_flush_asid(vm_asid_get(&next->asid));
+        }
+        to = &next->context;
+    } else {
+        // 'prev' may exit on another hart while this one idles: do not
+        // leave its page table installed here.
+        c->proc = NULL;
+        vm_switch_kernel();
+    }
+    c->prev = prev;
+    c->prev_requeue = requeue;
+    swtch(from, to);
+    sched_finish_switch(mycpu());
+}
+
+/*
+ * Called by proc_trampoline() the first time a process runs, on its own
+ * kernel stack. Returns the trap frame to enter U-mode with.
+ */
+struct TrapFrame *sched_first_run(void) {
+    struct cpu *c = mycpu();
+    sched_finish_switch(c);
+    return &c->proc->tf;
+}
+
+/*
+ * Take the running process 'prev' off this hart and run the best task
+ * queued here next, directly from here. With 'requeue' (yield, preemption)
+ * 'prev' stays runnable and keeps the CPU unless a task of the same or a
+ * higher level is queued, as if it had been requeued at the tail of its
+ * level. Without it 'prev' is asleep, and from the moment it was marked
+ * SLEEPING a waker may own it, so its state is not looked at again here.
+ * Only a hart with nothing left to run drops into its idle loop.
+ */
+static void sched_switch(struct cpu *c, struct proc *prev, int requeue) {
+    struct runqueue *rq = &runqueues[c->hartid];
+    uint64_t now = r_time();
+    prev->stats.runtime += now - prev->sched_ts;
+    prev->sched_ts = now;
+
+    spin_lock(&rq->lock);
+    if (requeue && (rq->bitmap & ((2U << prev->prio) - 1)) == 0) {
+        spin_unlock(&rq->lock);
+        sched_dispatch(c, prev);
+        return;
+    }
+    struct proc *next = rq_pop(rq);
+    spin_unlock(&rq->lock);
+    if (!next && !requeue) {
+        next = steal_work(c->hartid);
+    }
+    sched_switch_to(c, prev, next, requeue);
+}
+
+/*
+ * Wake 'p' and run it on this hart right away, bypassing the run queues;
+ * the caller stays runnable and is requeued as by yield(), minus the boost.
+ */
+void sched_yield_to(struct proc *p) {
+    enum proc_state expected = SLEEPING;
+    if (!__atomic_compare_exchange_n(&p->state, &expected, RUNNABLE, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        return;
+    }
+    wait_off_cpu(p);
+
+    struct cpu *c = mycpu();
+    struct proc *prev = c->proc;
+    uint64_t now = r_time();
+    prev->stats.runtime += now - prev->sched_ts;
+    prev->sched_ts = now;
+    prev->state = RUNNABLE;
+    p->sched_ts = now; // It never waited in a queue.
+    sched_switch_to(c, prev, p, 1);
+}
+
+/*
+ * The scheduler function.
+ * Each hart's idle loop: it takes the highest-priority task from its own
+ * run queue (or steals one) and switches to it. Running tasks switch among
+ * themselves directly and only come back here when no task is left.
+ */
+void scheduler(void) {
+    struct cpu *c = mycpu();
+    struct timer *tick = &tick_timers[c->hartid];
+
+    timer_setup(tick, sched_tick_fn, tick);
+    c->online = 1;
+    while (1) {
+        intr_save();
+        struct proc *p = sched_pick_next();
+
+        if (!p) {
+            // Nothing runnable anywhere: stop ticking and do background work
+            // with interrupts on.
+            timer_cancel(tick);
+            asm volatile("csrsi sstatus, 2");
+            klog_drain(KLOG_IDLE_BUDGET);
+            unsigned int zeroed = pfa_zero_idle();
+            // Sleep with interrupts off, and only if nothing was queued
+            // meanwhile: an enqueue IPI from here on stays pending, ends the
+            // wfi and is taken once interrupts are back on.
+            intr_save();
+            if (zeroed == 0 && !sched_work_queued()) {
+                asm volatile("wfi");
+            }
+            asm volatile("csrsi sstatus, 2");
+            continue;
+        }
+
+        // Execution resumes here once no task is runnable on this hart.
+        sched_switch_to(c, NULL, p, 0);
+    }
+}
+
+/*
+ * Yield the CPU from the current process.
+ * Mark the process as RUNNABLE, requeue it and switch straight to the best
+ * task queued on this hart. Giving up the CPU with slice left counts as
+ * interactive and earns a one-level boost.
+ */
+void yield(void) {
+    uint64_t flags = intr_save();
+    struct cpu *c = mycpu();
+    struct proc *p = c->proc;
+    if (p) {
+        if (p->slice_left > 0 && p->prio > 0) {
+            p->prio--;
+        }
+        p->state = RUNNABLE;
+        sched_switch(c, p, 1);
+    }
+    intr_restore(flags);
+}
+
+void sched_exit(void) {
+    intr_save();
+    struct cpu *c = mycpu();
+    struct proc *p = c->proc;
+    p->state = ZOMBIE;
+    sched_switch(c, p, 0);
+    panic("sched_exit: an exited process was switched back in");
+}
+
+static void sleep_timer_fn(void *arg) {
+    sched_wakeup(arg);
+}
+
+/*
+ * Only the caller that moves 'p' out of SLEEPING queues it, so a timeout
+ * racing a wakeup from another hart cannot queue it twice.
+ */
+void sched_wakeup(struct proc *p) {
+    enum proc_state expected = SLEEPING;
+    if (__atomic_compare_exchange_n(&p->state, &expected, RUNNABLE, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        sched_enqueue(p);
+    }
+}
+
+/*
+ * Interrupts are off and 'lock' (if any) is held, so a waker cannot see
+ * the process before it is SLEEPING, and the timer, armed on this hart,
+ * cannot fire before the switch away has saved the process's context.
+ * Sleeping counts as giving up the CPU early.
+ */
+void sched_block(struct spinlock *lock, uint64_t deadline) {
+    struct cpu *c = mycpu();
+    struct proc *p = c->proc;
+    if (p->slice_left > 0 && p->prio > 0) {
+        p->prio--;
+    }
+    if (deadline != TIMER_NEVER) {
+        timer_setup(&p->sleep_timer, sleep_timer_fn, p);
+        timer_add(&p->sleep_timer, deadline);
+    }
+    __atomic_store_n(&p->state, SLEEPING, __ATOMIC_RELEASE);
+    if (lock) {
+        spin_unlock(lock);
+    }
+    sched_switch(c, p, 0);
+    if (deadline != TIMER_NEVER) {
+        // A timeout already firing on another hart must not reach a later sleep.
+        timer_cancel_sync(&p->sleep_timer);
+    }
+}
+
+void sched_sleep_until(uint64_t deadline) {
+    uint64_t flags = intr_save();
+    if (mycpu()->proc) {
+        sched_block(NULL, deadline);
+    }
+    intr_restore(flags);
+}
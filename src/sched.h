@@ -0,0 +1,94 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdint.h>
+
+struct proc;
+struct spinlock;
+struct TrapFrame;
+
+// Number of priority levels; 0 is the highest.
+#define SCHED_NPRIO 8
+
+// Every SCHED_BOOST_TICKS timer ticks all runnable tasks return to level 0.
+#define SCHED_BOOST_TICKS 100
+
+// Length of one scheduler tick in microseconds. Only harts running a process tick.
+#define SCHED_TICK_US 100000UL
+
+// Per-process scheduling counters (times are in rdtime ticks).
+struct sched_stats {
+    uint64_t runtime;     // Time spent running.
+    uint64_t wait_time;   // Time spent runnable but waiting in a run queue.
+    uint64_t nr_switches; // Times the process was switched in.
+    uint64_t nr_preempt;  // Times it was preempted at the end of its slice.
+};
+
+// Initialize the run queues.
+void sched_init(void);
+
+// Make 'p' RUNNABLE and queue it at its current priority.
+void sched_enqueue(struct proc *p);
+
+// Set the time slice of priority level 'prio' to 'ticks' timer ticks (at least 1).
+void sched_set_slice(int prio, uint32_t ticks);
+
+/*
+ * Account one timer tick to the running process. When its slice runs out
+ * it is demoted one level and marked for preemption.
+ */
+void sched_tick(void);
+
+// Yield if the current tick asked for it. Called at the end of interrupt handling.
+void sched_preempt(void);
+
+/*
+ * Dequeue the task this hart should run next: the head of its highest
+ * non-empty level, or else one stolen from the busiest hart. NULL if none.
+ */
+struct proc *sched_pick_next(void);
+
+// Run the scheduler loop on this hart. Never returns.
+void scheduler(void);
+
+/*
+ * Complete the switch into a process that has never run; called from
+ * proc_trampoline (switch.S) on its kernel stack. Returns its trap frame.
+ */
+struct TrapFrame *sched_first_run(void);
+
+// Give up the CPU from the currently running process.
+void yield(void);
+
+/*
+ * Switch away from the current process for good and leave it ZOMBIE; the
+ * task that runs next on this hart frees it. Never returns.
+ */
+void sched_exit(void);
+
+// Put the current process to sleep until the time CSR reaches 'deadline'.
+void sched_sleep_until(uint64_t deadline);
+
+/*
+ * Put the current process to sleep until sched_wakeup() or, unless it is
+ * TIMER_NEVER, until 'deadline'. Called with interrupts off; 'lock', if not
+ * NULL, is held and is released once the process is marked SLEEPING, which
+ * is what lets a wait queue hand off to its wakers without losing a wakeup.
+ * Returns with interrupts still off and 'lock' not held.
+ */
+void sched_block(struct spinlock *lock, uint64_t deadline);
+
+/*
+ * Wake the SLEEPING process 'p' and switch to it directly on this hart, for
+ * handing off to the receiver of a message. The caller is requeued. Called
+ * with interrupts off. Does nothing if 'p' was not SLEEPING.
+ */
+void sched_yield_to(struct proc *p);
+
+/*
+ * Make a SLEEPING process runnable again and queue it. Does nothing for
+ * other states, so racing wakeups (a timeout and a wait queue) queue it once.
+ */
+void sched_wakeup(struct proc *p);
+
+#endif // SCHED_H
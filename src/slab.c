@@ -0,0 +1,319 @@
+#include "slab.h"
+#include "mem.h"
+#include "klog.h"
+#include "panic.h"
+#include "spinlock.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define SLAB_PAGE_SIZE   4096UL
+#define KMEM_MIN_ALIGN   8UL
+#define KMEM_MAX_EMPTY   2  // Empty slabs a cache keeps before returning pages.
+#define KMALLOC_MIN_SHIFT 4 // Smallest size class is 16 bytes.
+#define KMALLOC_MAX_SHIFT 11
+#define KMALLOC_NR_CLASSES (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+
+/*
+ * Slab header, stored at the start of every slab page.
+ * Free objects are chained through a pointer stored 'free_off' bytes into
+ * each object. Large kmalloc blocks reuse the header with cache == NULL so
+ * kfree() can tell them apart and recover their order.
+ */
+struct slab {
+    struct kmem_cache *cache;
+    struct slab *next;
+    struct slab *prev;
+    void *freelist;
+    uint32_t inuse;
+    uint32_t order;
+};
+
+struct kmem_cache {
+    char name[KMEM_NAME_LEN];
+    uint64_t obj_size;      // Slot size including any trailing free pointer.
+    uint64_t free_off;      // Offset of the free-list link inside a slot.
+    uint64_t first_off;     // Offset of the first slot from the slab header.
+    uint64_t objs_per_slab;
+    void (*ctor)(void *obj);
+    struct spinlock lock;
+    struct slab *partial;
+    struct slab *full;
+    struct slab *empty;
+    uint64_t nr_partial;
+    uint64_t nr_full;
+    uint64_t nr_empty;
+    uint64_t objs_active;
+    uint64_t allocs;
+    uint64_t frees;
+};
+
+// Cache that struct kmem_cache objects themselves are allocated from.
+static struct kmem_cache cache_cache;
+
+static struct kmem_cache *kmalloc_caches[KMALLOC_NR_CLASSES];
+
+static inline uint64_t align_up(uint64_t x, uint64_t a) {
+    return (x + a - 1) & ~(a - 1);
+}
+
+static inline struct slab *slab_of(void *obj) {
+    return (struct slab *)((uint64_t)obj & ~(SLAB_PAGE_SIZE - 1));
+}
+
+static void slab_list_add(struct slab **head, struct slab *s) {
+    s->prev = NULL;
+    s->next = *head;
+    if (*head) {
+        (*head)->prev = s;
+    }
+    *head = s;
+}
+
+static void slab_list_del(struct slab **head, struct slab *s) {
+    if (s->prev) {
+        s->prev->next = s->next;
+    } else {
+        *head = s->next;
+    }
+    if (s->next) {
+        s->next->prev = s->prev;
+    }
+}
+
+/*
+ * Fill in a cache descriptor. Returns -1 if an object cannot fit in one slab.
+ */
+static int cache_setup(struct kmem_cache *cache, const char *name, uint64_t size,
+                       uint64_t align, void (*ctor)(void *obj)) {
+    if (align < KMEM_MIN_ALIGN) {
+        align = KMEM_MIN_ALIGN;
+    }
+    if ((align & (align - 1)) != 0 || size == 0) {
+        return -1;
+    }
+
+    int i = 0;
+    for (; name[i] && i < KMEM_NAME_LEN - 1; i++) {
+        cache->name[i] = name[i];
+    }
+    cache->name[i] = '\0';
+
+    // With a constructor, the link must not overwrite constructed state.
+    uint64_t slot = align_up(size, align);
+    cache->free_off = ctor ? slot : 0;
+    cache->obj_size = ctor ? align_up(slot + sizeof(void *), align) : slot;
+    cache->first_off = align_up(sizeof(struct slab), align);
+    if (cache->first_off + cache->obj_size > SLAB_PAGE_SIZE) {
+        return -1;
+    }
+    cache->objs_per_slab = (SLAB_PAGE_SIZE - cache->first_off) / cache->obj_size;
+    cache->ctor = ctor;
+    cache->lock.locked = 0;
+    cache->partial = cache->full = cache->empty = NULL;
+    cache->nr_partial = cache->nr_full = cache->nr_empty = 0;
+    cache->objs_active = cache->allocs = cache->frees = 0;
+    return 0;
+}
+
+/*
+ * Allocate and carve a new slab page. Runs the constructor on every slot.
+ */
+static struct slab *slab_create(struct kmem_cache *cache) {
+    struct slab *s = (struct slab *)pfa_alloc();
+    if (!s) {
+        return NULL;
+    }
+    s->cache = cache;
+    s->next = s->prev = NULL;
+    s->inuse = 0;
+    s->order = 0;
+    s->freelist = NULL;
+
+    // Thread the free list so that allocation walks the page upwards.
+    uint8_t *base = (uint8_t *)s + cache->first_off;
+    for (uint64_t i = cache->objs_per_slab; i > 0; i--) {
+        uint8_t *obj = base + (i - 1) * cache->obj_size;
+        if (cache->ctor) {
+            cache->ctor(obj);
+        }
+        *(void **)(obj + cache->free_off) = s->freelist;
+        s->freelist = obj;
+    }
+    return s;
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, uint64_t size, uint64_t align,
+                                     void (*ctor)(void *obj)) {
+    struct kmem_cache *cache = kmem_cache_alloc(&cache_cache);
+    if (!cache) {
+        klog(KLOG_WARN, "kmem_cache_create out of memory.");
+        return NULL;
+    }
+    if (cache_setup(cache, name, size, align, ctor) != 0) {
+        klog(KLOG_ERR, "kmem_cache_create with unsupported size or alignment.");
+        kmem_cache_free(&cache_cache, cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *cache) {
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+
+    struct slab *s = cache->partial;
+    if (!s) {
+        s = cache->empty;
+        if (!s) {
+            // Populate a new slab without holding the lock.
+            spin_unlock_irqrestore(&cache->lock, flags);
+            struct slab *fresh = slab_create(cache);
+            if (!fresh) {
+                return NULL;
+            }
+            flags = spin_lock_irqsave(&cache->lock);
+            slab_list_add(&cache->empty, fresh);
+            cache->nr_empty++;
+            s = cache->partial ? cache->partial : cache->empty;
+        }
+    }
+
+    void *obj = s->freelist;
+    s->freelist = *(void **)((uint8_t *)obj + cache->free_off);
+
+    // Move the slab to the list matching its new fill level.
+    if (s->inuse == 0) {
+        slab_list_del(&cache->empty, s);
+        cache->nr_empty--;
+    } else {
+        slab_list_del(&cache->partial, s);
+        cache->nr_partial--;
+    }
+    s->inuse++;
+    if (s->inuse == cache->objs_per_slab) {
+        slab_list_add(&cache->full, s);
+        cache->nr_full++;
+    } else {
+        slab_list_add(&cache->partial, s);
+        cache->nr_partial++;
+    }
+
+    cache->objs_active++;
+    cache->allocs++;
+    spin_unlock_irqrestore(&cache->lock, flags);
+    return obj;
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *obj) {
+    if (obj == NULL) {
+        return;
+    }
+    struct slab *s = slab_of(obj);
+    if (s->cache != cache) {
+        klog(KLOG_ERR, "kmem_cache_free of an object from another cache.");
+        panic("kmem_cache_free cache mismatch");
+    }
+
+    struct slab *release = NULL;
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+
+    *(void **)((uint8_t *)obj + cache->free_off) = s->freelist;
+    s->freelist = obj;
+
+    if (s->inuse == cache->objs_per_slab) {
+        slab_list_del(&cache->full, s);
+        cache->nr_full--;
+    } else {
+        slab_list_del(&cache->partial, s);
+        cache->nr_partial--;
+    }
+    s->inuse--;
+    if (s->inuse == 0) {
+        if (cache->nr_empty >= KMEM_MAX_EMPTY) {
+            release = s;
+        } else {
+            slab_list_add(&cache->empty, s);
+            cache->nr_empty++;
+        }
+    } else {
+        slab_list_add(&cache->partial, s);
+        cache->nr_partial++;
+    }
+
+    cache->objs_active--;
+    cache->frees++;
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    if (release) {
+        pfa_free(release);
+    }
+}
+
+void kmem_cache_get_stats(struct kmem_cache *cache, struct kmem_cache_stats *out) {
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+    out->obj_size = cache->obj_size;
+    out->objs_per_slab = cache->objs_per_slab;
+    out->nr_partial = cache->nr_partial;
+    out->nr_full = cache->nr_full;
+    out->nr_empty = cache->nr_empty;
+    out->objs_active = cache->objs_active;
+    out->allocs = cache->allocs;
+    out->frees = cache->frees;
+    spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+void kmem_init(void) {
+    static const char *names[KMALLOC_NR_CLASSES] = {
+        "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+        "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+    };
+
+    if (cache_setup(&cache_cache, "kmem_cache", sizeof(struct kmem_cache), 0, NULL) != 0) {
+        panic("kmem_init: cannot set up cache_cache");
+    }
+    for (int i = 0; i < KMALLOC_NR_CLASSES; i++) {
+        kmalloc_caches[i] = kmem_cache_create(names[i], 1UL << (i + KMALLOC_MIN_SHIFT), 0, NULL);
+        if (!kmalloc_caches[i]) {
+            panic("kmem_init: cannot create kmalloc caches");
+        }
+    }
+    klog(KLOG_INFO, "Slab allocator initialized.");
+}
+
+void *kmalloc(uint64_t size) {
+    if (size == 0) {
+        return NULL;
+    }
+    if (size <= KMALLOC_MAX_CACHE_SIZE) {
+        unsigned int shift = KMALLOC_MIN_SHIFT;
+        while ((1UL << shift) < size) {
+            shift++;
+        }
+        return kmem_cache_alloc(kmalloc_caches[shift - KMALLOC_MIN_SHIFT]);
+    }
+
+    // Large request: a whole buddy block with a header marking it as such.
+    uint64_t hdr = align_up(sizeof(struct slab), 16);
+    unsigned int order = 0;
+    while ((SLAB_PAGE_SIZE << order) < size + hdr) {
+        order++;
+    }
+    struct slab *s = (struct slab *)pfa_alloc_order(order);
+    if (!s) {
+        return NULL;
+    }
+    s->cache = NULL;
+    s->order = order;
+    return (uint8_t *)s + hdr;
+}
+
+void kfree(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    struct slab *s = slab_of(ptr);
+    if (s->cache == NULL) {
+        pfa_free_order(s, s->order);
+    } else {
+        kmem_cache_free(s->cache, ptr);
+    }
+}
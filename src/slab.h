@@ -0,0 +1,55 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Maximum length of a cache name, including the terminator.
+#define KMEM_NAME_LEN 16
+
+// Largest request served from a kmalloc size class; bigger ones get whole pages.
+#define KMALLOC_MAX_CACHE_SIZE 2048
+
+// Opaque object cache.
+struct kmem_cache;
+
+// Snapshot of a cache's slab lists and counters.
+struct kmem_cache_stats {
+    uint64_t obj_size;      // Bytes per object slot.
+    uint64_t objs_per_slab; // Object slots in each slab page.
+    uint64_t nr_partial;    // Slabs with both free and used objects.
+    uint64_t nr_full;       // Slabs with no free objects.
+    uint64_t nr_empty;      // Slabs kept around with every object free.
+    uint64_t objs_active;   // Objects currently handed out.
+    uint64_t allocs;        // Total kmem_cache_alloc() calls that succeeded.
+    uint64_t frees;         // Total kmem_cache_free() calls.
+};
+
+// Initialize the slab allocator and the kmalloc size classes. Requires pfa_init_range().
+void kmem_init(void);
+
+/*
+ * Create a cache of 'size'-byte objects aligned to 'align' (0 for the default of 8).
+ * If 'ctor' is non-NULL it runs once per object when a slab is populated, and
+ * objects must be returned to the cache in their constructed state.
+ * Returns NULL if the object does not fit in a single slab page.
+ */
+struct kmem_cache *kmem_cache_create(const char *name, uint64_t size, uint64_t align,
+                                     void (*ctor)(void *obj));
+
+// Allocate one object from 'cache'. Returns NULL when out of memory.
+void *kmem_cache_alloc(struct kmem_cache *cache);
+
+// Return an object to the cache it was allocated from.
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+
+// Copy the current statistics of 'cache' into 'out'.
+void kmem_cache_get_stats(struct kmem_cache *cache, struct kmem_cache_stats *out);
+
+// General-purpose allocation of 'size' bytes (8-byte aligned, not zeroed).
+void *kmalloc(uint64_t size);
+
+// Free memory returned by kmalloc(). NULL is ignored.
+void kfree(void *ptr);
+
+#endif // SLAB_H
@@ -0,0 +1,36 @@
+#include "smp.h"
+#include "trap.h"
+#include <stdint.h>
+
+#define SIE_SSIE (1UL << 1) // Supervisor software interrupt enable.
+#define SIP_SSIP (1UL << 1)
+
+struct cpu cpus[NHART];
+
+void smp_init_hart(void) {
+    asm volatile("csrs sie, %0" :: "r"(SIE_SSIE));
+}
+
+// S-mode cannot reach the CLINT's msip registers; the M-mode handler writes them.
+void smp_send_ipi(uint64_t hart) {
+    register uint64_t a0 asm("a0") = hart;
+    register uint64_t a7 asm("a7") = MCALL_SEND_IPI;
+    asm volatile("ecall" : "+r"(a0) : "r"(a7) : "memory");
+}
+
+void smp_ipi_clear(void) {
+    asm volatile("csrc sip, %0" :: "r"(SIP_SSIP));
+}
+
+// Set by the boot hart when secondaries may leave their parking loop.
+static volatile uint32_t smp_released = 0;
+
+void smp_release(void) {
+    __atomic_store_n(&smp_released, 1, __ATOMIC_RELEASE);
+}
+
+void smp_wait_release(void) {
+    while (!__atomic_load_n(&smp_released, __ATOMIC_ACQUIRE)) {
+        asm volatile("nop");
+    }
+}
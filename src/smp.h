@@ -0,0 +1,57 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+#include "riscv.h"
+#include "context.h"
+
+struct proc;
+
+/*
+ * Per-hart kernel data, indexed by the hart ID that boot.S leaves in tp.
+ * Only the owning hart writes its entry (with interrupts disabled).
+ */
+struct cpu {
+    uint64_t hartid;
+    struct proc *proc;        // Process running on this hart, or NULL.
+    struct proc *prev;        // Process just switched away from, until sched_finish_switch().
+    int prev_requeue;         // 'prev' is still runnable and goes back on the run queue.
+    struct context context;   // swtch() here to enter this hart's scheduler loop.
+    int online;               // Set once the hart has entered its scheduler.
+    int need_resched;         // The running process should yield on the way out of the trap.
+} __attribute__((aligned(64)));
+
+extern struct cpu cpus[NHART];
+
+// This hart's entry in cpus[]. Only stable while interrupts are off.
+static inline struct cpu *mycpu(void) {
+    return &cpus[cpuid()];
+}
+
+// Process running on this hart. Safe with interrupts on.
+static inline struct proc *myproc(void) {
+    uint64_t flags = intr_save();
+    struct proc *p = mycpu()->proc;
+    intr_restore(flags);
+    return p;
+}
+
+// Enable IPIs (supervisor software interrupts) on this hart.
+void smp_init_hart(void);
+
+/*
+ * Interrupt 'hart' so that it leaves wfi and looks at its run queue again.
+ * IPIs are not queued: several sent before the hart reacts arrive as one.
+ */
+void smp_send_ipi(uint64_t hart);
+
+// Acknowledge an IPI on this hart. Called from the trap handler.
+void smp_ipi_clear(void);
+
+// Release the parked secondary harts. Called by the boot hart once the kernel is set up.
+void smp_release(void);
+
+// Park the calling secondary hart until smp_release().
+void smp_wait_release(void);
+
+#endif // SMP_H
@@ -0,0 +1,44 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <stdint.h>
+#include "riscv.h"
+
+// Test-and-test-and-set spinlock built on the A extension.
+struct spinlock {
+    volatile uint32_t locked;
+};
+
+#define SPINLOCK_INIT { 0 }
+
+static inline void spin_lock(struct spinlock *lk) {
+    while (__atomic_exchange_n(&lk->locked, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&lk->locked, __ATOMIC_RELAXED)) {}
+    }
+}
+
+// Take the lock only if it is free. Returns 1 on success.
+static inline int spin_trylock(struct spinlock *lk) {
+    return __atomic_exchange_n(&lk->locked, 1, __ATOMIC_ACQUIRE) == 0;
+}
+
+static inline void spin_unlock(struct spinlock *lk) {
+    __atomic_store_n(&lk->locked, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Variants for locks that are also taken from trap context.
+ * Interrupts stay disabled on this hart while the lock is held.
+ */
+static inline uint64_t spin_lock_irqsave(struct spinlock *lk) {
+    uint64_t flags = intr_save();
+    spin_lock(lk);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(struct spinlock *lk, uint64_t flags) {
+    spin_unlock(lk);
+    intr_restore(flags);
+}
+
+#endif // SPINLOCK_H
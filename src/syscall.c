@@ -0,0 +1,288 @@
+#include "syscall.h"
+#include "proc.h"
+#include "sched.h"
+#include "timer.h"
+#include "fault.h"
+#include "mem.h"
+#include "vm.h"
+#include "uart.h"
+#include "prof.h"
+#include "futex.h"
+#include "ipc.h"
+#include "riscv.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// The range SYS_MMAP regions live in; without an address they are placed
+// upwards from the base.
+#define USER_MMAP_BASE 0x50000000UL
+#define USER_MMAP_END  SYS_RING_VA
+
+// Bytes SYS_WRITE copies from user memory at a time.
+#define WRITE_CHUNK 128
+
+_Static_assert(sizeof(struct sys_ring) <= PAGE_SIZE, "sys_ring must fit in one page");
+
+typedef int64_t (*syscall_fn)(const uint64_t *args);
+
+static int64_t sys_write(const uint64_t *args) {
+    uint64_t fd = args[0], buf = args[1], len = args[2];
+    char chunk[WRITE_CHUNK];
+
+    if (fd != 1 && fd != 2) {
+        return -EBADF;
+    }
+    for (uint64_t done = 0; done < len;) {
+        uint64_t n = len - done < WRITE_CHUNK ? len - done : WRITE_CHUNK;
+        if (copy_from_user(chunk, buf + done, n) != 0) {
+            return done ? (int64_t)done : -EFAULT;
+        }
+        uart_write(chunk, n);
+        done += n;
+    }
+    return (int64_t)len;
+}
+
+static int64_t sys_sleep(const uint64_t *args) {
+    uint64_t usec = args[0];
+    sched_sleep_until(r_time() + timer_us_to_ticks(usec));
+    return 0;
+}
+
+static int64_t sys_yield(const uint64_t *args) {
+    yield();
+    return 0;
+}
+
+static int64_t sys_getpid(const uint64_t *args) {
+    return (int64_t)myproc()->pid;
+}
+
+static int64_t sys_fork(const uint64_t *args) {
+    struct proc *child = proc_fork();
+    return child ? (int64_t)child->pid : -ENOMEM;
+}
+
+/*
+ * Lowest address from 'start' up where 'len' bytes fit in the mmap window
+ * without overlapping a region of 'p', or 0 if there is none.
+ */
+static uint64_t mmap_find_gap(struct proc *p, uint64_t start, uint64_t len) {
+    struct vm_region *r = p->regions;
+    while (r) {
+        if (start > USER_MMAP_END || USER_MMAP_END - start < len) {
+            return 0;
+        }
+        if (start < r->end && r->start < start + len) {
+            // Skip past the conflict and check every region again.
+            start = r->end;
+            r = p->regions;
+            continue;
+        }
+        r = r->next;
+    }
+    return (start > USER_MMAP_END || USER_MMAP_END - start < len) ? 0 : start;
+}
+
+static int64_t sys_mmap(const uint64_t *args) {
+    struct proc *p = myproc();
+    uint64_t va = args[0];
+    uint64_t len = (args[1] + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1UL);
+    uint64_t prot = args[2];
+    // Sv39 reserves write-only leaves, so PROT_WRITE implies PROT_READ.
+    uint64_t flags = ((prot & (PROT_READ | PROT_WRITE)) ? PTE_R : 0) |
+                     ((prot & PROT_WRITE) ? PTE_W : 0) | ((prot & PROT_EXEC) ? PTE_X : 0);
+
+    if (len == 0 || flags == 0 || len > USER_MMAP_END - USER_MMAP_BASE) {
+        return -EINVAL;
+    }
+    int placed = (va == 0);
+    if (placed) {
+        if (p->mmap_next < USER_MMAP_BASE) {
+            p->mmap_next = USER_MMAP_BASE;
+        }
+        // Explicit mappings may sit in the way; gaps left below mmap_next
+        // are only searched once the space above it is used up.
+        va = mmap_find_gap(p, p->mmap_next, len);
+        if (va == 0) {
+            va = mmap_find_gap(p, USER_MMAP_BASE, len);
+        }
+        if (va == 0) {
+            return -ENOMEM;
+        }
+    } else if ((va & (PAGE_SIZE - 1)) != 0 || va < USER_MMAP_BASE || va >= USER_MMAP_END ||
+               USER_MMAP_END - va < len) {
+        // An explicit address must stay inside the mmap window: below it are
+        // the user image and the global kernel slots, above it the ring page
+        // and the stack.
+        return -EINVAL;
+    }
+    if (proc_add_region(p, va, len, flags) != 0) {
+        // A placed range is free, so only the region itself can be missing.
+        return placed ? -ENOMEM : -EINVAL;
+    }
+    if (placed && va >= p->mmap_next) {
+        p->mmap_next = va + len;
+    }
+    return (int64_t)va;
+}
+
+/*
+ * Map a zeroed ring page at SYS_RING_VA. The frame is not PTE_OWNED: the
+ * kernel keeps using it through p->ring, so it must never be copied on
+ * write, and proc_free() releases it.
+ */
+static int64_t sys_ring_setup(const uint64_t *args) {
+    struct proc *p = myproc();
+    if (p->ring) {
+        return -EBUSY;
+    }
+    struct sys_ring *ring = pfa_alloc_zeroed();
+    if (!ring) {
+        return -ENOMEM;
+    }
+    ring->entries = SYS_RING_ENTRIES;
+
+    uint64_t flags = PTE_R | PTE_W | PTE_U | PTE_A | PTE_D;
+    if (vm_map(p->pagetable, SYS_RING_VA, (uint64_t)ring, flags) != 0) {
+        pfa_free(ring);
+        return -ENOMEM;
+    }
+    vm_flush_page(SYS_RING_VA, vm_asid_get(&p->asid));
+    p->ring = ring;
+    return (int64_t)SYS_RING_VA;
+}
+
+static int64_t sys_prof(const uint64_t *args) {
+    switch (args[0]) {
+    case PROF_OP_START:
+        prof_start((uint32_t)args[1]);
+        return 0;
+    case PROF_OP_STOP:
+        prof_stop();
+        return 0;
+    case PROF_OP_DUMP:
+        prof_dump();
+        return 0;
+    default:
+        return -EINVAL;
+    }
+}
+
+static int64_t sys_futex_wait(const uint64_t *args) {
+    return futex_wait(args[0], (uint32_t)args[1], args[2]);
+}
+
+static int64_t sys_futex_wake(const uint64_t *args) {
+    return futex_wake(args[0], (uint32_t)args[1]);
+}
+
+static int64_t sys_ipc_send(const uint64_t *args) {
+    struct ipc_msg msg;
+    msg.from = 0;
+    for (int i = 0; i < IPC_MSG_WORDS; i++) {
+        msg.words[i] = args[1 + i];
+    }
+    msg.grant_va = args[4];
+    msg.grant_len = args[5] & ~IPC_GRANT_FLAGS;
+    msg.grant_flags = args[5] & IPC_GRANT_FLAGS;
+    return ipc_send(args[0], &msg);
+}
+
+// The message comes back in registers: a1-a3 and the granted length in a4.
+static int64_t sys_ipc_recv(const uint64_t *args) {
+    struct ipc_msg msg;
+    int64_t err = ipc_recv(args[0], args[1], args[2], &msg);
+    if (err != 0) {
+        return err;
+    }
+    struct TrapFrame *tf = &myproc()->tf;
+    for (int i = 0; i < IPC_MSG_WORDS; i++) {
+        tf->regs[10 + i] = msg.words[i]; // a1 (x11) onwards
+    }
+    tf->regs[13] = msg.grant_len;        // a4 (x14)
+    return (int64_t)msg.from;
+}
+
+static int64_t sys_exit(const uint64_t *args) {
+    proc_exit((int64_t)args[0]);
+    return 0;
+}
+
+static int64_t sys_ring_enter(const uint64_t *args);
+
+// Handlers indexed by call number; NULL entries fail with -ENOSYS.
+static const syscall_fn syscalls[SYS_NR] = {
+    [SYS_WRITE]      = sys_write,
+    [SYS_SLEEP]      = sys_sleep,
+    [SYS_YIELD]      = sys_yield,
+    [SYS_GETPID]     = sys_getpid,
+    [SYS_FORK]       = sys_fork,
+    [SYS_MMAP]       = sys_mmap,
+    [SYS_RING_SETUP] = sys_ring_setup,
+    [SYS_RING_ENTER] = sys_ring_enter,
+    [SYS_PROF]       = sys_prof,
+    [SYS_FUTEX_WAIT] = sys_futex_wait,
+    [SYS_FUTEX_WAKE] = sys_futex_wake,
+    [SYS_IPC_SEND]   = sys_ipc_send,
+    [SYS_IPC_RECV]   = sys_ipc_recv,
+    [SYS_EXIT]       = sys_exit,
+};
+
+/*
+ * Run up to 'to_submit' queued submissions, posting a completion for each.
+ * The ring is shared with the process, so every entry is copied out before
+ * it is looked at and indices are re-read rather than trusted.
+ */
+static int64_t sys_ring_enter(const uint64_t *args) {
+    struct sys_ring *ring = myproc()->ring;
+    uint64_t to_submit = args[0];
+    if (!ring) {
+        return -EINVAL;
+    }
+
+    uint64_t done = 0;
+    while (done < to_submit) {
+        uint32_t head = ring->sq_head;
+        uint32_t tail = __atomic_load_n(&ring->sq_tail, __ATOMIC_ACQUIRE);
+        uint32_t cq_head = __atomic_load_n(&ring->cq_head, __ATOMIC_ACQUIRE);
+        uint32_t cq_tail = ring->cq_tail;
+        if (head == tail || cq_tail - cq_head >= SYS_RING_ENTRIES) {
+            break;
+        }
+
+        struct sys_sqe sqe = ring->sq[head % SYS_RING_ENTRIES];
+        __atomic_store_n(&ring->sq_head, head + 1, __ATOMIC_RELEASE);
+
+        int64_t result;
+        if (sqe.flags != 0 || sqe.op == SYS_FORK || sqe.op == SYS_EXIT ||
+            sqe.op == SYS_RING_SETUP || sqe.op == SYS_RING_ENTER || sqe.op == SYS_IPC_RECV) {
+            result = -EINVAL;
+        } else if (sqe.op >= SYS_NR || !syscalls[sqe.op]) {
+            result = -ENOSYS;
+        } else {
+            result = syscalls[sqe.op](sqe.args);
+        }
+
+        struct sys_cqe *cqe = &ring->cq[cq_tail % SYS_RING_ENTRIES];
+        cqe->user_data = sqe.user_data;
+        cqe->result = result;
+        __atomic_store_n(&ring->cq_tail, cq_tail + 1, __ATOMIC_RELEASE);
+        done++;
+    }
+    return (int64_t)done;
+}
+
+void syscall(struct TrapFrame *frame) {
+    uint64_t nr = frame->regs[16]; // a7 (x17)
+    // Step past the ecall first: fork copies this frame into the child.
+    frame->sepc += 4;
+
+    int64_t ret;
+    if (nr < SYS_NR && syscalls[nr]) {
+        ret = syscalls[nr](&frame->regs[9]); // a0-a5 (x10-x15)
+    } else {
+        ret = -ENOSYS;
+    }
+    frame->regs[9] = (uint64_t)ret;
+}
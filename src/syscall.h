@@ -0,0 +1,116 @@
+#ifndef SYSCALL_H
+#define SYSCALL_H
+
+#include <stdint.h>
+
+/*
+ * System call ABI: ecall from U-mode with the call number in a7 and up to
+ * six arguments in a0-a5. The result comes back in a0; failures are
+ * negative error codes. This header is shared with user programs.
+ */
+#define SYS_WRITE      1 // write(fd, buf, len) -> bytes written
+#define SYS_SLEEP      2 // sleep(usec) -> 0
+#define SYS_YIELD      3 // yield() -> 0
+#define SYS_GETPID     4 // getpid() -> pid
+#define SYS_FORK       5 // fork() -> child pid in the parent, 0 in the child
+#define SYS_MMAP       6 // mmap(va or 0, len, prot) -> va of a demand-zero region in
+                         // [0x50000000, SYS_RING_VA)
+#define SYS_IPC_SEND   7 // ipc_send(pid, w0, w1, w2, grant va, grant len | IPC_GRANT_*) -> 0
+#define SYS_RING_SETUP 8 // ring_setup() -> user address of the shared ring page
+#define SYS_RING_ENTER 9 // ring_enter(to_submit) -> submissions consumed
+#define SYS_PROF      10 // prof(op, arg) -> 0, see PROF_OP_*
+#define SYS_FUTEX_WAIT 11 // futex_wait(addr, expected, timeout_us or 0) -> 0 once woken
+#define SYS_FUTEX_WAKE 12 // futex_wake(addr, n) -> waiters woken
+#define SYS_IPC_RECV  13 // ipc_recv(pid or IPC_ANY, window va, window len) -> sender pid, see below
+#define SYS_EXIT      14 // exit(status) -> does not return
+#define SYS_NR        15
+
+// Error codes (returned negated).
+#define ESRCH   3
+#define EBADF   9
+#define EAGAIN 11
+#define ENOMEM 12
+#define EFAULT 14
+#define EBUSY  16
+#define EINVAL 22
+#define ENOSYS 38
+#define EMSGSIZE 90
+#define ETIMEDOUT 110
+
+// SYS_MMAP protection bits.
+#define PROT_READ  1
+#define PROT_WRITE 2
+#define PROT_EXEC  4
+
+/*
+ * Synchronous IPC. SYS_IPC_SEND blocks until the receiver takes the
+ * message; a receiver already waiting gets the CPU straight away.
+ * SYS_IPC_RECV blocks until a message from 'pid' (or anyone) arrives and
+ * returns the sender's pid in a0 and the IPC_MSG_WORDS words in a1-a3.
+ *
+ * A message may carry a page grant: 'len' bytes at the page-aligned 'va'
+ * of the sender, given as len | flags (len a multiple of the page size, at
+ * most IPC_GRANT_MAX). The frames are mapped, not copied, at the start of
+ * the receiver's window, which must be unused and becomes a region of the
+ * receiver; a4 returns the granted length (0: none). The receiver always
+ * gets read access, and write access with IPC_GRANT_WRITE. The pages stay
+ * shared, also with the children either side forks later, unless
+ * IPC_GRANT_MOVE takes them from the sender, whose range then reads back
+ * as zero-filled. Grants fail with -EMSGSIZE when they do
+ * not fit the window.
+ */
+#define IPC_ANY         (~0UL)  // SYS_IPC_RECV: accept any sender.
+#define IPC_MSG_WORDS   3
+#define IPC_GRANT_MOVE  1UL
+#define IPC_GRANT_WRITE 2UL
+#define IPC_GRANT_FLAGS (IPC_GRANT_MOVE | IPC_GRANT_WRITE)
+#define IPC_GRANT_MAX   (256UL * 4096)
+
+// SYS_PROF operations.
+#define PROF_OP_START 0 // Reset and start sampling every 'arg' timer interrupts (0: default).
+#define PROF_OP_STOP  1
+#define PROF_OP_DUMP  2 // Stop and write the profile to the console as binary chunks.
+
+/*
+ * Batched submission ring, one shared page per process.
+ * The process fills sq[sq_tail % SYS_RING_ENTRIES] and then advances
+ * sq_tail; SYS_RING_ENTER runs queued entries in order and posts one
+ * completion each at cq_tail, stopping early if the completion queue is
+ * full. Every SQE op is a SYS_* number taking its arguments from args[].
+ * Ops that do not make sense in a batch (fork, exit, the ring calls,
+ * and SYS_IPC_RECV, which returns in registers) fail with -EINVAL. Indices
+ * are free-running; the kernel only writes sq_head and cq_tail, the
+ * process only sq_tail and cq_head.
+ */
+#define SYS_RING_VA      0x7F000000UL // Fixed user address of the ring page.
+#define SYS_RING_ENTRIES 32
+
+struct sys_sqe {
+    uint32_t op;
+    uint32_t flags;      // Must be 0.
+    uint64_t args[6];
+    uint64_t user_data;  // Copied to the completion.
+};
+
+struct sys_cqe {
+    uint64_t user_data;
+    int64_t result;
+};
+
+struct sys_ring {
+    uint32_t sq_head;
+    uint32_t sq_tail;
+    uint32_t cq_head;
+    uint32_t cq_tail;
+    uint32_t entries;    // SYS_RING_ENTRIES.
+    uint32_t pad[11];    // Keeps the queues cache-line aligned.
+    struct sys_sqe sq[SYS_RING_ENTRIES];
+    struct sys_cqe cq[SYS_RING_ENTRIES];
+};
+
+struct TrapFrame;
+
+// Kernel side: handle an ecall from U-mode (dispatch on a7, result in a0).
+void syscall(struct TrapFrame *frame);
+
+#endif // SYSCALL_H
@@ -0,0 +1,319 @@
+#include "timer.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#include "trap.h"
+
+#define SIE_STIE (1UL << 5) // Supervisor timer interrupt enable.
+
+/*
+ * Hierarchical timer wheel, one per hart.
+ * A timer expiring 'd' jiffies after 'clk' lives in the lowest level L for
+ * which its expiry, counted in level-L slots, is fewer than TIMER_LVL_SIZE
+ * slots ahead of clk. Within a level the slots therefore never wrap past the
+ * current one, and the first non-empty slot after clk (found through the
+ * 'pending' bitmap) holds that level's earliest timers. Timers in the current
+ * slot of a higher level are cascaded down as clk catches up with them.
+ * Timers beyond the top level's range wait on 'overflow' until they fit;
+ * they are always later than everything on the wheel.
+ */
+struct timer_base {
+    struct spinlock lock;
+    uint64_t clk;                                  // Current wheel time in jiffies.
+    uint64_t next_expiry;                          // Deadline the comparator is set to.
+    uint64_t pending[TIMER_LEVELS];                // Bit s set while slot s is non-empty.
+    struct timer *slots[TIMER_LEVELS][TIMER_LVL_SIZE];
+    struct timer *overflow;
+    struct timer *running;                         // Timer whose callback is in flight.
+} __attribute__((aligned(64)));
+
+static struct timer_base timer_bases[NHART];
+
+uint64_t timer_hz = TIMER_HZ_DEFAULT;
+uint64_t timer_clint_base = CLINT_BASE_DEFAULT;
+
+static inline uint64_t jiffies_of(uint64_t time) {
+    return time >> TIMER_JIFFY_SHIFT;
+}
+
+// Set by boot.S when the harts implement Sstc.
+extern uint32_t timer_sstc;
+
+/*
+ * Program this hart's comparator. TIMER_NEVER parks it.
+ * With Sstc, stimecmp is a plain CSR write that also clears a pending
+ * interrupt; otherwise the M-mode handler programs mtimecmp for us.
+ */
+static void timer_hw_program(uint64_t deadline) {
+    if (timer_sstc) {
+        asm volatile("csrw 0x14d, %0" :: "r"(deadline)); // stimecmp
+        return;
+    }
+    register uint64_t a0 asm("a0") = deadline;
+    register uint64_t a7 asm("a7") = MCALL_SET_TIMER;
+    asm volatile("ecall" : "+r"(a0) : "r"(a7) : "memory");
+}
+
+// List head 't' is linked on.
+static inline struct timer **timer_head(struct timer_base *base, struct timer *t) {
+    return t->level == TIMER_LEVELS ? &base->overflow : &base->slots[t->level][t->slot];
+}
+
+// Link 't' into the right slot for base->clk. Caller holds base->lock.
+static void wheel_insert(struct timer_base *base, struct timer *t) {
+    uint64_t exp = jiffies_of(t->expires);
+    if (exp < base->clk) {
+        exp = base->clk;
+    }
+
+    int level = 0;
+    while (level < TIMER_LEVELS &&
+           (exp >> (level * TIMER_LVL_BITS)) - (base->clk >> (level * TIMER_LVL_BITS)) >= TIMER_LVL_SIZE) {
+        level++;
+    }
+    t->level = level;
+    t->slot = (exp >> (level * TIMER_LVL_BITS)) & (TIMER_LVL_SIZE - 1);
+
+    struct timer **head = timer_head(base, t);
+    t->prev = NULL;
+    t->next = *head;
+    if (t->next) {
+        t->next->prev = t;
+    }
+    *head = t;
+    if (level < TIMER_LEVELS) {
+        base->pending[level] |= 1UL << t->slot;
+    }
+}
+
+// Unlink 't' from its slot. Caller holds base->lock.
+static void wheel_remove(struct timer_base *base, struct timer *t) {
+    struct timer **head = timer_head(base, t);
+    if (t->prev) {
+        t->prev->next = t->next;
+    } else {
+        *head = t->next;
+    }
+    if (t->next) {
+        t->next->prev = t->prev;
+    }
+    if (!*head && t->level < TIMER_LEVELS) {
+        base->pending[t->level] &= ~(1UL << t->slot);
+    }
+    t->next = t->prev = NULL;
+}
+
+/*
+ * Earliest pending timer on 'base', or NULL. Looks at the first non-empty
+ * slot of each level, so the cost does not depend on how far away the
+ * deadlines are. Caller holds base->lock.
+ */
+static struct timer *wheel_first(struct timer_base *base) {
+    struct timer *first = NULL;
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        uint64_t bits = base->pending[level];
+        if (bits == 0) {
+            continue;
+        }
+        // Rotate so bit 0 is the current slot, then the lowest set bit is the next one.
+        unsigned int cur = (base->clk >> (level * TIMER_LVL_BITS)) & (TIMER_LVL_SIZE - 1);
+        uint64_t rot = (bits >> cur) | (cur ? bits << (TIMER_LVL_SIZE - cur) : 0);
+        unsigned int slot = (cur + __builtin_ctzll(rot)) & (TIMER_LVL_SIZE - 1);
+        for (struct timer *t = base->slots[level][slot]; t; t = t->next) {
+            if (!first || t->expires < first->expires) {
+                first = t;
+            }
+        }
+    }
+    if (!first) {
+        for (struct timer *t = base->overflow; t; t = t->next) {
+            if (!first || t->expires < first->expires) {
+                first = t;
+            }
+        }
+    }
+    return first;
+}
+
+/*
+ * Move the wheel to 'now_j' and push timers that have come within range of
+ * a lower level down into it. Caller holds base->lock.
+ */
+static void wheel_advance(struct timer_base *base, uint64_t now_j) {
+    if (now_j <= base->clk) {
+        return;
+    }
+    int top_moved = (now_j >> ((TIMER_LEVELS - 1) * TIMER_LVL_BITS)) !=
+                    (base->clk >> ((TIMER_LEVELS - 1) * TIMER_LVL_BITS));
+    base->clk = now_j;
+    for (int level = 1; level < TIMER_LEVELS; level++) {
+        unsigned int cur = (now_j >> (level * TIMER_LVL_BITS)) & (TIMER_LVL_SIZE - 1);
+        struct timer *t = base->slots[level][cur];
+        if (!t) {
+            continue;
+        }
+        base->slots[level][cur] = NULL;
+        base->pending[level] &= ~(1UL << cur);
+        while (t) {
+            struct timer *next = t->next;
+            wheel_insert(base, t);
+            t = next;
+        }
+    }
+
+    // The top level's window moved: overflow timers may fit on the wheel now.
+    if (top_moved && base->overflow) {
+        struct timer *t = base->overflow;
+        base->overflow = NULL;
+        while (t) {
+            struct timer *next = t->next;
+            wheel_insert(base, t);
+            t = next;
+        }
+    }
+}
+
+// Point the comparator at the earliest deadline. Caller holds base->lock.
+static void timer_reprogram(struct timer_base *base) {
+    struct timer *first = wheel_first(base);
+    base->next_expiry = first ? first->expires : TIMER_NEVER;
+    timer_hw_program(base->next_expiry);
+}
+
+void timer_init(void) {
+    uint64_t now_j = jiffies_of(r_time());
+    for (int h = 0; h < NHART; h++) {
+        struct timer_base *base = &timer_bases[h];
+        base->lock.locked = 0;
+        base->clk = now_j;
+        base->next_expiry = TIMER_NEVER;
+        base->overflow = NULL;
+        base->running = NULL;
+        for (int level = 0; level < TIMER_LEVELS; level++) {
+            base->pending[level] = 0;
+            for (int s = 0; s < TIMER_LVL_SIZE; s++) {
+                base->slots[level][s] = NULL;
+            }
+        }
+    }
+}
+
+void timer_init_hart(void) {
+    timer_hw_program(TIMER_NEVER);
+
+    uint64_t sie;
+    asm volatile("csrr %0, sie" : "=r"(sie));
+    sie |= SIE_STIE;
+    asm volatile("csrw sie, %0" :: "r"(sie));
+}
+
+void timer_setup(struct timer *t, void (*fn)(void *arg), void *arg) {
+    t->fn = fn;
+    t->arg = arg;
+    t->expires = 0;
+    t->next = t->prev = NULL;
+    t->hart = -1;
+}
+
+int timer_pending(struct timer *t) {
+    return __atomic_load_n(&t->hart, __ATOMIC_RELAXED) >= 0;
+}
+
+/*
+ * Lock the wheel 't' is pending on and return it, or NULL (with nothing
+ * locked) if 't' is idle. Interrupts must be off.
+ */
+static struct timer_base *lock_timer_base(struct timer *t) {
+    while (1) {
+        int32_t hart = __atomic_load_n(&t->hart, __ATOMIC_ACQUIRE);
+        if (hart < 0) {
+            return NULL;
+        }
+        struct timer_base *base = &timer_bases[hart];
+        spin_lock(&base->lock);
+        if (t->hart == hart) {
+            return base;
+        }
+        // Fired or moved while we were taking the lock.
+        spin_unlock(&base->lock);
+    }
+}
+
+int timer_cancel(struct timer *t) {
+    uint64_t flags = intr_save();
+    struct timer_base *base = lock_timer_base(t);
+    if (!base) {
+        intr_restore(flags);
+        return 0;
+    }
+    wheel_remove(base, t);
+    __atomic_store_n(&t->hart, -1, __ATOMIC_RELEASE);
+    // The comparator is left alone: an early interrupt finds nothing due and re-arms.
+    spin_unlock(&base->lock);
+    intr_restore(flags);
+    return 1;
+}
+
+int timer_cancel_sync(struct timer *t) {
+    int was_pending = timer_cancel(t);
+    // The interrupt handler publishes 'running' before it marks the timer
+    // idle, so a callback that already started is seen here.
+    for (int h = 0; h < NHART; h++) {
+        while (__atomic_load_n(&timer_bases[h].running, __ATOMIC_ACQUIRE) == t) {
+            asm volatile("nop");
+        }
+    }
+    return was_pending;
+}
+
+void timer_add(struct timer *t, uint64_t expires) {
+    timer_cancel(t);
+
+    uint64_t flags = intr_save();
+    struct timer_base *base = &timer_bases[cpuid()];
+    spin_lock(&base->lock);
+    t->expires = expires;
+    wheel_insert(base, t);
+    __atomic_store_n(&t->hart, (int32_t)cpuid(), __ATOMIC_RELEASE);
+    if (expires < base->next_expiry) {
+        base->next_expiry = expires;
+        timer_hw_program(expires);
+    }
+    spin_unlock(&base->lock);
+    intr_restore(flags);
+}
+
+void timer_interrupt(void) {
+    uint64_t flags = intr_save();
+    struct timer_base *base = &timer_bases[cpuid()];
+
+    spin_lock(&base->lock);
+    while (1) {
+        uint64_t now = r_time();
+        struct timer *t = wheel_first(base);
+        if (t && t->expires <= now) {
+            wheel_remove(base, t);
+            base->running = t;
+            __atomic_store_n(&t->hart, -1, __ATOMIC_RELEASE);
+            // Callbacks may re-add their own timer, so run them unlocked.
+            void (*fn)(void *) = t->fn;
+            void *arg = t->arg;
+            spin_unlock(&base->lock);
+            fn(arg);
+            spin_lock(&base->lock);
+            __atomic_store_n(&base->running, NULL, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        wheel_advance(base, jiffies_of(now));
+        timer_reprogram(base);
+        // A deadline that passed while programming would not raise an interrupt.
+        if (base->next_expiry > r_time()) {
+            break;
+        }
+    }
+    spin_unlock(&base->lock);
+    intr_restore(flags);
+}
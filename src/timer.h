@@ -0,0 +1,86 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+/*
+ * One-shot kernel timers. Deadlines are absolute values of the time CSR.
+ * Each hart keeps its own timer wheel, and the hardware comparator is only
+ * programmed for the earliest pending deadline, so a hart with nothing due
+ * takes no timer interrupts at all.
+ */
+
+// Wheel geometry: TIMER_LEVELS levels of 2^TIMER_LVL_BITS slots each.
+#define TIMER_LVL_BITS   6
+#define TIMER_LVL_SIZE   (1 << TIMER_LVL_BITS)
+#define TIMER_LEVELS     4
+// Level 0 slot width in time-CSR ticks (2^10, about 100us at QEMU's 10MHz).
+#define TIMER_JIFFY_SHIFT 10
+
+// Defaults for a QEMU virt machine, used when the device tree says nothing.
+#define TIMER_HZ_DEFAULT   10000000UL
+#define CLINT_BASE_DEFAULT 0x2000000UL
+
+/*
+ * Frequency of the time CSR (the device tree's timebase-frequency) and the
+ * CLINT the M-mode timer fallback programs. Set once by the boot hart
+ * before timer_init().
+ */
+extern uint64_t timer_hz;
+extern uint64_t timer_clint_base;
+
+// Convert between microseconds and time-CSR ticks without overflowing for long spans.
+static inline uint64_t timer_us_to_ticks(uint64_t us) {
+    return (us / 1000000) * timer_hz + (us % 1000000) * timer_hz / 1000000;
+}
+
+static inline uint64_t timer_ticks_to_us(uint64_t ticks) {
+    return (ticks / timer_hz) * 1000000 + (ticks % timer_hz) * 1000000 / timer_hz;
+}
+
+// Deadline meaning "never", used to park the comparator.
+#define TIMER_NEVER UINT64_MAX
+
+struct timer {
+    uint64_t expires;           // Absolute deadline (time CSR value).
+    void (*fn)(void *arg);      // Runs in interrupt context on the hart the timer was added on.
+    void *arg;
+    struct timer *next;
+    struct timer *prev;
+    int32_t hart;               // Hart whose wheel holds the timer, or -1 when not pending.
+    uint8_t level;
+    uint8_t slot;
+};
+
+// Initialize the timer wheels of all harts. Call once before timer_init_hart().
+void timer_init(void);
+
+// Park this hart's comparator and enable the supervisor timer interrupt.
+void timer_init_hart(void);
+
+// Prepare 't' to run 'fn(arg)'. It starts out not pending.
+void timer_setup(struct timer *t, void (*fn)(void *arg), void *arg);
+
+/*
+ * Arm 't' to fire at 'expires' on the calling hart. A pending timer is moved
+ * to the new deadline. Deadlines in the past fire on the next interrupt.
+ */
+void timer_add(struct timer *t, uint64_t expires);
+
+// Disarm 't'. Returns 1 if it was pending, 0 otherwise.
+int timer_cancel(struct timer *t);
+
+/*
+ * Disarm 't' and wait for its callback to finish if it is running on
+ * another hart, so that nothing touches 't' or its argument afterwards.
+ * Not for use from the callback itself. Returns 1 if it was pending.
+ */
+int timer_cancel_sync(struct timer *t);
+
+// Non-zero while 't' is armed and has not fired yet.
+int timer_pending(struct timer *t);
+
+// Run every expired timer on this hart and reprogram the comparator. Called on the timer interrupt.
+void timer_interrupt(void);
+
+#endif // TIMER_H
@@ -3,13 +3,45 @@
 
 #include <stdint.h>
 
-// Structure to save general-purpose registers and Supervisor-level CSRs on the stack during a trap.
-// This must exactly match the order in which registers are saved in trap.S for Supervisor mode.
+// Exception cause codes (scause with the interrupt bit clear).
+#define EXC_INST_PAGE_FAULT  12
+#define EXC_LOAD_PAGE_FAULT  13
+#define EXC_STORE_PAGE_FAULT 15
+#define EXC_ECALL_U          8
+#define EXC_ECALL_S          9
+
+// Interrupt cause codes (scause with the interrupt bit set).
+#define IRQ_S_SOFT           1
+#define IRQ_S_TIMER          5
+#define IRQ_S_EXTERNAL       9
+
+// Exception and interrupt codes below this have a slot in the dispatch tables.
+#define TRAP_NCAUSE          16
+
+// Set in scause for interrupts.
+#define SCAUSE_INTR (1UL << 63)
+
+/*
+ * Calls from S-mode into the M-mode handler (ecall with the call number in
+ * a7 and the argument in a0).
+ */
+#define MCALL_SET_TIMER 0 // Program this hart's mtimecmp to a0 (harts without Sstc).
+#define MCALL_SEND_IPI  1 // Raise a supervisor software interrupt on hart a0.
+
+/*
+ * Saved state of an S-mode trap; the layout must match the TF_* offsets in trap.S.
+ * For a process the frame is proc->tf and holds every user register. For a
+ * trap taken in the kernel it lives on the kernel stack and only the
+ * caller-saved registers (ra, t0-t6, a0-a7) are filled in.
+ */
 struct TrapFrame {
-    uint64_t regs[31]; // x1 through x31
-    uint64_t sepc;     // Supervisor Exception Program Counter
-    uint64_t scause;   // Supervisor Cause Register
-    uint64_t stval;    // Supervisor Trap Value Register
+    uint64_t regs[31];  // x1 through x31
+    uint64_t sepc;      // Supervisor Exception Program Counter
+    uint64_t scause;    // Supervisor Cause Register
+    uint64_t stval;     // Supervisor Trap Value Register
+    uint64_t sstatus;   // Saved on kernel traps only.
+    uint64_t kernel_sp; // Kernel stack to switch to on a trap from U-mode.
+    uint64_t kernel_tp; // Hart ID (tp) the process was last entered on.
 };
 
 // Structure to save general-purpose registers and Machine-level CSRs on the stack during a trap.
@@ -21,10 +53,15 @@ struct MTrapFrame {
     uint64_t mtval;    // Machine Trap Value Register
 };
 
-// The C trap handler function for Supervisor mode.
-// It receives a pointer to the saved TrapFrame on the stack.
+// The C trap handler function for Supervisor mode, called from __trap_vector.
 void trap_handler(struct TrapFrame *frame);
 
+/*
+ * Enter U-mode with the registers in 'tf' (trap.S). Must be called on the
+ * process's kernel stack, with that process's page table installed.
+ */
+void __trap_return(struct TrapFrame *tf) __attribute__((noreturn));
+
 // The C trap handler function for Machine mode.
 // It receives a pointer to the saved MTrapFrame on the stack.
 void mtrap_handler(struct MTrapFrame *frame);
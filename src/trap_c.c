@@ -1,68 +1,183 @@
 #include "trap.h"
 #include "uart.h"
+#include "klog.h"
 #include "panic.h"
+#include "riscv.h"
+#include "fault.h"
+#include "sched.h"
+#include "timer.h"
+#include "syscall.h"
+#include "plic.h"
+#include "prof.h"
+#include "smp.h"
+#include "proc.h"
+#include <stddef.h>
 #include <stdint.h>
 
 // CLINT memory-mapped registers
-#define CLINT_BASE 0x2000000UL
-#define CLINT_MTIMECMP(hartid) (CLINT_BASE + 0x4000 + (hartid * 8))
-#define CLINT_MTIME (CLINT_BASE + 0xBFF8)
-
-// Function to set the next timer interrupt
-void set_next_timer_interrupt(uint64_t hartid) {
-    volatile uint64_t *mtime = (volatile uint64_t *)CLINT_MTIME;
-    volatile uint64_t *mtimecmp = (volatile uint64_t *)CLINT_MTIMECMP(hartid);
-    *mtimecmp = *mtime + 1000000UL;
+#define CLINT_MSIP(hartid)     (timer_clint_base + (hartid * 4))
+#define CLINT_MTIMECMP(hartid) (timer_clint_base + 0x4000 + (hartid * 8))
+
+// trap.S hard-codes these offsets.
+_Static_assert(offsetof(struct TrapFrame, sepc) == 248, "TrapFrame layout");
+_Static_assert(offsetof(struct TrapFrame, kernel_tp) == 288, "TrapFrame layout");
+_Static_assert(sizeof(struct TrapFrame) <= 304, "TrapFrame layout");
+
+typedef void (*trap_fn)(struct TrapFrame *frame);
+
+/*
+ * A trap from U-mode saves into the process's own trap frame; one taken in
+ * the kernel pushes its frame on the kernel stack instead.
+ */
+static int trap_from_user(struct TrapFrame *frame) {
+    struct proc *p = myproc();
+    return p && frame == &p->tf;
 }
 
-// The C trap handler function for Supervisor mode.
-void trap_handler(struct TrapFrame *frame) {
-    uart_puts("=== Supervisor Mode Trap Occurred ===\n");
-    uart_puts("scause: ");
-    uart_puts_hex(frame->scause);
-    uart_puts("\nsepc: ");
-    uart_puts_hex(frame->sepc);
-    uart_puts("\n");
+/*
+ * Slow path for anything without a handler (or that a handler refused):
+ * an exception raised by a user process kills that process; anything else
+ * is reported and stops the kernel.
+ */
+static void trap_unhandled(struct TrapFrame *frame) {
+    if (!(frame->scause & SCAUSE_INTR) && trap_from_user(frame)) {
+        klog(KLOG_WARN, "Killing process %d: scause=%p sepc=%p stval=%p",
+             myproc()->pid, frame->scause, frame->sepc, frame->stval);
+        proc_exit(-1);
+    }
+    klog(KLOG_ERR, "Unhandled supervisor trap: scause=%p sepc=%p stval=%p",
+         frame->scause, frame->sepc, frame->stval);
+    if (frame->scause & SCAUSE_INTR) {
+        panic("Unhandled Supervisor Interrupt");
+    }
+    panic("Unhandled Supervisor Exception");
+}
 
-    uint64_t is_interrupt = (frame->scause >> 63) & 1;
-    uint64_t cause_code = frame->scause & ~(1UL << 63);
+// Take a profiler sample, then run expired timers (including the scheduler tick).
+static void timer_trap(struct TrapFrame *frame) {
+    prof_tick(frame);
+    timer_interrupt();
+}
 
-    if (is_interrupt) {
-        if (cause_code == 5) { // Supervisor Timer Interrupt
-            uart_puts("Handling Timer Interrupt...\n");
-            set_next_timer_interrupt(0);
-        } else {
-            uart_puts("Unhandled interrupt in S-mode. scause=");
-            uart_puts_hex(frame->scause);
-            uart_puts("\n");
-            panic("Unhandled Supervisor Interrupt");
-        }
+// An IPI: its only job is to get an idle hart out of wfi to look at its run queue.
+static void soft_trap(struct TrapFrame *frame) {
+    smp_ipi_clear();
+}
+
+// Device interrupts routed through the PLIC (the UART, for now).
+static void external_trap(struct TrapFrame *frame) {
+    plic_interrupt();
+}
+
+// Demand-paging and copy-on-write faults are resolved and retried without logging.
+static void page_fault_trap(struct TrapFrame *frame) {
+    if (handle_page_fault(frame->scause, frame->stval) != 0) {
+        trap_unhandled(frame);
+    }
+}
+
+static void breakpoint_trap(struct TrapFrame *frame) {
+    klog(KLOG_WARN, "Breakpoint exception at %p.", frame->sepc);
+    frame->sepc += 2;
+}
+
+static void misaligned_fetch_trap(struct TrapFrame *frame) {
+    if (trap_from_user(frame)) {
+        trap_unhandled(frame);
+        return;
+    }
+    klog(KLOG_ERR, "Instruction address misaligned at %p.", frame->sepc);
+    if (frame->sepc == 0) {
+        panic("SEPC is 0 in misaligned exception");
+    }
+    frame->sepc += 4;
+}
+
+// Handlers indexed by scause code; NULL entries go to trap_unhandled().
+
+static const trap_fn exc_handlers[TRAP_NCAUSE] = {
+    [0]                    = misaligned_fetch_trap,
+    [3]                    = breakpoint_trap,
+    [EXC_ECALL_U]          = syscall,
+    [EXC_INST_PAGE_FAULT]  = page_fault_trap,
+    [EXC_LOAD_PAGE_FAULT]  = page_fault_trap,
+    [EXC_STORE_PAGE_FAULT] = page_fault_trap,
+};
+
+static const trap_fn irq_handlers[TRAP_NCAUSE] = {
+    [IRQ_S_SOFT]     = soft_trap,
+    [IRQ_S_TIMER]    = timer_trap,
+    [IRQ_S_EXTERNAL] = external_trap,
+};
+
+/*
+ * The C trap handler function for Supervisor mode.
+ * A single table lookup; nothing is logged unless the trap is unhandled.
+ * The profiler is charged the cycles spent in the handler, which for a
+ * blocking system call includes the time the process slept. After an
+ * interrupt, preempt if the scheduler tick ended the slice; that switch is
+ * not charged.
+ */
+void trap_handler(struct TrapFrame *frame) {
+    uint64_t start = r_cycle();
+    uint64_t scause = frame->scause;
+    uint64_t code = scause & ~SCAUSE_INTR;
+    const trap_fn *table = (scause & SCAUSE_INTR) ? irq_handlers : exc_handlers;
+    trap_fn fn = (code < TRAP_NCAUSE) ? table[code] : NULL;
+    if (fn) {
+        fn(frame);
     } else {
-        if (cause_code == 3) { // Breakpoint exception
-            uart_puts("Breakpoint Exception caught.\n");
-            frame->sepc += 2;
-        } else if (cause_code == 0) { // Instruction Address Misaligned
-            uart_puts("Instruction Address Misaligned Exception!\n");
-            if (frame->sepc == 0) {
-                panic("SEPC is 0 in misaligned exception");
-            }
-            frame->sepc += 4;
-        } else {
-            uart_puts("Unhandled Supervisor Exception!\n");
-            uart_puts("scause=");
-            uart_puts_hex(frame->scause);
-            uart_puts("\nsepc=");
-            uart_puts_hex(frame->sepc);
-            uart_puts("\nstval=");
-            uart_puts_hex(frame->stval);
-            uart_puts("\n");
-            panic("Unhandled Supervisor Exception");
-        }
+        trap_unhandled(frame);
+    }
+    prof_trap(scause, r_cycle() - start);
+    if (scause & SCAUSE_INTR) {
+        sched_preempt();
     }
 }
 
-// The C trap handler function for Machine mode.
+#define MIP_SSIP (1UL << 1)
+#define MIP_STIP (1UL << 5)
+#define MIE_MTIE (1UL << 7)
+
+/*
+ * The C trap handler function for Machine mode.
+ * Without Sstc, S-mode timers run on mtimecmp: MCALL_SET_TIMER programs it,
+ * and the machine timer interrupt is forwarded as a supervisor timer
+ * interrupt. IPIs work the same way: MCALL_SEND_IPI sets the target's CLINT
+ * msip, and the machine software interrupt becomes a supervisor one there.
+ * These paths are hot, so they return without logging.
+ */
 void mtrap_handler(struct MTrapFrame *frame) {
+    if (frame->mcause == ((1UL << 63) | 3)) { // Machine Software Interrupt
+        uint64_t hartid;
+        asm volatile("csrr %0, mhartid" : "=r"(hartid));
+        *(volatile uint32_t *)CLINT_MSIP(hartid) = 0;
+        asm volatile("csrs mip, %0" :: "r"(MIP_SSIP));
+        return;
+    }
+    if (frame->mcause == ((1UL << 63) | 7)) { // Machine Timer Interrupt
+        // Raise STIP and mask MTIE until S-mode sets the next deadline.
+        asm volatile("csrs mip, %0" :: "r"(MIP_STIP));
+        asm volatile("csrc mie, %0" :: "r"(MIE_MTIE));
+        return;
+    }
+    if (frame->mcause == EXC_ECALL_S && frame->regs[16] == MCALL_SET_TIMER) {
+        uint64_t hartid;
+        asm volatile("csrr %0, mhartid" : "=r"(hartid));
+        *(volatile uint64_t *)CLINT_MTIMECMP(hartid) = frame->regs[9];
+        asm volatile("csrc mip, %0" :: "r"(MIP_STIP));
+        asm volatile("csrs mie, %0" :: "r"(MIE_MTIE));
+        frame->mepc += 4;
+        return;
+    }
+    if (frame->mcause == EXC_ECALL_S && frame->regs[16] == MCALL_SEND_IPI) {
+        if (frame->regs[9] < NHART) {
+            *(volatile uint32_t *)CLINT_MSIP(frame->regs[9]) = 1;
+        }
+        frame->mepc += 4;
+        return;
+    }
+
     uart_puts("=== Machine Mode Trap Occurred ===\n");
     uart_puts("mcause: ");
     uart_puts_hex(frame->mcause);
@@ -74,15 +189,10 @@ void mtrap_handler(struct MTrapFrame *frame) {
     uint64_t cause_code = frame->mcause & ~(1UL << 63);
 
     if (is_interrupt) {
-        if (cause_code == 7) { // Machine Timer Interrupt
-            uart_puts("Handling Machine Timer Interrupt...\n");
-            set_next_timer_interrupt(0);
-        } else {
-            uart_puts("Unhandled interrupt in M-mode. mcause=");
-            uart_puts_hex(frame->mcause);
-            uart_puts("\n");
-            panic("Unhandled Machine Interrupt");
-        }
+        uart_puts("Unhandled interrupt in M-mode. mcause=");
+        uart_puts_hex(frame->mcause);
+        uart_puts("\n");
+        panic("Unhandled Machine Interrupt");
     } else {
         if (cause_code == 3) { // Breakpoint exception
             uart_puts("Breakpoint Exception in Machine Mode.\n");
@@ -1,45 +1,196 @@
 #include "uart.h"
+#include "plic.h"
+#include "spinlock.h"
+#include <stddef.h>
+#include <stdint.h>
 
-// UART base address and register offsets
-#define UART_BASE 0x10000000
-#define UART_THR 0  // Transmitter Holding Register
+// UART register offsets
+#define UART_RBR 0  // Receiver Buffer Register (read)
+#define UART_THR 0  // Transmitter Holding Register (write)
+#define UART_IER 1  // Interrupt Enable Register
+#define UART_FCR 2  // FIFO Control Register (write)
+#define UART_IIR 2  // Interrupt Identification Register (read)
+#define UART_LCR 3  // Line Control Register
 #define UART_LSR 5  // Line Status Register
 
+// Interrupt Enable Register bits
+#define IER_RDI  (1 << 0) // Received data available
+#define IER_THRI (1 << 1) // Transmitter holding register empty
+
+// FIFO Control Register bits
+#define FCR_ENABLE   (1 << 0)
+#define FCR_CLEAR_RX (1 << 1)
+#define FCR_CLEAR_TX (1 << 2)
+
+#define LCR_8N1 0x03
+
 // Line Status Register bits
+#define LSR_DR   (1 << 0) // Data Ready
 #define LSR_THRE (1 << 5) // Transmitter Holding Register Empty
 
-void uart_putc(char c) {
-    volatile unsigned char *uart = (volatile unsigned char *)UART_BASE;
+// Bytes the transmit FIFO takes once THRE is set.
+#define UART_FIFO_SIZE 16
+
+// Software rings (powers of two). Indices are free-running.
+#define UART_TX_RING 4096
+#define UART_RX_RING 256
+
+static struct spinlock uart_lock = SPINLOCK_INIT;
+static char tx_ring[UART_TX_RING];
+static uint32_t tx_head, tx_tail;
+static char rx_ring[UART_RX_RING];
+static uint32_t rx_head, rx_tail;
+static uint8_t uart_ier;
 
-    // Wait until the Transmitter Holding Register is empty
-    while (! (uart[UART_LSR] & LSR_THRE));
+// Set by uart_init(); before that every byte is written synchronously.
+static int uart_irq_ready = 0;
 
-    // Write the character to the Transmitter Holding Register
+static uint64_t uart_base = UART_BASE_DEFAULT;
+static uint32_t uart_irq = UART0_IRQ;
+
+static inline volatile uint8_t *uart_regs(void) {
+    return (volatile uint8_t *)uart_base;
+}
+
+// Write one byte, waiting for the transmitter.
+static void uart_putc_sync(char c) {
+    volatile uint8_t *uart = uart_regs();
+    while (!(uart[UART_LSR] & LSR_THRE)) {}
     uart[UART_THR] = c;
 }
 
+/*
+ * Move queued bytes into the hardware FIFO if the transmitter is idle, and
+ * keep the THRE interrupt enabled exactly while bytes remain queued.
+ * Caller holds uart_lock.
+ */
+static void uart_tx_start(void) {
+    volatile uint8_t *uart = uart_regs();
+    if (uart[UART_LSR] & LSR_THRE) {
+        for (int i = 0; i < UART_FIFO_SIZE && tx_head != tx_tail; i++) {
+            uart[UART_THR] = tx_ring[tx_head++ % UART_TX_RING];
+        }
+    }
+    uint8_t ier = (tx_head != tx_tail) ? (uart_ier | IER_THRI) : (uart_ier & ~IER_THRI);
+    if (ier != uart_ier) {
+        uart_ier = ier;
+        uart[UART_IER] = ier;
+    }
+}
+
+// Queue one byte. Caller holds uart_lock.
+static void uart_tx_put(char c) {
+    // Ring full: push the oldest bytes out by hand rather than drop output.
+    while (tx_tail - tx_head >= UART_TX_RING) {
+        uart_putc_sync(tx_ring[tx_head++ % UART_TX_RING]);
+    }
+    tx_ring[tx_tail++ % UART_TX_RING] = c;
+}
+
+// PLIC handler: drain the receiver, then refill the transmit FIFO.
+static void uart_intr(void *arg) {
+    volatile uint8_t *uart = uart_regs();
+    spin_lock(&uart_lock);
+    (void)uart[UART_IIR]; // Acknowledges a THRE interrupt.
+    while (uart[UART_LSR] & LSR_DR) {
+        char c = uart[UART_RBR];
+        if (rx_tail - rx_head < UART_RX_RING) {
+            rx_ring[rx_tail++ % UART_RX_RING] = c;
+        }
+    }
+    uart_tx_start();
+    spin_unlock(&uart_lock);
+}
+
+void uart_set_base(uint64_t base, uint32_t irq) {
+    uart_base = base;
+    uart_irq = irq;
+}
+
+void uart_init(void) {
+    volatile uint8_t *uart = uart_regs();
+    uart[UART_IER] = 0;
+    uart[UART_LCR] = LCR_8N1;
+    uart[UART_FCR] = FCR_ENABLE | FCR_CLEAR_RX | FCR_CLEAR_TX;
+
+    plic_register(uart_irq, uart_intr, NULL);
+
+    uint64_t flags = spin_lock_irqsave(&uart_lock);
+    uart_ier = IER_RDI;
+    uart[UART_IER] = uart_ier;
+    uart_irq_ready = 1;
+    spin_unlock_irqrestore(&uart_lock, flags);
+}
+
+void uart_putc(char c) {
+    if (!uart_irq_ready) {
+        uart_putc_sync(c);
+        return;
+    }
+    uint64_t flags = spin_lock_irqsave(&uart_lock);
+    uart_tx_put(c);
+    uart_tx_start();
+    spin_unlock_irqrestore(&uart_lock, flags);
+}
+
 void uart_puts(const char *s) {
+    if (!uart_irq_ready) {
+        while (*s) {
+            uart_putc_sync(*s++);
+        }
+        return;
+    }
+    uint64_t flags = spin_lock_irqsave(&uart_lock);
     while (*s) {
-        uart_putc(*s++);
+        uart_tx_put(*s++);
+    }
+    uart_tx_start();
+    spin_unlock_irqrestore(&uart_lock, flags);
+}
+
+void uart_write(const char *buf, uint64_t len) {
+    if (!uart_irq_ready) {
+        for (uint64_t i = 0; i < len; i++) {
+            uart_putc_sync(buf[i]);
+        }
+        return;
     }
+    uint64_t flags = spin_lock_irqsave(&uart_lock);
+    for (uint64_t i = 0; i < len; i++) {
+        uart_tx_put(buf[i]);
+    }
+    uart_tx_start();
+    spin_unlock_irqrestore(&uart_lock, flags);
 }
 
 void uart_puts_hex(uint64_t n) {
-    uart_putc('0');
-    uart_putc('x');
+    char buf[19];
+    buf[0] = '0';
+    buf[1] = 'x';
 
-    // Iterate through 16 nibbles (64 bits / 4 bits per nibble)
+    // Iterate through 16 nibbles (64 bits / 4 bits per nibble), MSB first
     for (int i = 0; i < 16; i++) {
-        // Extract the current nibble (from MSB to LSB)
-        // Shift right by (15 - i) * 4 to get the current nibble to the LSB position
-        // Then mask with 0xF to get only the 4 bits of the nibble
         uint8_t nibble = (n >> ((15 - i) * 4)) & 0xF;
+        buf[2 + i] = (nibble < 10) ? '0' + nibble : 'a' + (nibble - 10);
+    }
+    buf[18] = '\0';
+    uart_puts(buf);
+}
 
-        // Convert nibble to ASCII character
-        if (nibble < 10) {
-            uart_putc('0' + nibble);
-        } else {
-            uart_putc('a' + (nibble - 10));
-        }
+int uart_getc(void) {
+    int c = -1;
+    uint64_t flags = spin_lock_irqsave(&uart_lock);
+    if (rx_head != rx_tail) {
+        c = (unsigned char)rx_ring[rx_head++ % UART_RX_RING];
     }
-}
\ No newline at end of file
+    spin_unlock_irqrestore(&uart_lock, flags);
+    return c;
+}
+
+void uart_flush(void) {
+    uint64_t flags = spin_lock_irqsave(&uart_lock);
+    while (tx_head != tx_tail) {
+        uart_putc_sync(tx_ring[tx_head++ % UART_TX_RING]);
+    }
+    spin_unlock_irqrestore(&uart_lock, flags);
+}
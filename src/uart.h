@@ -3,7 +3,31 @@
 
 #include <stdint.h>
 
+/*
+ * NS16550 console. Until uart_init() output is polled; afterwards writers
+ * only copy into a transmit ring that the UART interrupt drains.
+ */
+
+// QEMU virt UART0, used until uart_set_base() says otherwise.
+#define UART_BASE_DEFAULT 0x10000000UL
+
+// Use the UART at physical address 'base', wired to PLIC source 'irq'. Call before uart_init().
+void uart_set_base(uint64_t base, uint32_t irq);
+
+// Enable the FIFOs and the receive/transmit interrupts. Requires plic_init().
+void uart_init(void);
+
+void uart_putc(char c);
 void uart_puts(const char *s);
 void uart_puts_hex(uint64_t n);
 
-#endif // UART_H
\ No newline at end of file
+// Queue 'len' bytes from 'buf' under a single lock hold.
+void uart_write(const char *buf, uint64_t len);
+
+// Next received byte, or -1 if none is buffered.
+int uart_getc(void);
+
+// Write out everything still queued, by polling. For panic().
+void uart_flush(void);
+
+#endif // UART_H
@@ -0,0 +1,228 @@
+#ifndef ULIB_H
+#define ULIB_H
+
+#include <stdint.h>
+#include "syscall.h"
+
+/*
+ * User-side system call stubs (see syscall.h for the ABI).
+ * Header-only so user programs need nothing else linked in.
+ */
+static inline int64_t ecall3(uint64_t nr, uint64_t a, uint64_t b, uint64_t c) {
+    register uint64_t a0 asm("a0") = a;
+    register uint64_t a1 asm("a1") = b;
+    register uint64_t a2 asm("a2") = c;
+    register uint64_t a7 asm("a7") = nr;
+    asm volatile("ecall" : "+r"(a0) : "r"(a1), "r"(a2), "r"(a7) : "memory");
+    return (int64_t)a0;
+}
+
+static inline int64_t ecall6(uint64_t nr, uint64_t a, uint64_t b, uint64_t c, uint64_t d,
+                             uint64_t e, uint64_t f) {
+    register uint64_t a0 asm("a0") = a;
+    register uint64_t a1 asm("a1") = b;
+    register uint64_t a2 asm("a2") = c;
+    register uint64_t a3 asm("a3") = d;
+    register uint64_t a4 asm("a4") = e;
+    register uint64_t a5 asm("a5") = f;
+    register uint64_t a7 asm("a7") = nr;
+    asm volatile("ecall"
+                 : "+r"(a0)
+                 : "r"(a1), "r"(a2), "r"(a3), "r"(a4), "r"(a5), "r"(a7)
+                 : "memory");
+    return (int64_t)a0;
+}
+
+static inline int64_t sys_write(int fd, const void *buf, uint64_t len) {
+    return ecall3(SYS_WRITE, fd, (uint64_t)buf, len);
+}
+
+static inline int64_t sys_sleep(uint64_t usec) {
+    return ecall3(SYS_SLEEP, usec, 0, 0);
+}
+
+static inline int64_t sys_yield(void) {
+    return ecall3(SYS_YIELD, 0, 0, 0);
+}
+
+static inline int64_t sys_getpid(void) {
+    return ecall3(SYS_GETPID, 0, 0, 0);
+}
+
+static inline int64_t sys_fork(void) {
+    return ecall3(SYS_FORK, 0, 0, 0);
+}
+
+static inline void sys_exit(int64_t status) {
+    ecall3(SYS_EXIT, (uint64_t)status, 0, 0);
+    __builtin_unreachable();
+}
+
+static inline int64_t sys_mmap(uint64_t va, uint64_t len, uint64_t prot) {
+    return ecall3(SYS_MMAP, va, len, prot);
+}
+
+static inline struct sys_ring *sys_ring_setup(void) {
+    return (struct sys_ring *)ecall3(SYS_RING_SETUP, 0, 0, 0);
+}
+
+static inline int64_t sys_ring_enter(uint64_t to_submit) {
+    return ecall3(SYS_RING_ENTER, to_submit, 0, 0);
+}
+
+static inline int64_t sys_prof(uint64_t op, uint64_t arg) {
+    return ecall3(SYS_PROF, op, arg, 0);
+}
+
+static inline int64_t sys_futex_wait(uint32_t *addr, uint32_t expected, uint64_t timeout_us) {
+    return ecall3(SYS_FUTEX_WAIT, (uint64_t)addr, expected, timeout_us);
+}
+
+static inline int64_t sys_futex_wake(uint32_t *addr, uint32_t n) {
+    return ecall3(SYS_FUTEX_WAKE, (uint64_t)addr, n, 0);
+}
+
+// Send three words, plus 'grant' bytes at 'grant_va' (grant = len | IPC_GRANT_*; 0: none).
+static inline int64_t sys_ipc_send(uint64_t pid, uint64_t w0, uint64_t w1, uint64_t w2,
+                                   void *grant_va, uint64_t grant) {
+    return ecall6(SYS_IPC_SEND, pid, w0, w1, w2, (uint64_t)grant_va, grant);
+}
+
+// A received message; any grant is mapped at the start of the receive window.
+struct ipc_umsg {
+    uint64_t words[IPC_MSG_WORDS];
+    uint64_t grant_len;
+};
+
+/*
+ * Wait for a message from 'pid' (IPC_ANY: anyone), accepting grants of up
+ * to 'window_len' bytes at 'window'. Returns the sender's pid or a
+ * negative error.
+ */
+static inline int64_t sys_ipc_recv(uint64_t pid, void *window, uint64_t window_len,
+                                   struct ipc_umsg *out) {
+    register uint64_t a0 asm("a0") = pid;
+    register uint64_t a1 asm("a1") = (uint64_t)window;
+    register uint64_t a2 asm("a2") = window_len;
+    register uint64_t a3 asm("a3");
+    register uint64_t a4 asm("a4");
+    register uint64_t a7 asm("a7") = SYS_IPC_RECV;
+    asm volatile("ecall"
+                 : "+r"(a0), "+r"(a1), "+r"(a2), "=r"(a3), "=r"(a4)
+                 : "r"(a7)
+                 : "memory");
+    if ((int64_t)a0 >= 0) {
+        out->words[0] = a1;
+        out->words[1] = a2;
+        out->words[2] = a3;
+        out->grant_len = a4;
+    }
+    return (int64_t)a0;
+}
+
+/*
+ * Single-producer/single-consumer message ring for an established channel.
+ * It lives in a page one side grants to the other (IPC_GRANT_WRITE, shared),
+ * after which messages flow with no system calls at all. Indices are
+ * free-running; only the producer writes tail and only the consumer head.
+ * A side that finds the ring empty or full can park on the index word with
+ * sys_futex_wait(): the futex key is the frame, which both sides share.
+ */
+#define IPC_RING_SLOTS 64
+
+struct ipc_ring {
+    uint32_t head;
+    uint32_t pad0[15];      // Producer and consumer indices on separate cache lines.
+    uint32_t tail;
+    uint32_t pad1[15];
+    uint64_t slots[IPC_RING_SLOTS][4];
+};
+
+// Queue one message. Returns 0, or -1 if the ring is full.
+static inline int ipc_ring_push(struct ipc_ring *r, const uint64_t msg[4]) {
+    uint32_t tail = r->tail;
+    if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) >= IPC_RING_SLOTS) {
+        return -1;
+    }
+    uint64_t *slot = r->slots[tail % IPC_RING_SLOTS];
+    for (int i = 0; i < 4; i++) {
+        slot[i] = msg[i];
+    }
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Take the oldest message into 'msg'. Returns 0, or -1 if the ring is empty.
+static inline int ipc_ring_pop(struct ipc_ring *r, uint64_t msg[4]) {
+    uint32_t head = r->head;
+    if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+    const uint64_t *slot = r->slots[head % IPC_RING_SLOTS];
+    for (int i = 0; i < 4; i++) {
+        msg[i] = slot[i];
+    }
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Mutex on a futex word: 0 unlocked, 1 locked, 2 locked with waiters.
+ * Taking a free lock and releasing one nobody waits for are a single
+ * atomic each and never enter the kernel.
+ */
+static inline void umutex_lock(uint32_t *m) {
+    uint32_t c = 0;
+    if (__atomic_compare_exchange_n(m, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    // Contended: mark the lock as having waiters and sleep until it is free.
+    if (c != 2) {
+        c = __atomic_exchange_n(m, 2, __ATOMIC_ACQUIRE);
+    }
+    while (c != 0) {
+        sys_futex_wait(m, 2, 0);
+        c = __atomic_exchange_n(m, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+static inline void umutex_unlock(uint32_t *m) {
+    if (__atomic_fetch_sub(m, 1, __ATOMIC_RELEASE) != 1) {
+        __atomic_store_n(m, 0, __ATOMIC_RELEASE);
+        sys_futex_wake(m, 1);
+    }
+}
+
+/*
+ * Queue one operation on 'ring'. Returns 0, or -1 if the submission queue
+ * is full. Nothing runs until sys_ring_enter().
+ */
+static inline int ring_submit(struct sys_ring *ring, uint32_t op, uint64_t a0, uint64_t a1,
+                              uint64_t a2, uint64_t user_data) {
+    uint32_t tail = ring->sq_tail;
+    if (tail - __atomic_load_n(&ring->sq_head, __ATOMIC_ACQUIRE) >= SYS_RING_ENTRIES) {
+        return -1;
+    }
+    struct sys_sqe *sqe = &ring->sq[tail % SYS_RING_ENTRIES];
+    sqe->op = op;
+    sqe->flags = 0;
+    sqe->args[0] = a0;
+    sqe->args[1] = a1;
+    sqe->args[2] = a2;
+    sqe->user_data = user_data;
+    __atomic_store_n(&ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Take the oldest completion into '*out'. Returns 0, or -1 if there is none.
+static inline int ring_reap(struct sys_ring *ring, struct sys_cqe *out) {
+    uint32_t head = ring->cq_head;
+    if (head == __atomic_load_n(&ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+    *out = ring->cq[head % SYS_RING_ENTRIES];
+    __atomic_store_n(&ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+#endif // ULIB_H
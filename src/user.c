@@ -1,14 +1,17 @@
-#include "uart.h"
+#include "ulib.h"
+
+// This file is the user image (see linker.ld): it is mapped into every
+// process and must not reference anything in the kernel.
 
 /*
  * This is our first user-space process.
- * It enters an infinite loop that prints an identifying message.
- * It never returns.
+ * It prints an identifying message through the write system call,
+ * then sleeps for a second. It never returns.
  */
 void user_process_1(void) {
+    static const char msg[] = "... I am user process 1 ...\n";
     while (1) {
-        uart_puts("... I am user process 1 ...\n");
-        // Optionally add some delay (e.g., busy loop) here.
-        for(volatile uint64_t i = 0; i < 1000000; i++);
+        sys_write(1, msg, sizeof(msg) - 1);
+        sys_sleep(1000000);
     }
 }
@@ -1,6 +1,9 @@
 #include "vm.h"
 #include "mem.h"
-#include <string.h>
+#include "klog.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include <stddef.h>
 
 // Sv39 uses three levels:
 //   Level 2: Bits 38-30, Level 1: Bits 29-21, Level 0: Bits 20-12.
@@ -9,42 +12,521 @@
 #define VPN_SHIFT_LVL1 21
 #define VPN_SHIFT_LVL0 12
 
+#define SATP_MODE_SV39 (8UL << 60)
+#define SATP_ASID_SHIFT 44
+#define SATP_ASID_MASK  0xFFFFUL
+
+// ASID contexts keep the allocation generation above the 16-bit ASID.
+#define ASID_GEN_SHIFT 16
+
+// Above this many per-address flushes, one ASID-wide flush is cheaper.
+#define VM_FLUSH_MAX_PAGES 32
+
+// Helpers for the per-level geometry and PTE encoding.
+#define LEVEL_SHIFT(level) (VPN_SHIFT_LVL0 + 9 * (level))
+#define LEVEL_SIZE(level)  (1UL << LEVEL_SHIFT(level))
+#define VPN(va, level)     (((va) >> LEVEL_SHIFT(level)) & VPN_MASK)
+#define PTE_LEAF(pte)      ((pte) & (PTE_R | PTE_W | PTE_X))
+
+pagetable_t kernel_pagetable;
+
+// ASID allocator state.
+static struct spinlock asid_lock = SPINLOCK_INIT;
+static uint64_t asid_max;                           // Largest implemented ASID (0 if none).
+static uint64_t asid_generation = 1UL << ASID_GEN_SHIFT;
+static uint64_t asid_next = 1;
+static uint64_t asid_hart_generation[NHART];        // Generation each hart's TLB is clean for.
+
 /*
  * Create a new page table.
- * Allocates one page using pfa_alloc and zeros it.
+ * Takes one page from the pre-zeroed pool (zeroed on the spot if it is empty).
  */
 pagetable_t vm_create_pagetable(void) {
-    pagetable_t pt = (pagetable_t) pfa_alloc();
-    if (pt) {
-        memset(pt, 0, PAGE_SIZE);
+    return (pagetable_t) pfa_alloc_zeroed();
+}
+
+/*
+ * Every valid entry of a page table holds a reference on the table's own
+ * frame, on top of the one from its allocation, so unmap_table() sees a
+ * table empty without scanning it. Entries are installed and cleared
+ * through these two helpers only.
+ */
+static inline void *pte_table(uint64_t *pte) {
+    return (void *)((uint64_t)pte & ~(PAGE_SIZE - 1UL));
+}
+
+static void pte_install(uint64_t *pte, uint64_t val) {
+    if (!(*pte & PTE_V)) {
+        pfa_ref(pte_table(pte));
+    }
+    *pte = val;
+}
+
+// Clear a valid entry. Returns 1 if its table is now empty.
+static int pte_clear(uint64_t *pte) {
+    *pte = 0;
+    return pfa_unref(pte_table(pte)) == 1;
+}
+
+pagetable_t vm_create_user_pagetable(void) {
+    pagetable_t root = vm_create_pagetable();
+    if (!root) {
+        return NULL;
+    }
+    for (int i = 0; i < 512; i++) {
+        if (kernel_pagetable[i] & PTE_G) {
+            pte_install(&root[i], kernel_pagetable[i]);
+        }
+    }
+    return root;
+}
+
+/*
+ * Return the PTE slot for 'va' at 'level', walking down from Level 2.
+ * Missing intermediate tables are created when 'alloc' is set.
+ * Returns NULL if a table is missing (or cannot be allocated), or if a
+ * superpage leaf above 'level' already covers 'va'.
+ */
+static uint64_t *walk_to_level(pagetable_t root, uint64_t va, int level, int alloc) {
+    pagetable_t table = root;
+    for (int l = 2; l > level; l--) {
+        uint64_t *pte = &table[VPN(va, l)];
+        if (*pte & PTE_V) {
+            if (PTE_LEAF(*pte)) {
+                return NULL;
+            }
+        } else {
+            if (!alloc) {
+                return NULL;
+            }
+            pagetable_t new_level = vm_create_pagetable();
+            if (!new_level) {
+                return NULL;
+            }
+            pte_install(pte, PA2PTE((uint64_t)new_level) | PTE_V);
+        }
+        table = (pagetable_t)PTE2PA(*pte);
     }
-    return pt;
+    return &table[VPN(va, level)];
 }
 
 /*
  * Map virtual address 'va' to physical address 'pa' with given flags.
  * Walks through Level 2, Level 1, and Level 0 page tables.
  */
-void vm_map(pagetable_t root, uint64_t va, uint64_t pa, uint64_t flags) {
-    pagetable_t level = root;
-    uint64_t vpn2 = (va >> VPN_SHIFT_LVL2) & VPN_MASK;
-    uint64_t vpn1 = (va >> VPN_SHIFT_LVL1) & VPN_MASK;
-    uint64_t vpn0 = (va >> VPN_SHIFT_LVL0) & VPN_MASK;
+int vm_map(pagetable_t root, uint64_t va, uint64_t pa, uint64_t flags) {
+    uint64_t *pte = walk_to_level(root, va, 0, 1);
+    if (!pte) {
+        klog(KLOG_ERR, "vm_map could not reach a Level 0 entry.");
+        return -1;
+    }
+    // Level 0: Set the final mapping.
+    pte_install(pte, PA2PTE(pa) | (flags | PTE_V));
+    return 0;
+}
 
-    // Level 2: Create page if not exists.
-    if (!(level[vpn2] & PTE_V)) {
-        pagetable_t new_level = vm_create_pagetable();
-        level[vpn2] = (((uint64_t)new_level) >> 12 << 10) | PTE_V;
+uint64_t *vm_walk(pagetable_t root, uint64_t va, int *level) {
+    pagetable_t table = root;
+    for (int l = 2; l >= 0; l--) {
+        uint64_t *pte = &table[VPN(va, l)];
+        if (!(*pte & PTE_V)) {
+            return NULL;
+        }
+        if (PTE_LEAF(*pte)) {
+            if (level) {
+                *level = l;
+            }
+            return pte;
+        }
+        table = (pagetable_t)PTE2PA(*pte);
     }
-    level = (pagetable_t)(((uint64_t)level[vpn2] >> 10) << 12);
+    return NULL;
+}
 
-    // Level 1: Create page if not exists.
-    if (!(level[vpn1] & PTE_V)) {
-        pagetable_t new_level = vm_create_pagetable();
-        level[vpn1] = (((uint64_t)new_level) >> 12 << 10) | PTE_V;
+int vm_map_range(pagetable_t root, uint64_t va, uint64_t pa, uint64_t len, uint64_t flags) {
+    if ((va | pa | len) & (PAGE_SIZE - 1)) {
+        klog(KLOG_ERR, "vm_map_range with unaligned arguments.");
+        return -1;
     }
-    level = (pagetable_t)(((uint64_t)level[vpn1] >> 10) << 12);
 
-    // Level 0: Set the final mapping.
-    level[vpn0] = ((pa >> 12) << 10) | (flags | PTE_V);
+    uint64_t end = va + len;
+    while (va < end) {
+        // Largest leaf that the current alignment and remaining length allow.
+        int level = 2;
+        while (level > 0 &&
+               (((va | pa) & (LEVEL_SIZE(level) - 1)) != 0 || end - va < LEVEL_SIZE(level))) {
+            level--;
+        }
+
+        uint64_t *pte;
+        for (;;) {
+            pte = walk_to_level(root, va, level, 1);
+            if (!pte) {
+                klog(KLOG_ERR, "vm_map_range could not reach a page table entry.");
+                return -1;
+            }
+            // Smaller mappings already live below this slot; use them instead.
+            if (level > 0 && (*pte & PTE_V) && !PTE_LEAF(*pte)) {
+                level--;
+                continue;
+            }
+            break;
+        }
+
+        pte_install(pte, PA2PTE(pa) | (flags | PTE_V));
+        va += LEVEL_SIZE(level);
+        pa += LEVEL_SIZE(level);
+    }
+    return 0;
+}
+
+/*
+ * Replace the superpage leaf '*pte' at 'level' with a table of
+ * next-level leaves that map the same physical range with the same flags.
+ */
+static int split_superpage(uint64_t *pte, int level) {
+    pagetable_t table = vm_create_pagetable();
+    if (!table) {
+        return -1;
+    }
+    uint64_t pa = PTE2PA(*pte);
+    uint64_t flags = *pte & 0x3FF;
+    for (uint64_t i = 0; i < 512; i++) {
+        pte_install(&table[i], PA2PTE(pa + i * LEVEL_SIZE(level - 1)) | flags);
+    }
+    *pte = PA2PTE((uint64_t)table) | PTE_V;
+    return 0;
+}
+
+/*
+ * Work deferred until the end of an unmap or teardown: the TLB flush and
+ * the return of freed frames (linked through their first word) to the PFA.
+ * Frames are only handed back after the flush, so no stale translation can
+ * reach a reused frame.
+ */
+struct vm_gather {
+    uint64_t asid;
+    uint64_t vas[VM_FLUSH_MAX_PAGES]; // Removed leaves, flushed one by one.
+    uint64_t nr_vas;                  // Past VM_FLUSH_MAX_PAGES, flush the whole ASID.
+    int tables_freed;                 // Non-leaf entries also need an ASID-wide flush.
+    void *frames;                     // Chain of frames to free.
+};
+
+static void gather_frame(struct vm_gather *g, uint64_t pa) {
+    *(void **)pa = g->frames;
+    g->frames = (void *)pa;
+}
+
+static void gather_leaf(struct vm_gather *g, uint64_t va, uint64_t pte, int level) {
+    if (g->nr_vas < VM_FLUSH_MAX_PAGES) {
+        g->vas[g->nr_vas] = va;
+    }
+    g->nr_vas++;
+
+    if (PTE_REFCOUNTED(pte)) {
+        uint64_t pa = PTE2PA(pte);
+        for (uint64_t off = 0; off < LEVEL_SIZE(level); off += PAGE_SIZE) {
+            // Frames still shared copy-on-write stay with the other owners.
+            if (pfa_unref((void *)(pa + off)) == 0) {
+                gather_frame(g, pa + off);
+            }
+        }
+    }
+}
+
+static void gather_finish(struct vm_gather *g) {
+    if (g->asid == ASID_NONE) {
+        // No TLB holds translations for this address space any more.
+    } else if (g->tables_freed || g->nr_vas > VM_FLUSH_MAX_PAGES) {
+        vm_flush_asid(g->asid);
+    } else {
+        for (uint64_t i = 0; i < g->nr_vas; i++) {
+            vm_flush_page(g->vas[i], g->asid);
+        }
+    }
+    if (g->frames) {
+        pfa_free_chain(g->frames);
+    }
+}
+
+/*
+ * Unmap [start, end) within 'table', a Level 'level' table that maps
+ * virtual addresses from 'table_va'. Returns -1 if a split failed.
+ */
+static int unmap_table(pagetable_t root, pagetable_t table, int level, uint64_t table_va,
+                       uint64_t start, uint64_t end, struct vm_gather *g) {
+    uint64_t size = LEVEL_SIZE(level);
+    uint64_t first = (start > table_va) ? (start - table_va) / size : 0;
+    uint64_t last = (end - table_va + size - 1) / size;
+    int ret = 0;
+
+    if (last > 512) {
+        last = 512;
+    }
+    for (uint64_t i = first; i < last; i++) {
+        uint64_t *pte = &table[i];
+        uint64_t sva = table_va + i * size;
+
+        if (!(*pte & PTE_V)) {
+            continue;
+        }
+        // Kernel mappings shared into a user root are never torn down from it.
+        if ((*pte & PTE_G) && root != kernel_pagetable) {
+            continue;
+        }
+        if (PTE_LEAF(*pte)) {
+            // A 4 KiB leaf cannot be split; callers pass page-rounded bounds.
+            if (level == 0 || (start <= sva && sva + size <= end)) {
+                gather_leaf(g, sva, *pte, level);
+                pte_clear(pte);
+                continue;
+            }
+            // Range covers only part of this superpage: split and descend.
+            if (split_superpage(pte, level) != 0) {
+                klog(KLOG_ERR, "vm_unmap_range could not split a superpage.");
+                ret = -1;
+                continue;
+            }
+        }
+
+        pagetable_t child = (pagetable_t)PTE2PA(*pte);
+        if (unmap_table(root, child, level - 1, sva, start, end, g) != 0) {
+            ret = -1;
+        }
+        if (pfa_refcount(child) == 1) {
+            pte_clear(pte);
+            gather_frame(g, (uint64_t)child);
+            g->tables_freed = 1;
+        }
+    }
+    return ret;
+}
+
+int vm_unmap_range(pagetable_t root, uint64_t va, uint64_t len, uint64_t asid) {
+    struct vm_gather g = { .asid = asid };
+    uint64_t start = va & ~(PAGE_SIZE - 1UL);
+    uint64_t end = (va + len + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1UL);
+    int ret = unmap_table(root, root, 2, 0, start, end, &g);
+    gather_finish(&g);
+    return ret;
+}
+
+void vm_destroy(pagetable_t root, uint64_t asid) {
+    struct vm_gather g = { .asid = asid };
+    unmap_table(root, root, 2, 0, 0, VM_USER_END, &g);
+    gather_frame(&g, (uint64_t)root);
+    g.tables_freed = 1;
+    gather_finish(&g);
+}
+
+/*
+ * Copy the leaves of the Level 'level' table 'table' (mapping from
+ * 'table_va') into 'dst', downgrading owned writable leaves to COW.
+ * Shared leaves keep their permissions: both sides see each other's stores.
+ */
+static int fork_table(pagetable_t table, int level, uint64_t table_va, pagetable_t dst) {
+    uint64_t size = LEVEL_SIZE(level);
+    uint64_t last = (level == 2) ? VM_USER_END / size : 512;
+
+    for (uint64_t i = 0; i < last; i++) {
+        uint64_t *pte = &table[i];
+        uint64_t va = table_va + i * size;
+
+        if (!(*pte & PTE_V) || (*pte & PTE_G)) {
+            continue;
+        }
+        // Owned superpages are shared at 4 KiB granularity so COW faults stay small.
+        if (PTE_LEAF(*pte) && level > 0 && (*pte & PTE_OWNED)) {
+            if (split_superpage(pte, level) != 0) {
+                return -1;
+            }
+        }
+        if (!PTE_LEAF(*pte)) {
+            if (fork_table((pagetable_t)PTE2PA(*pte), level - 1, va, dst) != 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        uint64_t *child = walk_to_level(dst, va, level, 1);
+        if (!child) {
+            return -1;
+        }
+        if (PTE_REFCOUNTED(*pte)) {
+            if ((*pte & PTE_OWNED) && (*pte & PTE_W)) {
+                *pte = (*pte & ~PTE_W) | PTE_COW;
+            }
+            // One reference per 4 KiB frame, as gather_leaf() drops them.
+            for (uint64_t off = 0; off < size; off += PAGE_SIZE) {
+                pfa_ref((void *)(PTE2PA(*pte) + off));
+            }
+        }
+        pte_install(child, *pte);
+    }
+    return 0;
+}
+
+int vm_fork(pagetable_t src, pagetable_t dst) {
+    return fork_table(src, 2, 0, dst);
+}
+
+void vm_flush_page(uint64_t va, uint64_t asid) {
+    if (asid == ASID_KERNEL) {
+        // Kernel mappings are global; only rs2 = x0 reaches them.
+        sfence_vma_page(va);
+    } else {
+        sfence_vma_page_asid(va, asid);
+    }
+}
+
+void vm_flush_asid(uint64_t asid) {
+    if (asid == ASID_KERNEL) {
+        sfence_vma_all();
+    } else {
+        sfence_vma_asid(asid);
+    }
+}
+
+uint64_t vm_asid_get(uint64_t *ctx) {
+    if (asid_max == 0) {
+        return ASID_KERNEL;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&asid_lock);
+    if ((*ctx & ~SATP_ASID_MASK) != asid_generation) {
+        if (asid_next > asid_max) {
+            // Out of ASIDs: start a new generation. Every hart flushes its
+            // TLB before it next runs with an ASID from this generation.
+            asid_generation += 1UL << ASID_GEN_SHIFT;
+            asid_next = 1;
+        }
+        *ctx = asid_generation | asid_next++;
+    }
+    spin_unlock_irqrestore(&asid_lock, flags);
+    return *ctx & SATP_ASID_MASK;
+}
+
+uint64_t vm_asid_peek(uint64_t ctx) {
+    if (asid_max == 0) {
+        return ASID_KERNEL;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&asid_lock);
+    uint64_t asid = ((ctx & ~SATP_ASID_MASK) == asid_generation) ? (ctx & SATP_ASID_MASK)
+                                                                  : ASID_NONE;
+    spin_unlock_irqrestore(&asid_lock, flags);
+    return asid;
+}
+
+void vm_switch(pagetable_t root, uint64_t *asid_ctx) {
+    uint64_t hart = cpuid();
+    uint64_t generation = __atomic_load_n(&asid_generation, __ATOMIC_ACQUIRE);
+    uint64_t ctx = *asid_ctx;
+    if (asid_max != 0 && (ctx & ~SATP_ASID_MASK) == generation &&
+        asid_hart_generation[hart] == generation &&
+        r_satp() == (SATP_MODE_SV39 | ((ctx & SATP_ASID_MASK) << SATP_ASID_SHIFT) |
+                     ((uint64_t)root >> 12))) {
+        // Already installed with a live ASID (same address space, or back to
+        // the task that ran last): nothing to write and nothing to flush.
+        return;
+    }
+
+    uint64_t asid = vm_asid_get(asid_ctx);
+    uint64_t satp = SATP_MODE_SV39 | (asid << SATP_ASID_SHIFT) | ((uint64_t)root >> 12);
+    w_satp(satp);
+
+    if (asid_max == 0) {
+        // No ASIDs: every switch has to discard the previous address space.
+        sfence_vma_all();
+        return;
+    }
+    generation = __atomic_load_n(&asid_generation, __ATOMIC_ACQUIRE);
+    if (asid_hart_generation[hart] != generation) {
+        sfence_vma_all();
+        asid_hart_generation[hart] = generation;
+    }
+}
+
+/*
+ * Find how many ASID bits the hart implements by writing all ones to
+ * satp.ASID and reading back what sticks.
+ */
+static void asid_init(void) {
+    uint64_t root_ppn = (uint64_t)kernel_pagetable >> 12;
+    uint64_t satp = SATP_MODE_SV39 | (SATP_ASID_MASK << SATP_ASID_SHIFT) | root_ppn;
+    w_satp(satp);
+    satp = r_satp();
+    asid_max = (satp >> SATP_ASID_SHIFT) & SATP_ASID_MASK;
+}
+
+/*
+ * Build the kernel address space and turn on Sv39 translation.
+ * The low gigabyte (CLINT, PLIC, UART and other MMIO on virt-like boards)
+ * and all of RAM are identity-mapped with global 1 GiB leaves, which
+ * vm_create_user_pagetable() shares into every user root.
+ */
+void enable_virtual_memory(uint64_t ram_base, uint64_t ram_size) {
+    uint64_t ram_start = ram_base & ~(GIGAPAGE_SIZE - 1);
+    uint64_t ram_end = (ram_base + ram_size + GIGAPAGE_SIZE - 1) & ~(GIGAPAGE_SIZE - 1);
+    if (ram_start < GIGAPAGE_SIZE || ram_end > VM_USER_END) {
+        klog(KLOG_ERR, "RAM at %p is outside the identity-mappable range.", ram_base);
+        return;
+    }
+
+    kernel_pagetable = vm_create_pagetable();
+    if (!kernel_pagetable) {
+        klog(KLOG_ERR, "cannot allocate the kernel page table.");
+        return;
+    }
+
+    if (vm_map_range(kernel_pagetable, 0x0UL, 0x0UL, GIGAPAGE_SIZE,
+                     PTE_R | PTE_W | PTE_A | PTE_D | PTE_G) != 0 ||
+        vm_map_range(kernel_pagetable, ram_start, ram_start, ram_end - ram_start,
+                     PTE_R | PTE_W | PTE_X | PTE_A | PTE_D | PTE_G) != 0) {
+        klog(KLOG_ERR, "cannot build the kernel mappings.");
+        return;
+    }
+
+    sfence_vma_all();
+    asid_init();
+    vm_init_hart();
+    klog(KLOG_INFO, "Virtual memory enabled (Sv39, %u GiB of RAM in gigapages).",
+         (ram_end - ram_start) / GIGAPAGE_SIZE);
+}
+
+int vm_map_mmio(uint64_t pa, uint64_t len) {
+    uint64_t start = pa & ~(MEGAPAGE_SIZE - 1);
+    uint64_t end = (pa + len + MEGAPAGE_SIZE - 1) & ~(MEGAPAGE_SIZE - 1);
+    for (uint64_t a = start; a < end; a += MEGAPAGE_SIZE) {
+        if (vm_walk(kernel_pagetable, a, NULL)) {
+            continue;
+        }
+        if (vm_map_range(kernel_pagetable, a, a, MEGAPAGE_SIZE,
+                         PTE_R | PTE_W | PTE_A | PTE_D | PTE_G) != 0) {
+            return -1;
+        }
+        // vm_create_user_pagetable() shares only global top-level slots, so
+        // a table created here is marked global too.
+        kernel_pagetable[VPN(a, 2)] |= PTE_G;
+        // Translation may already be on; the hart may have cached the hole.
+        sfence_vma_all();
+    }
+    return 0;
+}
+
+void vm_switch_kernel(void) {
+    w_satp(SATP_MODE_SV39 | ((uint64_t)ASID_KERNEL << SATP_ASID_SHIFT) |
+           ((uint64_t)kernel_pagetable >> 12));
+    if (asid_max == 0) {
+        // Without ASIDs the user translations would still match.
+        sfence_vma_all();
+    }
+}
+
+void vm_init_hart(void) {
+    uint64_t satp = SATP_MODE_SV39 | ((uint64_t)ASID_KERNEL << SATP_ASID_SHIFT) |
+                    ((uint64_t)kernel_pagetable >> 12);
+    w_satp(satp);
+    sfence_vma_all();
+    asid_hart_generation[cpuid()] = __atomic_load_n(&asid_generation, __ATOMIC_ACQUIRE);
 }
@@ -5,24 +5,157 @@
 #include "mem.h"
 
 #define PAGE_SIZE 4096
+#define MEGAPAGE_SIZE (2UL * 1024 * 1024)    // Level-1 leaf (2 MiB).
+#define GIGAPAGE_SIZE (1024UL * 1024 * 1024) // Level-2 leaf (1 GiB).
 
 // Sv39 Page Table Entry flags.
 #define PTE_V (1UL << 0) // Valid
 #define PTE_R (1UL << 1) // Read
 #define PTE_W (1UL << 2) // Write
 #define PTE_X (1UL << 3) // Execute
+#define PTE_U (1UL << 4) // User accessible
+#define PTE_G (1UL << 5) // Global (present in every address space)
+#define PTE_A (1UL << 6) // Accessed
+#define PTE_D (1UL << 7) // Dirty
+#define PTE_OWNED  (1UL << 8) // RSW: frame belongs to this mapping and is freed on unmap
+#define PTE_COW    (1UL << 9) // RSW, with PTE_OWNED: read-only copy-on-write share
+#define PTE_SHARED (1UL << 9) // RSW, without PTE_OWNED: deliberately shared frame (IPC grants)
+
+// Leaves whose frame is reference-counted and released with the last mapping.
+#define PTE_REFCOUNTED(pte) (((pte) & (PTE_OWNED | PTE_SHARED)) != 0)
+// Leaves that a store must copy first.
+#define PTE_IS_COW(pte)     (((pte) & (PTE_OWNED | PTE_COW)) == (PTE_OWNED | PTE_COW))
+
+// User-visible Sv39 range (lower half); vm_destroy() tears down all of it.
+#define VM_USER_END (1UL << 38)
+
+// PTE <-> physical address conversion.
+#define PTE2PA(pte) (((pte) >> 10) << 12)
+#define PA2PTE(pa)  (((pa) >> 12) << 10)
 
 typedef uint64_t* pagetable_t;
 
+// ASID used by the kernel page table. User address spaces get ASIDs from 1 up.
+#define ASID_KERNEL 0
+
+// Passed for an address space no TLB can still hold entries for: skip the flush.
+#define ASID_NONE (~0UL)
+
+// Root page table of the kernel address space, set up by enable_virtual_memory().
+extern pagetable_t kernel_pagetable;
+
 /*
  * Create a new pagetable by allocating a zeroed page.
  */
 pagetable_t vm_create_pagetable(void);
 
+/*
+ * Create the root page table of a user address space.
+ * The kernel's global top-level entries are shared into it, so the kernel
+ * stays mapped (and its TLB entries stay valid) across address-space switches.
+ */
+pagetable_t vm_create_user_pagetable(void);
+
 /*
  * Map a virtual address 'va' to a physical address 'pa' with provided flags in the page table 'root'.
- * Implements a 3-level Sv39 walk.
+ * Implements a 3-level Sv39 walk. Returns 0, or -1 if a page table could not be allocated.
+ */
+int vm_map(pagetable_t root, uint64_t va, uint64_t pa, uint64_t flags);
+
+/*
+ * Look up the leaf PTE that translates 'va' in 'root'.
+ * Returns a pointer to it (and its level in '*level' if non-NULL), or NULL if unmapped.
+ */
+uint64_t *vm_walk(pagetable_t root, uint64_t va, int *level);
+
+/*
+ * Map 'len' bytes at 'va' to 'pa'. All three must be page-aligned.
+ * Uses 1 GiB and 2 MiB leaves wherever va and pa are aligned for them and
+ * falls back to 4 KiB pages at the edges. Returns 0, or -1 on failure.
+ */
+int vm_map_range(pagetable_t root, uint64_t va, uint64_t pa, uint64_t len, uint64_t flags);
+
+/*
+ * Remove all mappings in [va, va + len), widened to whole pages. Superpages
+ * that straddle the range boundary are split so the part outside stays
+ * mapped, intermediate tables left empty are freed, and reference-counted
+ * frames (PTE_OWNED or PTE_SHARED) drop a reference and are released when it
+ * was the last one.
+ * TLB invalidation for 'asid' is deferred to one flush after the walk, and
+ * all freed frames go back to the allocator in a single batch after it.
+ * Returns 0, or -1 if a split could not allocate a page table.
+ */
+int vm_unmap_range(pagetable_t root, uint64_t va, uint64_t len, uint64_t asid);
+
+/*
+ * Clone the user mappings of 'src' into the empty user root 'dst' for fork.
+ * Owned frames are shared rather than copied: writable leaves lose PTE_W and
+ * gain PTE_COW in both tables, and each shared frame gains a reference.
+ * PTE_SHARED leaves are copied as they are, writable ones included.
+ * The caller must flush the source ASID afterwards. Returns 0, or -1 when
+ * out of memory (dst may then hold a partial copy for vm_destroy()).
+ */
+int vm_fork(pagetable_t src, pagetable_t dst);
+
+/*
+ * Tear down a user address space: every non-global mapping, owned frame and
+ * page table including 'root' itself, with one TLB flush for 'asid'
+ * (none for ASID_NONE).
+ */
+void vm_destroy(pagetable_t root, uint64_t asid);
+
+/*
+ * Return the hardware ASID for an address space whose ASID context is '*ctx'
+ * (0 for a new address space). A context from an older generation is given a
+ * fresh ASID; when the ASID space runs out the generation rolls over.
+ */
+uint64_t vm_asid_get(uint64_t *ctx);
+
+/*
+ * Return the hardware ASID held by the context 'ctx' without allocating one,
+ * or ASID_NONE if it is from an older generation (or was never assigned):
+ * the rollover already made every hart flush those entries.
+ */
+uint64_t vm_asid_peek(uint64_t ctx);
+
+/*
+ * Switch this hart to the address space 'root', using (and if needed
+ * refreshing) its ASID context. No TLB flush is needed on the common path,
+ * and nothing is written when satp already holds this address space.
+ */
+void vm_switch(pagetable_t root, uint64_t *asid_ctx);
+
+/*
+ * Flush the translation of 'va' tagged with 'asid' from this hart's TLB.
+ * Other harts are not told: the scheduler flushes a process's ASID when it
+ * arrives on a hart other than the one it last ran on.
+ */
+void vm_flush_page(uint64_t va, uint64_t asid);
+
+// Flush every non-global translation tagged with 'asid' from this hart's TLB.
+void vm_flush_asid(uint64_t asid);
+
+/*
+ * Build the kernel page table (identity-mapped with gigapages) and enable Sv39.
+ * [ram_base, ram_base + ram_size) is RAM as found at boot; it must lie above
+ * the low gigabyte and inside the lower half of the Sv39 space.
+ */
+void enable_virtual_memory(uint64_t ram_base, uint64_t ram_size);
+
+/*
+ * Identity-map a device register window outside the low gigabyte into the
+ * kernel address space, in 2 MiB pieces. Parts already mapped are left
+ * alone. Call at boot, before the first user page table is created.
+ */
+int vm_map_mmio(uint64_t pa, uint64_t len);
+
+// Turn on translation with the kernel page table on a secondary hart.
+void vm_init_hart(void);
+
+/*
+ * Move this hart onto the kernel page table, for the idle loop, so that no
+ * user page table it might outlive stays installed.
  */
-void vm_map(pagetable_t root, uint64_t va, uint64_t pa, uint64_t flags);
+void vm_switch_kernel(void);
 
 #endif // VM_H
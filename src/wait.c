@@ -0,0 +1,75 @@
+#include "wait.h"
+#include "proc.h"
+#include "sched.h"
+#include "smp.h"
+#include <stddef.h>
+#include <stdint.h>
+
+void wait_queue_init(struct wait_queue *wq) {
+    wq->lock.locked = 0;
+    wq->head = wq->tail = NULL;
+}
+
+// Caller holds wq->lock.
+static void wait_unlink(struct wait_queue *wq, struct wait_entry *w) {
+    if (w->prev) {
+        w->prev->next = w->next;
+    } else {
+        wq->head = w->next;
+    }
+    if (w->next) {
+        w->next->prev = w->prev;
+    } else {
+        wq->tail = w->prev;
+    }
+    w->next = w->prev = NULL;
+}
+
+int wait_queue_sleep(struct wait_queue *wq, uint64_t key, uint64_t deadline, uint64_t flags) {
+    struct wait_entry w;
+    w.proc = mycpu()->proc;
+    w.key = key;
+    w.woken = 0;
+    w.next = NULL;
+    w.prev = wq->tail;
+    if (wq->tail) {
+        wq->tail->next = &w;
+    } else {
+        wq->head = &w;
+    }
+    wq->tail = &w;
+
+    sched_block(&wq->lock, deadline);
+
+    // Timed out (or woken by something else): the entry may still be linked.
+    spin_lock(&wq->lock);
+    int woken = w.woken;
+    if (!woken) {
+        wait_unlink(wq, &w);
+    }
+    spin_unlock_irqrestore(&wq->lock, flags);
+    return woken ? 0 : -1;
+}
+
+/*
+ * The entry is unlinked and marked before the wakeup, all under the lock,
+ * so the sleeper never sees its entry (on its stack) touched after it
+ * takes the lock back.
+ */
+uint32_t wait_queue_wake(struct wait_queue *wq, uint64_t key, uint32_t n) {
+    uint32_t woken = 0;
+    uint64_t flags = spin_lock_irqsave(&wq->lock);
+    struct wait_entry *w = wq->head;
+    while (w && woken < n) {
+        struct wait_entry *next = w->next;
+        if (w->key == key) {
+            wait_unlink(wq, w);
+            w->woken = 1;
+            sched_wakeup(w->proc);
+            woken++;
+        }
+        w = next;
+    }
+    spin_unlock_irqrestore(&wq->lock, flags);
+    return woken;
+}
@@ -0,0 +1,46 @@
+#ifndef WAIT_H
+#define WAIT_H
+
+#include <stdint.h>
+#include "spinlock.h"
+
+struct proc;
+
+/*
+ * Wait queues: processes sleeping until another one wakes them.
+ *
+ * Each sleeper links an entry that lives on its own kernel stack, tagged
+ * with a key so that one queue can be shared by unrelated events (the
+ * futex hash buckets). Sleepers use no CPU at all; a wakeup puts them
+ * straight onto a run queue.
+ */
+struct wait_entry {
+    struct proc *proc;
+    uint64_t key;
+    int woken;                  // Set (under the queue lock) by the waker.
+    struct wait_entry *next;
+    struct wait_entry *prev;
+};
+
+struct wait_queue {
+    struct spinlock lock;
+    struct wait_entry *head;    // Oldest sleeper first.
+    struct wait_entry *tail;
+};
+
+// A zero-filled wait_queue is also a valid empty one.
+void wait_queue_init(struct wait_queue *wq);
+
+/*
+ * Sleep the current process on 'wq' under 'key' until a wakeup for that key
+ * or, unless it is TIMER_NEVER, until 'deadline'. Called with wq->lock taken
+ * by spin_lock_irqsave(), which returned 'flags', so that the caller can
+ * check its condition first; returns with the lock released and interrupts
+ * restored. Returns 0 if woken, -1 on timeout.
+ */
+int wait_queue_sleep(struct wait_queue *wq, uint64_t key, uint64_t deadline, uint64_t flags);
+
+// Wake up to 'n' processes sleeping on 'wq' under 'key', oldest first. Returns how many.
+uint32_t wait_queue_wake(struct wait_queue *wq, uint64_t key, uint32_t n);
+
+#endif // WAIT_H
@@ -0,0 +1,151 @@
+#!/usr/bin/env python3
+"""
+Decode a Chimera profiler dump (SYS_PROF / PROF_OP_DUMP) and print a flat
+profile symbolized against the kernel ELF, plus per-cause trap statistics.
+
+Usage:
+    prof_symbolize.py chimera.elf console.log [--nm riscv-none-elf-nm] [--top N]
+
+'console.log' is the raw serial output, e.g. from
+    qemu-system-riscv64 ... -serial file:console.log
+Console text around the binary chunks is skipped. The chunk layout is
+described in src/prof.h and must match PROF_VERSION below.
+"""
+import argparse
+import bisect
+import collections
+import os
+import struct
+import subprocess
+import sys
+
+PROF_MAGIC = 0x46525043
+PROF_VERSION = 1
+PROF_NCAUSE = 32
+PROF_BUCKETS = 32
+
+CHUNK_SAMPLES, CHUNK_TRAPS, CHUNK_END = 1, 2, 3
+
+CHUNK = struct.Struct("<IBBBBII")
+SAMPLE = struct.Struct("<QIB3x")
+TRAPS = struct.Struct("<Q%dQ%dQ%dI" % (PROF_NCAUSE, PROF_NCAUSE, PROF_NCAUSE * PROF_BUCKETS))
+
+EXC_NAMES = {
+    0: "inst_misaligned", 1: "inst_access", 2: "illegal_inst", 3: "breakpoint",
+    4: "load_misaligned", 5: "load_access", 6: "store_misaligned", 7: "store_access",
+    8: "ecall_u", 9: "ecall_s", 12: "inst_page_fault", 13: "load_page_fault",
+    15: "store_page_fault",
+}
+IRQ_NAMES = {1: "s_software", 5: "s_timer", 9: "s_external"}
+
+
+def cause_name(idx):
+    half = PROF_NCAUSE // 2
+    if idx < half:
+        return EXC_NAMES.get(idx, "exc_%d" % idx)
+    return IRQ_NAMES.get(idx - half, "irq_%d" % (idx - half))
+
+
+def parse_chunks(data):
+    """Yield (type, hart, count, payload) for every well-formed chunk."""
+    magic = struct.pack("<I", PROF_MAGIC)
+    pos = 0
+    while True:
+        pos = data.find(magic, pos)
+        if pos < 0 or pos + CHUNK.size > len(data):
+            return
+        _, version, ctype, hart, _, length, count = CHUNK.unpack_from(data, pos)
+        end = pos + CHUNK.size + length
+        if version != PROF_VERSION or end > len(data):
+            pos += 1
+            continue
+        yield ctype, hart, count, data[pos + CHUNK.size:end]
+        pos = end
+
+
+def load_symbols(nm, elf):
+    out = subprocess.run([nm, "-n", "--defined-only", elf], check=True,
+                         capture_output=True, text=True).stdout
+    addrs, names = [], []
+    for line in out.splitlines():
+        parts = line.split()
+        if len(parts) == 3 and parts[1] in "TtWw":
+            addrs.append(int(parts[0], 16))
+            names.append(parts[2])
+    return addrs, names
+
+
+def symbolize(addrs, names, pc):
+    i = bisect.bisect_right(addrs, pc) - 1
+    return names[i] if i >= 0 else "0x%x" % pc
+
+
+def bucket_percentile(hist, frac):
+    total = sum(hist)
+    seen = 0
+    for b, n in enumerate(hist):
+        seen += n
+        if seen >= total * frac:
+            return 1 << (b + 1)
+    return 0
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    ap.add_argument("elf")
+    ap.add_argument("log")
+    ap.add_argument("--nm", default=os.environ.get("NM", "riscv-none-elf-nm"))
+    ap.add_argument("--top", type=int, default=30)
+    args = ap.parse_args()
+
+    with open(args.log, "rb") as f:
+        data = f.read()
+    addrs, names = load_symbols(args.nm, args.elf)
+
+    samples = []
+    traps = {}
+    for ctype, hart, count, payload in parse_chunks(data):
+        if ctype == CHUNK_SAMPLES:
+            for i in range(count):
+                pc, pid, mode = SAMPLE.unpack_from(payload, i * SAMPLE.size)
+                samples.append((hart, pc, pid, mode))
+        elif ctype == CHUNK_TRAPS:
+            traps[hart] = TRAPS.unpack(payload)
+        elif ctype == CHUNK_END:
+            break
+    if not samples and not traps:
+        sys.exit("no profile chunks found in %s" % args.log)
+
+    flat = collections.Counter()
+    modes = collections.Counter()
+    for hart, pc, pid, mode in samples:
+        flat[(symbolize(addrs, names, pc), "U" if mode == 0 else "K")] += 1
+        modes["user" if mode == 0 else "kernel"] += 1
+    total = len(samples)
+    print("samples: %d (%s)" % (total, ", ".join("%s %d" % kv for kv in sorted(modes.items()))))
+    print("%7s %6s  %s  %s" % ("samples", "%", "M", "symbol"))
+    for (sym, mode), n in flat.most_common(args.top):
+        print("%7d %6.2f  %s  %s" % (n, 100.0 * n / total, mode, sym))
+
+    print()
+    print("%-18s %10s %12s %10s %10s" % ("trap", "count", "avg_cycles", "~p50", "~p99"))
+    for idx in range(PROF_NCAUSE):
+        count = cycles = 0
+        hist = [0] * PROF_BUCKETS
+        for t in traps.values():
+            count += t[1 + idx]
+            cycles += t[1 + PROF_NCAUSE + idx]
+            base = 1 + 2 * PROF_NCAUSE + idx * PROF_BUCKETS
+            for b in range(PROF_BUCKETS):
+                hist[b] += t[base + b]
+        if count:
+            print("%-18s %10d %12d %10d %10d" % (cause_name(idx), count, cycles // count,
+                                                 bucket_percentile(hist, 0.5),
+                                                 bucket_percentile(hist, 0.99)))
+    dropped = sum(t[0] for t in traps.values())
+    if dropped:
+        print("\n%d samples dropped (buffers full)" % dropped)
+
+
+if __name__ == "__main__":
+    main()